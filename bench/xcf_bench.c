@@ -0,0 +1,414 @@
+// end-to-end throughput of writing XCF files. every combination of pattern, precision, channel count, compression
+// (with every zlib level asked for) and size is written and the results are printed as one JSON document.
+// usage: xcf_bench [-s sizes] [-r repeats] [-j threads] [-z levels] [-o file]
+
+#include "xcf.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef XCF_BENCH_VERSION
+#define XCF_BENCH_VERSION "unknown"
+#endif
+
+#define MAX_SIZES 16
+#define MAX_LEVELS 16
+
+typedef enum pattern_t
+{
+  PATTERN_NOISE,
+  PATTERN_GRADIENT,
+  PATTERN_FLAT,
+  PATTERN_SPARSE_ALPHA,
+  PATTERN_MIXED,
+  N_PATTERNS
+} pattern_t;
+
+static const char *pattern_names[N_PATTERNS] = { "noise", "gradient", "flat", "sparse_alpha", "mixed" };
+
+static const xcf_precision_t precisions[] = {
+  XCF_PRECISION_I_8_L,  XCF_PRECISION_I_8_G,  XCF_PRECISION_I_16_L, XCF_PRECISION_I_16_G, XCF_PRECISION_I_32_L,
+  XCF_PRECISION_I_32_G, XCF_PRECISION_F_16_L, XCF_PRECISION_F_16_G, XCF_PRECISION_F_32_L, XCF_PRECISION_F_32_G,
+  XCF_PRECISION_F_64_L, XCF_PRECISION_F_64_G,
+};
+
+static const xcf_prop_compression_t compressions[] = { XCF_PROP_COMPRESSION_NONE, XCF_PROP_COMPRESSION_ZLIB };
+
+
+// memory used by libxcf, counted through the allocator hooks. every block has its size in front of it
+
+static size_t lib_current = 0, lib_peak = 0;
+
+typedef union header_t
+{
+  size_t size;
+  // keep the memory after it aligned
+  long double align_float;
+  long long align_int;
+  void *align_pointer;
+} header_t;
+
+static void *count_malloc(size_t size, void *user)
+{
+  (void)user;
+  header_t *header = (header_t *)malloc(sizeof(header_t) + size);
+  if(!header) return NULL;
+  header->size = size;
+  lib_current += size;
+  if(lib_current > lib_peak) lib_peak = lib_current;
+  return header + 1;
+}
+
+static void count_free(void *ptr, void *user)
+{
+  (void)user;
+  if(!ptr) return;
+  header_t *header = (header_t *)ptr - 1;
+  lib_current -= header->size;
+  free(header);
+}
+
+static void *count_realloc(void *ptr, size_t size, void *user)
+{
+  if(!ptr) return count_malloc(size, user);
+  header_t *header = (header_t *)ptr - 1;
+  const size_t old_size = header->size;
+  header = (header_t *)realloc(header, sizeof(header_t) + size);
+  if(!header) return NULL;
+  header->size = size;
+  lib_current = lib_current - old_size + size;
+  if(lib_current > lib_peak) lib_peak = lib_current;
+  return header + 1;
+}
+
+
+// synthetic pixel data
+
+static int precision_size(const xcf_precision_t precision)
+{
+  switch(precision / 100)
+  {
+    case 1: return 1;
+    case 2: return 2;
+    case 3: return 4;
+    case 5: return 2;
+    case 6: return 4;
+    case 7: return 8;
+    default: return 0;
+  }
+}
+
+static uint16_t float_to_half(const float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const int32_t exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+  const uint32_t mantissa = bits & 0x7fffff;
+  if(exponent <= 0) return sign; // the values here are in [0, 1], denormals don't matter
+  if(exponent >= 31) return sign | 0x7c00;
+  return sign | (exponent << 10) | (mantissa >> 13);
+}
+
+static void store(uint8_t *dest, const float value, const xcf_precision_t precision)
+{
+  switch(precision / 100)
+  {
+    case 1: *dest = (uint8_t)lrintf(value * 255.0f); break;
+    case 2: { const uint16_t v = (uint16_t)lrintf(value * 65535.0f); memcpy(dest, &v, sizeof(v)); break; }
+    case 3: { const uint32_t v = (uint32_t)llrint(value * 4294967295.0); memcpy(dest, &v, sizeof(v)); break; }
+    case 5: { const uint16_t v = float_to_half(value); memcpy(dest, &v, sizeof(v)); break; }
+    case 6: memcpy(dest, &value, sizeof(value)); break;
+    case 7: { const double v = value; memcpy(dest, &v, sizeof(v)); break; }
+  }
+}
+
+static uint32_t xorshift(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static uint8_t *generate(const pattern_t pattern, const uint32_t width, const uint32_t height, const int channels,
+                         const xcf_precision_t precision)
+{
+  const int channel_size = precision_size(precision);
+  uint8_t *data = (uint8_t *)malloc((size_t)width * height * channels * channel_size);
+  if(!data) return NULL;
+
+  const int has_alpha = (channels == 2 || channels == 4);
+  uint32_t state = 0x12345678;
+  uint8_t *p = data;
+  for(uint32_t y = 0; y < height; y++)
+    for(uint32_t x = 0; x < width; x++)
+    {
+      // sparse alpha has small opaque blobs on an otherwise transparent layer
+      const int inside = ((x / 8) % 16 == 0) && ((y / 8) % 16 == 0);
+      // mixed has blocks of flat color, of something like a photo (a gradient with a little noise) and of noise
+      const int block = (x / 96 + y / 96 * 2) % 3;
+      for(int c = 0; c < channels; c++, p += channel_size)
+      {
+        const int is_alpha = has_alpha && c == channels - 1;
+        float value = 0.0f;
+        switch(pattern)
+        {
+          case PATTERN_NOISE:
+            value = is_alpha ? 1.0f : (xorshift(&state) >> 8) / 16777215.0f;
+            break;
+          case PATTERN_GRADIENT:
+            value = is_alpha ? 1.0f : (c % 2 ? (float)x / width : (float)y / height);
+            break;
+          case PATTERN_FLAT:
+            value = is_alpha ? 1.0f : 0.25f * (c + 1);
+            break;
+          case PATTERN_SPARSE_ALPHA:
+            value = inside ? (is_alpha ? 1.0f : (float)x / width) : 0.0f;
+            break;
+          case PATTERN_MIXED:
+            if(is_alpha) value = 1.0f;
+            else if(block == 0) value = 0.25f * (c + 1);
+            else if(block == 1)
+              value = 0.05f + 0.8f * (c % 2 ? (float)x / width : (float)y / height) + (xorshift(&state) >> 8) / 16777215.0f * 0.1f;
+            else value = (xorshift(&state) >> 8) / 16777215.0f;
+            break;
+          default:
+            break;
+        }
+        store(p, value, precision);
+      }
+    }
+  return data;
+}
+
+
+// one run
+
+typedef struct result_t
+{
+  double seconds;
+  uint64_t output_bytes;
+  int ok;
+} result_t;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static result_t write_file(const char *filename, const uint8_t *data, const uint32_t width, const uint32_t height,
+                           const int channels, const xcf_precision_t precision,
+                           const xcf_prop_compression_t compression, const int level)
+{
+  result_t result = { 0.0, 0, 0 };
+  const double start = now();
+
+  XCF *xcf = xcf_open(filename);
+  if(!xcf) return result;
+  xcf_set(xcf, XCF_BASE_TYPE, channels >= 3 ? XCF_BASE_TYPE_RGB : XCF_BASE_TYPE_GRAYSCALE);
+  xcf_set(xcf, XCF_WIDTH, width);
+  xcf_set(xcf, XCF_HEIGHT, height);
+  xcf_set(xcf, XCF_PRECISION, precision);
+  xcf_set(xcf, XCF_N_LAYERS, 1);
+  // the only layer is the base layer, it only gets alpha when asked for it
+  xcf_set(xcf, XCF_OMIT_BASE_ALPHA, !(channels == 2 || channels == 4));
+  xcf_set(xcf, XCF_PROP, XCF_PROP_COMPRESSION, compression);
+  xcf_set(xcf, XCF_ZLIB_LEVEL, level);
+  xcf_add_layer(xcf);
+  xcf_set(xcf, XCF_WIDTH, width);
+  xcf_set(xcf, XCF_HEIGHT, height);
+  xcf_set(xcf, XCF_NAME, "bench");
+  xcf_add_data(xcf, data, channels);
+  result.ok = xcf_close(xcf);
+
+  result.seconds = now() - start;
+
+  FILE *fd = fopen(filename, "rb");
+  if(fd)
+  {
+    fseek(fd, 0, SEEK_END);
+    result.output_bytes = ftell(fd);
+    fclose(fd);
+  }
+  return result;
+}
+
+static long peak_rss_kb(void)
+{
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+  return usage.ru_maxrss;
+}
+
+static int parse_sizes(const char *arg, uint32_t *sizes)
+{
+  int n = 0;
+  char *end;
+  while(*arg && n < MAX_SIZES)
+  {
+    const long size = strtol(arg, &end, 10);
+    if(end == arg || size < 1) return 0;
+    sizes[n++] = size;
+    arg = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+// levels of zlib: 0 - 9, default or adaptive
+static int parse_levels(const char *arg, int *levels)
+{
+  int n = 0;
+  char *end;
+  while(*arg && n < MAX_LEVELS)
+  {
+    if(!strncmp(arg, "default", 7))
+    {
+      levels[n++] = XCF_ZLIB_LEVEL_DEFAULT;
+      end = (char *)arg + 7;
+    }
+    else if(!strncmp(arg, "adaptive", 8))
+    {
+      levels[n++] = XCF_ZLIB_LEVEL_ADAPTIVE;
+      end = (char *)arg + 8;
+    }
+    else
+    {
+      const long level = strtol(arg, &end, 10);
+      if(end == arg || level < 0 || level > 9) return 0;
+      levels[n++] = level;
+    }
+    if(*end != ',' && *end != '\0') return 0;
+    arg = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+static const char *level_name(const int level, char *buffer)
+{
+  if(level == XCF_ZLIB_LEVEL_DEFAULT) return "default";
+  if(level == XCF_ZLIB_LEVEL_ADAPTIVE) return "adaptive";
+  sprintf(buffer, "%d", level);
+  return buffer;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-s sizes] [-r repeats] [-j threads] [-z levels] [-o file]\n"
+                  "  -s sizes    comma separated list of image sizes, the images are square. default: 256,1024\n"
+                  "  -r repeats  write every file this many times and report the fastest. default: 3\n"
+                  "  -j threads  start the scheduler with this many threads. default: 0, no scheduler\n"
+                  "  -z levels   comma separated list of zlib levels: 0 - 9, default or adaptive. default: default\n"
+                  "  -o file     the file that is written over and over. default: xcf_bench.xcf\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t sizes[MAX_SIZES] = { 256, 1024 };
+  int levels[MAX_LEVELS] = { XCF_ZLIB_LEVEL_DEFAULT };
+  int n_sizes = 2, n_levels = 1, repeats = 3, n_threads = 0;
+  const char *filename = "xcf_bench.xcf";
+  int opt;
+  while((opt = getopt(argc, argv, "s:r:j:z:o:")) != -1)
+  {
+    switch(opt)
+    {
+      case 's':
+        if(!(n_sizes = parse_sizes(optarg, sizes)))
+        {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'z':
+        if(!(n_levels = parse_levels(optarg, levels)))
+        {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'r': repeats = atoi(optarg); break;
+      case 'j': n_threads = atoi(optarg); break;
+      case 'o': filename = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(repeats < 1) repeats = 1;
+
+  const xcf_allocator_t allocator = { count_malloc, count_realloc, count_free, NULL };
+  xcf_set_allocator(&allocator);
+  if(n_threads > 0 && !xcf_scheduler_start(n_threads, NULL, 0)) return 1;
+
+  printf("{\"version\":\"%s\",\"threads\":%d,\"repeats\":%d,\"runs\":[", XCF_BENCH_VERSION,
+         xcf_scheduler_threads(), repeats);
+  int first = 1, failed = 0;
+
+  for(int s = 0; s < n_sizes; s++)
+    for(int pattern = 0; pattern < N_PATTERNS; pattern++)
+      for(size_t p = 0; p < sizeof(precisions) / sizeof(precisions[0]); p++)
+        for(int channels = 1; channels <= 4; channels++)
+        {
+          const uint32_t size = sizes[s];
+          const xcf_precision_t precision = precisions[p];
+          uint8_t *data = generate((pattern_t)pattern, size, size, channels, precision);
+          if(!data)
+          {
+            fprintf(stderr, "error: out of memory\n");
+            return 1;
+          }
+          const uint64_t input_bytes = (uint64_t)size * size * channels * precision_size(precision);
+          const uint64_t n_tiles = (uint64_t)((size + 63) / 64) * ((size + 63) / 64);
+
+          for(size_t c = 0; c < sizeof(compressions) / sizeof(compressions[0]); c++)
+          for(int l = 0; l < (compressions[c] == XCF_PROP_COMPRESSION_ZLIB ? n_levels : 1); l++)
+          {
+            const int level = compressions[c] == XCF_PROP_COMPRESSION_ZLIB ? levels[l] : XCF_ZLIB_LEVEL_DEFAULT;
+            char level_buffer[16];
+            result_t best = { 0.0, 0, 0 };
+            lib_peak = lib_current;
+            for(int r = 0; r < repeats; r++)
+            {
+              const result_t result = write_file(filename, data, size, size, channels, precision, compressions[c],
+                                                 level);
+              if(!result.ok)
+              {
+                best = result;
+                break;
+              }
+              if(r == 0 || result.seconds < best.seconds) best = result;
+            }
+            if(!best.ok) failed = 1;
+
+            const double seconds = best.seconds > 0.0 ? best.seconds : 1e-9;
+            printf("%s\n{\"pattern\":\"%s\",\"precision\":\"%s\",\"channels\":%d,\"compression\":\"%s\","
+                   "\"zlib_level\":\"%s\",\"width\":%" PRIu32 ",\"height\":%" PRIu32 ",\"ok\":%s,\"seconds\":%.6f,\"mb_per_s\":%.2f,"
+                   "\"tiles_per_s\":%.0f,\"input_bytes\":%" PRIu64 ",\"output_bytes\":%" PRIu64 ",\"ratio\":%.4f,"
+                   "\"peak_rss_kb\":%ld,\"lib_peak_bytes\":%zu}",
+                   first ? "" : ",", pattern_names[pattern], xcf_get_precision_name(precision), channels,
+                   xcf_get_compression_name(compressions[c]), level_name(level, level_buffer), size, size,
+                   best.ok ? "true" : "false", best.seconds, input_bytes / seconds / 1e6, n_tiles / seconds, input_bytes,
+                   best.output_bytes, (double)best.output_bytes / input_bytes, peak_rss_kb(), lib_peak);
+            fflush(stdout);
+            first = 0;
+          }
+          free(data);
+        }
+
+  printf("\n]}\n");
+
+  xcf_scheduler_stop();
+  unlink(filename);
+  return failed;
+}
@@ -0,0 +1,426 @@
+// throughput of the single stages of encoding a layer, without any file io: adapting the channels and precision
+// of the source while gathering a tile, byte swapping for every channel size, compression and encoding the tile
+// pointers. every stage runs on warm buffers, over and over, and the results are printed as one JSON document.
+// usage: xcf_stage_bench [-r repeats] [-t milliseconds] [-f filter]
+
+#include "xcf.h"
+#include "xcf_internal.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAVE_TSC
+#endif
+
+#ifndef XCF_BENCH_VERSION
+#define XCF_BENCH_VERSION "unknown"
+#endif
+
+#define N_POINTERS 4096
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static uint32_t xorshift(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+
+// the stages. every one gets a context with everything set up and returns the number of bytes it processed
+
+typedef struct context_t
+{
+  xcf_tile_encoder_t encoder;
+  size_t tile_length; // of the gathered tile, for compressing it
+
+  // for byte swapping
+  uint8_t *values, *swapped;
+  size_t n_values;
+  int channel_size;
+
+  // for pointers
+  uint64_t offsets[N_POINTERS];
+  uint8_t pointers[N_POINTERS * 8];
+  int pointer_size;
+} context_t;
+
+typedef size_t (*stage_func_t)(context_t *context);
+
+static size_t run_gather(context_t *context)
+{
+  return xcf_tile_gather(&context->encoder, 0, 0);
+}
+
+static size_t run_byteswap(context_t *context)
+{
+  xcf_copy_values_be(context->swapped, context->values, context->n_values, context->channel_size);
+  return context->n_values * context->channel_size;
+}
+
+static size_t run_compress(context_t *context)
+{
+  const uint8_t *result;
+  size_t length;
+  if(!xcf_tile_compress(&context->encoder, context->tile_length, &result, &length)) return 0;
+  return context->tile_length;
+}
+
+static size_t run_pointers(context_t *context)
+{
+  xcf_encode_pointers(context->pointers, context->pointer_size, 1024, context->offsets, N_POINTERS);
+  return (size_t)N_POINTERS * context->pointer_size;
+}
+
+
+// a single tile of source data
+
+typedef enum pattern_t
+{
+  PATTERN_NOISE,
+  PATTERN_GRADIENT,
+  PATTERN_FLAT,
+} pattern_t;
+
+static const char *pattern_names[] = { "noise", "gradient", "flat" };
+
+// fill a 64x64 tile with n_channels values per pixel. 8 bit values for integer precisions, floats between 0 and 1
+// otherwise. alpha is always last
+static void fill_tile(uint8_t *dest, const pattern_t pattern, const int channels, const xcf_precision_t precision)
+{
+  uint32_t state = 0x12345678;
+  const int channel_size = xcf_precision_size(precision);
+  for(int y = 0; y < TILE_SIZE; y++)
+    for(int x = 0; x < TILE_SIZE; x++)
+      for(int c = 0; c < channels; c++)
+      {
+        float value;
+        if(pattern == PATTERN_NOISE) value = (xorshift(&state) & 0xffff) / 65535.0f;
+        else if(pattern == PATTERN_GRADIENT) value = (x + y * (c + 1)) / (float)(TILE_SIZE * (channels + 1));
+        else value = 0.25f * (c + 1);
+        uint8_t *v = dest + (((size_t)y * TILE_SIZE + x) * channels + c) * channel_size;
+        switch(precision)
+        {
+          case XCF_PRECISION_I_8_L:
+          case XCF_PRECISION_I_8_G: *v = value * 255.0f + 0.5f; break;
+          case XCF_PRECISION_I_16_L:
+          case XCF_PRECISION_I_16_G: { const uint16_t i = value * 65535.0f + 0.5f; memcpy(v, &i, 2); break; }
+          case XCF_PRECISION_F_32_L:
+          case XCF_PRECISION_F_32_G: memcpy(v, &value, 4); break;
+          default: memset(v, 0, channel_size); break;
+        }
+      }
+}
+
+
+// measuring
+
+typedef struct measurement_t
+{
+  size_t bytes;        // per call
+  double ns_per_byte;
+  double cycles_per_byte;
+} measurement_t;
+
+// call the stage until it ran for at least min_seconds, repeats times, and keep the fastest
+static measurement_t measure(stage_func_t stage, context_t *context, const int repeats, const double min_seconds)
+{
+  measurement_t result = { 0, 0.0, 0.0 };
+  result.bytes = stage(context); // warm up
+  if(result.bytes == 0) return result;
+
+  // find the number of calls that take long enough
+  uint64_t n = 1;
+  for(;;)
+  {
+    const double start = now();
+    for(uint64_t i = 0; i < n; i++) stage(context);
+    if(now() - start >= min_seconds || n >= ((uint64_t)1 << 40)) break;
+    n *= 2;
+  }
+
+  double best_seconds = 0.0;
+  uint64_t best_cycles = 0;
+  for(int r = 0; r < repeats; r++)
+  {
+    const uint64_t start_cycles = cycles();
+    const double start = now();
+    for(uint64_t i = 0; i < n; i++) stage(context);
+    const double seconds = now() - start;
+    const uint64_t used_cycles = cycles() - start_cycles;
+    if(r == 0 || seconds < best_seconds) best_seconds = seconds;
+    if(r == 0 || used_cycles < best_cycles) best_cycles = used_cycles;
+  }
+
+  const double total_bytes = (double)n * result.bytes;
+  result.ns_per_byte = best_seconds * 1e9 / total_bytes;
+  result.cycles_per_byte = best_cycles / total_bytes;
+  return result;
+}
+
+static int repeats = 5;
+static double min_seconds = 0.05;
+static const char *filter = NULL;
+static int first = 1, failed = 0;
+
+static void report(const char *stage_name, const char *variant, stage_func_t stage, context_t *context)
+{
+  if(filter && !strstr(stage_name, filter) && !strstr(variant, filter)) return;
+
+  const measurement_t m = measure(stage, context, repeats, min_seconds);
+  if(m.bytes == 0) failed = 1;
+  printf("%s\n{\"stage\":\"%s\",\"variant\":\"%s\",\"ok\":%s,\"bytes\":%zu,\"ns_per_byte\":%.4f,\"mb_per_s\":%.1f,",
+         first ? "" : ",", stage_name, variant, m.bytes ? "true" : "false", m.bytes, m.ns_per_byte,
+         m.ns_per_byte > 0.0 ? 1e3 / m.ns_per_byte : 0.0);
+#ifdef HAVE_TSC
+  printf("\"cycles_per_byte\":%.4f}", m.cycles_per_byte);
+#else
+  printf("\"cycles_per_byte\":null}");
+#endif
+  fflush(stdout);
+  first = 0;
+}
+
+
+// the variants of gathering a tile. source is what the user passes in, the tile is written with n_channels in
+// precision
+
+typedef struct gather_variant_t
+{
+  const char *name;
+  int source_channels;
+  xcf_precision_t source_precision;
+  int n_channels;
+  xcf_precision_t precision;
+  xcf_channel_order_t order;
+  int premultiplied;
+  int planar;
+  int indexed;
+} gather_variant_t;
+
+static const gather_variant_t gather_variants[] = {
+  { "copy_u8_rgba",            4, XCF_PRECISION_I_8_G,  4, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_RGBA, 0, 0, 0 },
+  { "copy_u16_rgba",           4, XCF_PRECISION_I_16_G, 4, XCF_PRECISION_I_16_G, XCF_CHANNEL_ORDER_RGBA, 0, 0, 0 },
+  { "copy_f32_rgba",           4, XCF_PRECISION_F_32_L, 4, XCF_PRECISION_F_32_L, XCF_CHANNEL_ORDER_RGBA, 0, 0, 0 },
+  { "drop_alpha_u8",           4, XCF_PRECISION_I_8_G,  3, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_RGBA, 0, 0, 0 },
+  { "add_alpha_u8",            3, XCF_PRECISION_I_8_G,  4, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_RGBA, 0, 0, 0 },
+  { "bgra_u8",                 4, XCF_PRECISION_I_8_G,  4, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_BGRA, 0, 0, 0 },
+  { "planar_u8",               4, XCF_PRECISION_I_8_G,  4, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_RGBA, 0, 1, 0 },
+  { "premultiplied_u8",        4, XCF_PRECISION_I_8_G,  4, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_RGBA, 1, 0, 0 },
+  { "premultiplied_u16",       4, XCF_PRECISION_I_16_G, 4, XCF_PRECISION_I_16_G, XCF_CHANNEL_ORDER_RGBA, 1, 0, 0 },
+  { "premultiplied_f32",       4, XCF_PRECISION_F_32_L, 4, XCF_PRECISION_F_32_L, XCF_CHANNEL_ORDER_RGBA, 1, 0, 0 },
+  { "u8_to_f32",               4, XCF_PRECISION_I_8_L,  4, XCF_PRECISION_F_32_L, XCF_CHANNEL_ORDER_RGBA, 0, 0, 0 },
+  { "u16_to_u8",               4, XCF_PRECISION_I_16_G, 4, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_RGBA, 0, 0, 0 },
+  { "f32_linear_to_u8_gamma",  4, XCF_PRECISION_F_32_L, 4, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_RGBA, 0, 0, 0 },
+  { "palette_rgba",            4, XCF_PRECISION_I_8_G,  2, XCF_PRECISION_I_8_G,  XCF_CHANNEL_ORDER_RGBA, 0, 0, 1 },
+};
+
+static void bench_gather(context_t *context)
+{
+  const size_t max_size = (size_t)TILE_SIZE * TILE_SIZE * 4 * 8;
+  uint8_t *data = (uint8_t *)malloc(max_size);
+  uint8_t *planes = (uint8_t *)malloc(max_size);
+  xcf_palette_t palette;
+  memset(&palette, 0, sizeof(palette));
+  if(!data || !planes)
+  {
+    fprintf(stderr, "error: out of memory\n");
+    exit(1);
+  }
+
+  for(size_t v = 0; v < sizeof(gather_variants) / sizeof(gather_variants[0]); v++)
+  {
+    const gather_variant_t *variant = &gather_variants[v];
+    const int channels = variant->source_channels;
+    const int channel_size = xcf_precision_size(variant->source_precision);
+    fill_tile(data, variant->indexed ? PATTERN_FLAT : PATTERN_GRADIENT, channels, variant->source_precision);
+
+    xcf_source_t source;
+    xcf_source_init(&source, data, TILE_SIZE, channels, variant->source_precision);
+    const void *plane_pointers[4] = { NULL, NULL, NULL, NULL };
+    if(variant->planar)
+    {
+      const size_t plane_size = (size_t)TILE_SIZE * TILE_SIZE * channel_size;
+      for(int c = 0; c < channels; c++)
+      {
+        for(size_t i = 0; i < (size_t)TILE_SIZE * TILE_SIZE; i++)
+          memcpy(planes + c * plane_size + i * channel_size, data + (i * channels + c) * channel_size, channel_size);
+        plane_pointers[c] = planes + c * plane_size;
+      }
+    }
+    if(variant->indexed)
+    {
+      // all colors of the flat tile are in the palette, so this is the exact lookup
+      uint8_t colors[3] = { data[0], data[1], data[2] };
+      xcf_palette_set(&palette, colors, 1);
+      source.palette = &palette;
+    }
+    if(!xcf_source_set_memory(&source, plane_pointers, 0, TILE_SIZE)
+       || !xcf_source_set_layout(&source, variant->order, variant->premultiplied)
+       || !xcf_tile_encoder_init(&context->encoder, &source, TILE_SIZE, TILE_SIZE, variant->n_channels,
+                                 variant->precision, XCF_PROP_COMPRESSION_NONE, XCF_ZLIB_LEVEL_DEFAULT))
+    {
+      failed = 1;
+      continue;
+    }
+    report("gather", variant->name, run_gather, context);
+  }
+
+  xcf_palette_free(&palette);
+  free(planes);
+  free(data);
+}
+
+static void bench_byteswap(context_t *context)
+{
+  static const char *names[] = { NULL, "1_byte", "2_bytes", NULL, "4_bytes", NULL, NULL, NULL, "8_bytes" };
+  // a tile with 4 channels of 8 bytes is the biggest there is
+  context->n_values = (size_t)TILE_SIZE * TILE_SIZE * 4;
+  context->values = (uint8_t *)calloc(context->n_values, 8);
+  context->swapped = (uint8_t *)calloc(context->n_values, 8);
+  if(!context->values || !context->swapped)
+  {
+    fprintf(stderr, "error: out of memory\n");
+    exit(1);
+  }
+  for(int channel_size = 1; channel_size <= 8; channel_size *= 2)
+  {
+    context->channel_size = channel_size;
+    report("byteswap", names[channel_size], run_byteswap, context);
+  }
+  free(context->values);
+  free(context->swapped);
+  context->values = context->swapped = NULL;
+}
+
+static void bench_compress(context_t *context)
+{
+  static const struct { const char *name; int channels; xcf_precision_t precision; } formats[] = {
+    { "u8_rgba", 4, XCF_PRECISION_I_8_G }, { "u16_rgba", 4, XCF_PRECISION_I_16_G },
+    { "f32_rgba", 4, XCF_PRECISION_F_32_L },
+  };
+  uint8_t *data = (uint8_t *)malloc((size_t)TILE_SIZE * TILE_SIZE * 4 * 4);
+  if(!data)
+  {
+    fprintf(stderr, "error: out of memory\n");
+    exit(1);
+  }
+
+  // the default level keeps the plain name, the others get theirs appended
+  static const struct { const char *name; int level; } levels[] = {
+    { "", XCF_ZLIB_LEVEL_DEFAULT }, { "_level1", 1 }, { "_level9", 9 }, { "_adaptive", XCF_ZLIB_LEVEL_ADAPTIVE },
+  };
+
+  for(size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    for(int pattern = PATTERN_NOISE; pattern <= PATTERN_FLAT; pattern++)
+      for(size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+      {
+        fill_tile(data, (pattern_t)pattern, formats[f].channels, formats[f].precision);
+        xcf_source_t source;
+        xcf_source_init(&source, data, TILE_SIZE, formats[f].channels, formats[f].precision);
+        if(!xcf_tile_encoder_init(&context->encoder, &source, TILE_SIZE, TILE_SIZE, formats[f].channels,
+                                  formats[f].precision, XCF_PROP_COMPRESSION_ZLIB, levels[l].level)
+           || !(context->tile_length = xcf_tile_gather(&context->encoder, 0, 0)))
+        {
+          failed = 1;
+          continue;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "zlib_%s_%s%s", formats[f].name, pattern_names[pattern], levels[l].name);
+        report("compress", name, run_compress, context);
+      }
+
+  free(data);
+}
+
+static void bench_pointers(context_t *context)
+{
+  // tiles of varying sizes, like compressed ones
+  uint32_t state = 0x9e3779b9;
+  uint64_t offset = 0;
+  for(int i = 0; i < N_POINTERS; i++)
+  {
+    context->offsets[i] = offset;
+    offset += 1000 + xorshift(&state) % 16384;
+  }
+  context->pointer_size = 4;
+  report("pointers", "4_bytes", run_pointers, context);
+  context->pointer_size = 8;
+  report("pointers", "8_bytes", run_pointers, context);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-r repeats] [-t milliseconds] [-f filter]\n"
+                  "  -r repeats       measure every stage this many times and report the fastest. default: 5\n"
+                  "  -t milliseconds  the minimal duration of a measurement. default: 50\n"
+                  "  -f filter        only run stages or variants with this in their name\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  while((opt = getopt(argc, argv, "r:t:f:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'r': repeats = atoi(optarg); break;
+      case 't': min_seconds = atof(optarg) / 1000.0; break;
+      case 'f': filter = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(repeats < 1) repeats = 1;
+
+  context_t *context = (context_t *)calloc(1, sizeof(context_t));
+  if(!context)
+  {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+
+#ifdef HAVE_TSC
+  const char *clock_name = "tsc";
+#else
+  const char *clock_name = "none";
+#endif
+  printf("{\"version\":\"%s\",\"clock\":\"%s\",\"repeats\":%d,\"tile_size\":%d,\"stages\":[", XCF_BENCH_VERSION,
+         clock_name, repeats, TILE_SIZE);
+
+  bench_gather(context);
+  bench_byteswap(context);
+  bench_compress(context);
+  bench_pointers(context);
+
+  printf("\n]}\n");
+
+  xcf_tile_encoder_cleanup(&context->encoder);
+  free(context);
+  return failed;
+}
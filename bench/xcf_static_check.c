@@ -0,0 +1,217 @@
+// checks that a handle opened with xcf_open_static() doesn't allocate. every call of the allocator after opening
+// fails and is counted while 16 bit layers from float, native and provider data and a channel are written, the
+// handle is reset and the same is written again. both files have to be the same as one written by xcf_open().
+// usage: xcf_static_check [-o prefix]
+
+#include "xcf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WIDTH 300
+#define HEIGHT 200
+
+// once armed every call of the allocator fails
+static int armed = 0, calls = 0;
+
+static void *failing_malloc(size_t size, void *user)
+{
+  (void)user;
+  if(armed)
+  {
+    calls++;
+    return NULL;
+  }
+  return malloc(size);
+}
+
+static void *failing_realloc(void *ptr, size_t size, void *user)
+{
+  (void)user;
+  if(armed)
+  {
+    calls++;
+    return NULL;
+  }
+  return realloc(ptr, size);
+}
+
+static void failing_free(void *ptr, void *user)
+{
+  (void)user;
+  if(armed && ptr) calls++;
+  free(ptr);
+}
+
+// 3 channels of 16 bit, the precision of the image
+static int provide_tile(void *user, uint32_t x, uint32_t y, uint32_t width, uint32_t height, void *tile)
+{
+  (void)user;
+  memset(tile, (x + y) & 0xff, (size_t)width * height * 3 * sizeof(uint16_t));
+  return 1;
+}
+
+static int write_image(XCF *xcf, const float *floats, const uint16_t *gray)
+{
+  int ok = 1;
+  ok &= xcf_set(xcf, XCF_WIDTH, WIDTH);
+  ok &= xcf_set(xcf, XCF_HEIGHT, HEIGHT);
+  ok &= xcf_set(xcf, XCF_PRECISION, XCF_PRECISION_I_16_G);
+  ok &= xcf_set(xcf, XCF_N_LAYERS, 3);
+  ok &= xcf_set(xcf, XCF_N_CHANNELS, 1);
+
+  ok &= xcf_add_layer(xcf);
+  ok &= xcf_set(xcf, XCF_NAME, "float");
+  ok &= xcf_set(xcf, XCF_WIDTH, WIDTH);
+  ok &= xcf_set(xcf, XCF_HEIGHT, HEIGHT);
+  xcf_data_t data;
+  memset(&data, 0, sizeof(data));
+  data.data = floats;
+  data.channels = 4;
+  data.precision = XCF_PRECISION_F_32_L;
+  ok &= xcf_add_data_ex(xcf, &data);
+
+  ok &= xcf_add_layer(xcf);
+  ok &= xcf_set(xcf, XCF_NAME, "native");
+  ok &= xcf_set(xcf, XCF_WIDTH, WIDTH / 2);
+  ok &= xcf_set(xcf, XCF_HEIGHT, HEIGHT / 2);
+  ok &= xcf_add_data(xcf, gray, 1);
+
+  ok &= xcf_add_layer(xcf);
+  ok &= xcf_set(xcf, XCF_NAME, "provider");
+  ok &= xcf_set(xcf, XCF_WIDTH, 100);
+  ok &= xcf_set(xcf, XCF_HEIGHT, 70);
+  ok &= xcf_add_data_cb(xcf, provide_tile, NULL);
+
+  ok &= xcf_add_channel(xcf);
+  ok &= xcf_set(xcf, XCF_NAME, "mask");
+  ok &= xcf_add_data(xcf, gray, 1);
+  return ok;
+}
+
+static int same_files(const char *a, const char *b)
+{
+  FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+  int same = fa && fb;
+  while(same)
+  {
+    const int ca = fgetc(fa), cb = fgetc(fb);
+    if(ca != cb) same = 0;
+    if(ca == EOF) break;
+  }
+  if(fa) fclose(fa);
+  if(fb) fclose(fb);
+  return same;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-o prefix]\n"
+                  "  -o prefix  the files written are prefix-0.xcf, prefix-1.xcf and prefix-ref.xcf.\n"
+                  "             default: xcf_static_check\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prefix = "xcf_static_check";
+  int opt;
+  while((opt = getopt(argc, argv, "o:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'o': prefix = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  const size_t prefix_length = strlen(prefix);
+  char *filenames[3];
+  static const char *suffixes[3] = { "-0.xcf", "-1.xcf", "-ref.xcf" };
+  for(int i = 0; i < 3; i++)
+  {
+    if(!(filenames[i] = malloc(prefix_length + strlen(suffixes[i]) + 1)))
+    {
+      fprintf(stderr, "error: out of memory\n");
+      return 1;
+    }
+    sprintf(filenames[i], "%s%s", prefix, suffixes[i]);
+  }
+
+  float *floats = malloc(sizeof(float) * WIDTH * HEIGHT * 4);
+  uint16_t *gray = malloc(sizeof(uint16_t) * WIDTH * HEIGHT);
+  if(!floats || !gray)
+  {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  for(int i = 0; i < WIDTH * HEIGHT * 4; i++) floats[i] = (i % 977) / 977.0f;
+  for(int i = 0; i < WIDTH * HEIGHT; i++) gray[i] = (uint16_t)(i * 7);
+
+  const xcf_allocator_t allocator = { failing_malloc, failing_realloc, failing_free, NULL };
+  xcf_set_allocator(&allocator);
+
+  // the names of the file, the layers and the channel, with room to spare
+  const xcf_static_desc_t desc = { WIDTH, HEIGHT, XCF_PRECISION_I_16_G, 4, prefix_length + 256 };
+  const size_t size = xcf_scratch_size(&desc);
+  // one more byte to hand out memory that isn't aligned
+  uint8_t *memory = size ? malloc(size + 1) : NULL;
+  if(!memory)
+  {
+    fprintf(stderr, "error: can't get %zu bytes for the static handle\n", size);
+    return 1;
+  }
+
+  int failed = 0;
+  armed = 1;
+  XCF *xcf = xcf_open_static(filenames[0], memory + 1, size, &desc);
+  if(!xcf)
+  {
+    fprintf(stderr, "error: can't open '%s'\n", filenames[0]);
+    failed = 1;
+  }
+  else
+  {
+    if(!write_image(xcf, floats, gray)) failed = 1;
+    if(!xcf_reset(xcf, filenames[1])) failed = 1;
+    if(!write_image(xcf, floats, gray)) failed = 1;
+    if(!xcf_close(xcf)) failed = 1;
+  }
+  armed = 0;
+  free(memory);
+  if(calls > 0)
+  {
+    fprintf(stderr, "error: the static handle called the allocator %d times\n", calls);
+    failed = 1;
+  }
+
+  // the same with a normal handle, both files have to match it
+  xcf = xcf_open(filenames[2]);
+  const int written = xcf && write_image(xcf, floats, gray);
+  if(!xcf || !xcf_close(xcf) || !written)
+  {
+    fprintf(stderr, "error: can't write '%s'\n", filenames[2]);
+    failed = 1;
+  }
+  for(int i = 0; i < 2; i++)
+    if(!failed && !same_files(filenames[i], filenames[2]))
+    {
+      fprintf(stderr, "error: '%s' isn't the same as '%s'\n", filenames[i], filenames[2]);
+      failed = 1;
+    }
+
+  printf("%s\n", failed ? "failed" : "ok");
+
+  for(int i = 0; i < 3; i++)
+  {
+    unlink(filenames[i]);
+    free(filenames[i]);
+  }
+  free(floats);
+  free(gray);
+  return failed;
+}
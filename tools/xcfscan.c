@@ -0,0 +1,386 @@
+// walk directories and print the metadata of all XCF files found as JSON, one object per line.
+// usage: xcfscan [-j threads] [-p] [-a] [-i] path...
+
+#include "xcf.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define QUEUE_SIZE 1024
+
+// a bounded queue of file names. the main thread walks the directories and pushes, the workers pop
+typedef struct queue_t
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty, not_full;
+  char *paths[QUEUE_SIZE];
+  size_t head, count;
+  int done;
+} queue_t;
+
+typedef struct options_t
+{
+  int flags;
+  int only_xcf_suffix;
+} options_t;
+
+static queue_t queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, { 0 }, 0, 0, 0 };
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static options_t options = { XCF_SCAN_LAYERS, 1 };
+static int failed; // set when anything couldn't be read, it's the exit status
+
+static void set_failed(void)
+{
+  pthread_mutex_lock(&output_mutex);
+  failed = 1;
+  pthread_mutex_unlock(&output_mutex);
+}
+
+static void queue_push(char *path)
+{
+  pthread_mutex_lock(&queue.mutex);
+  while(queue.count == QUEUE_SIZE)
+    pthread_cond_wait(&queue.not_full, &queue.mutex);
+  queue.paths[(queue.head + queue.count) % QUEUE_SIZE] = path;
+  queue.count++;
+  pthread_cond_signal(&queue.not_empty);
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+// returns NULL once the queue is empty and no more paths will come
+static char *queue_pop(void)
+{
+  char *path = NULL;
+  pthread_mutex_lock(&queue.mutex);
+  while(queue.count == 0 && !queue.done)
+    pthread_cond_wait(&queue.not_empty, &queue.mutex);
+  if(queue.count > 0)
+  {
+    path = queue.paths[queue.head];
+    queue.head = (queue.head + 1) % QUEUE_SIZE;
+    queue.count--;
+    pthread_cond_signal(&queue.not_full);
+  }
+  pthread_mutex_unlock(&queue.mutex);
+  return path;
+}
+
+static void queue_finish(void)
+{
+  pthread_mutex_lock(&queue.mutex);
+  queue.done = 1;
+  pthread_cond_broadcast(&queue.not_empty);
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+
+// a growing string buffer so every file is written with a single fwrite and lines never interleave
+
+typedef struct buffer_t
+{
+  char *data;
+  size_t length, allocated;
+} buffer_t;
+
+static void buffer_append(buffer_t *buffer, const char *data, size_t length)
+{
+  if(buffer->length + length + 1 > buffer->allocated)
+  {
+    size_t allocated = buffer->allocated ? buffer->allocated : 4096;
+    while(buffer->length + length + 1 > allocated) allocated *= 2;
+    char *new_data = (char *)realloc(buffer->data, allocated);
+    if(!new_data)
+    {
+      fprintf(stderr, "error: out of memory\n");
+      exit(1);
+    }
+    buffer->data = new_data;
+    buffer->allocated = allocated;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  buffer->data[buffer->length] = '\0';
+}
+
+#define buffer_literal(buffer, s) buffer_append(buffer, s, sizeof(s) - 1)
+
+static void buffer_printf(buffer_t *buffer, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void buffer_printf(buffer_t *buffer, const char *format, ...)
+{
+  char tmp[256];
+  va_list ap;
+  va_start(ap, format);
+  const int length = vsnprintf(tmp, sizeof(tmp), format, ap);
+  va_end(ap);
+  if(length > 0)
+    buffer_append(buffer, tmp, length < (int)sizeof(tmp) ? (size_t)length : sizeof(tmp) - 1);
+}
+
+static void buffer_json_string(buffer_t *buffer, const char *s, size_t length)
+{
+  buffer_literal(buffer, "\"");
+  for(size_t i = 0; i < length; i++)
+  {
+    const unsigned char c = s[i];
+    switch(c)
+    {
+      case '"':  buffer_literal(buffer, "\\\""); break;
+      case '\\': buffer_literal(buffer, "\\\\"); break;
+      case '\n': buffer_literal(buffer, "\\n");  break;
+      case '\r': buffer_literal(buffer, "\\r");  break;
+      case '\t': buffer_literal(buffer, "\\t");  break;
+      default:
+        if(c < 0x20)
+          buffer_printf(buffer, "\\u%04x", c);
+        else
+          buffer_append(buffer, (const char *)&s[i], 1);
+    }
+  }
+  buffer_literal(buffer, "\"");
+}
+
+static void buffer_json_name(buffer_t *buffer, const char *s)
+{
+  if(s)
+    buffer_json_string(buffer, s, strlen(s));
+  else
+    buffer_literal(buffer, "null");
+}
+
+// parasites like gimp-comment are text. everything else is only described by its length
+static int is_text(const uint8_t *data, uint32_t length)
+{
+  if(!data) return 0;
+  if(length > 0 && data[length - 1] == '\0') length--;
+  for(uint32_t i = 0; i < length; i++)
+    if(data[i] < 0x20 && data[i] != '\n' && data[i] != '\r' && data[i] != '\t')
+      return 0;
+  return 1;
+}
+
+static void buffer_json_parasites(buffer_t *buffer, const uint32_t n_parasites, const xcf_info_parasite_t *parasites)
+{
+  buffer_literal(buffer, "[");
+  for(uint32_t i = 0; i < n_parasites; i++)
+  {
+    const xcf_info_parasite_t *parasite = &parasites[i];
+    if(i) buffer_literal(buffer, ",");
+    buffer_literal(buffer, "{\"name\":");
+    buffer_json_name(buffer, parasite->name);
+    buffer_printf(buffer, ",\"flags\":%" PRIu32 ",\"length\":%" PRIu32, parasite->flags, parasite->length);
+    if(is_text(parasite->data, parasite->length))
+    {
+      uint32_t length = parasite->length;
+      if(length > 0 && parasite->data[length - 1] == '\0') length--;
+      buffer_literal(buffer, ",\"text\":");
+      buffer_json_string(buffer, (const char *)parasite->data, length);
+    }
+    buffer_literal(buffer, "}");
+  }
+  buffer_literal(buffer, "]");
+}
+
+static const char *or_unknown(const char *s)
+{
+  return s ? s : "unknown";
+}
+
+static void scan_file(const char *path, buffer_t *buffer)
+{
+  buffer->length = 0;
+
+  xcf_info_t *info = xcf_scan(path, options.flags);
+  buffer_literal(buffer, "{\"path\":");
+  buffer_json_name(buffer, path);
+  if(!info)
+  {
+    buffer_literal(buffer, ",\"error\":\"not a readable xcf file\"}\n");
+    set_failed();
+  }
+  else
+  {
+    buffer_printf(buffer, ",\"version\":%d,\"width\":%" PRIu32 ",\"height\":%" PRIu32, info->version, info->width, info->height);
+    buffer_printf(buffer, ",\"base_type\":\"%s\"", or_unknown(xcf_get_base_type_name(info->base_type)));
+    buffer_printf(buffer, ",\"precision\":\"%s\"", or_unknown(xcf_get_precision_name(info->precision)));
+    buffer_printf(buffer, ",\"compression\":\"%s\"", or_unknown(xcf_get_compression_name(info->compression)));
+    buffer_printf(buffer, ",\"n_layers\":%" PRIu32 ",\"n_channels\":%" PRIu32, info->n_layers, info->n_channels);
+    buffer_literal(buffer, ",\"parasites\":");
+    buffer_json_parasites(buffer, info->n_parasites, info->parasites);
+    if(info->layers)
+    {
+      buffer_literal(buffer, ",\"layers\":[");
+      for(uint32_t i = 0; i < info->n_layers; i++)
+      {
+        const xcf_info_layer_t *layer = &info->layers[i];
+        if(i) buffer_literal(buffer, ",");
+        buffer_literal(buffer, "{\"name\":");
+        buffer_json_name(buffer, layer->name);
+        buffer_printf(buffer, ",\"width\":%" PRIu32 ",\"height\":%" PRIu32, layer->width, layer->height);
+        buffer_printf(buffer, ",\"type\":\"%s\"", or_unknown(xcf_get_type_name(layer->type)));
+        buffer_printf(buffer, ",\"offset_x\":%" PRId32 ",\"offset_y\":%" PRId32, layer->offset_x, layer->offset_y);
+        // broken files can have any float there, JSON has no nan or inf
+        if(isfinite(layer->opacity))
+          buffer_printf(buffer, ",\"opacity\":%g", layer->opacity);
+        else
+          buffer_literal(buffer, ",\"opacity\":null");
+        buffer_printf(buffer, ",\"visible\":%s", layer->visible ? "true" : "false");
+        buffer_printf(buffer, ",\"mode\":\"%s\"", or_unknown(xcf_get_mode_name((xcf_prop_mode_t)layer->mode)));
+        buffer_literal(buffer, ",\"parasites\":");
+        buffer_json_parasites(buffer, layer->n_parasites, layer->parasites);
+        buffer_literal(buffer, "}");
+      }
+      buffer_literal(buffer, "]");
+    }
+    buffer_literal(buffer, "}\n");
+    xcf_info_free(info);
+  }
+
+  pthread_mutex_lock(&output_mutex);
+  fwrite(buffer->data, 1, buffer->length, stdout);
+  pthread_mutex_unlock(&output_mutex);
+}
+
+static void *worker(void *arg)
+{
+  (void)arg;
+  buffer_t buffer = { 0 };
+  char *path;
+  while((path = queue_pop()))
+  {
+    scan_file(path, &buffer);
+    free(path);
+  }
+  free(buffer.data);
+  return NULL;
+}
+
+static int has_xcf_suffix(const char *name)
+{
+  const size_t length = strlen(name);
+  return length >= 4 && !strcasecmp(name + length - 4, ".xcf");
+}
+
+// paths given on the command line are followed when they are symlinks. inside of directories symlinks to files are
+// scanned, but symlinks to directories are skipped, they could form a loop
+static void walk(const char *path, int explicit)
+{
+  struct stat st;
+  if((explicit ? stat(path, &st) : lstat(path, &st)) != 0)
+  {
+    fprintf(stderr, "error: can't stat '%s': %s\n", path, strerror(errno));
+    set_failed();
+    return;
+  }
+  if(S_ISLNK(st.st_mode))
+  {
+    if(stat(path, &st) != 0)
+    {
+      fprintf(stderr, "error: can't stat '%s': %s\n", path, strerror(errno));
+      set_failed();
+      return;
+    }
+    if(S_ISDIR(st.st_mode)) return;
+  }
+
+  if(S_ISDIR(st.st_mode))
+  {
+    DIR *dir = opendir(path);
+    if(!dir)
+    {
+      fprintf(stderr, "error: can't open directory '%s': %s\n", path, strerror(errno));
+      set_failed();
+      return;
+    }
+    struct dirent *entry;
+    while((entry = readdir(dir)))
+    {
+      if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+      const size_t length = strlen(path) + 1 + strlen(entry->d_name) + 1;
+      char *child = (char *)malloc(length);
+      if(!child)
+      {
+        fprintf(stderr, "error: out of memory\n");
+        set_failed();
+        break;
+      }
+      snprintf(child, length, "%s/%s", path, entry->d_name);
+      walk(child, 0);
+      free(child);
+    }
+    closedir(dir);
+  }
+  else if(S_ISREG(st.st_mode) && (explicit || !options.only_xcf_suffix || has_xcf_suffix(path)))
+  {
+    char *copy = strdup(path);
+    if(!copy)
+    {
+      fprintf(stderr, "error: out of memory\n");
+      set_failed();
+      return;
+    }
+    queue_push(copy);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-j threads] [-p] [-a] [-i] path...\n"
+                  "  -j threads  number of worker threads (default: number of cpus)\n"
+                  "  -p          include the text of parasites like gimp-comment\n"
+                  "  -a          look at all files, not only the ones ending in .xcf\n"
+                  "  -i          only scan the image header, skip the layers\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while((opt = getopt(argc, argv, "j:pai")) != -1)
+  {
+    switch(opt)
+    {
+      case 'j': n_threads = strtol(optarg, NULL, 10); break;
+      case 'p': options.flags |= XCF_SCAN_PARASITE_DATA; break;
+      case 'a': options.only_xcf_suffix = 0; break;
+      case 'i': options.flags &= ~XCF_SCAN_LAYERS; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(optind >= argc)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if(n_threads < 1) n_threads = 1;
+
+  pthread_t *threads = (pthread_t *)malloc(n_threads * sizeof(pthread_t));
+  if(!threads)
+  {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  for(long i = 0; i < n_threads; i++)
+    pthread_create(&threads[i], NULL, worker, NULL);
+
+  for(int i = optind; i < argc; i++)
+    walk(argv[i], 1);
+  queue_finish();
+
+  for(long i = 0; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  return failed ? 1 : 0;
+}
@@ -1,4 +1,5 @@
 #include "xcf.h"
+#include "xcf_internal.h"
 
 #include <inttypes.h>
 #include <math.h>
@@ -8,47 +9,6 @@
 #include <string.h>
 #include <zlib.h>
 
-#if defined(_WIN32)
-  #include <windows.h>
-  #if BYTE_ORDER == LITTLE_ENDIAN
-    #if defined(_MSC_VER)
-      #define htobe16(x) _byteswap_ushort(x)
-      #define htobe32(x) _byteswap_ulong(x)
-      #define htobe64(x) _byteswap_uint64(x)
-    #elif defined(__GNUC__) || defined(__clang__)
-      #define htobe16(x) __builtin_bswap16(x)
-      #define htobe32(x) __builtin_bswap32(x)
-      #define htobe64(x) __builtin_bswap64(x)
-    #endif
-  #else
-    #define htobe16(x) (x)
-    #define htobe32(x) (x)
-    #define htobe64(x) (x)
-  #endif
-#elif defined(__APPLE__)
-  #include <libkern/OSByteOrder.h>
-  #define htobe16(x) OSSwapHostToBigInt16(x)
-  #define htobe32(x) OSSwapHostToBigInt32(x)
-  #define htobe64(x) OSSwapHostToBigInt64(x)
-#elif defined(__OpenBSD__)
-  #include <sys/endian.h>
-#elif  defined(__DragonFly__) || defined(__FreeBSD__) || defined(__NetBSD__)
-  #include <sys/endian.h>
-//   #define htobe16(x) noideawhat(x)
-//   #define htobe32(x) noideawhat(x)
-//   #define htobe64(x) noideawhat(x)
-#else
-  #include <endian.h>
-#endif
-
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define CLAMP(a, b, c) ((a) < (b) ? (b) : ((a) > (c) ? (c) : (a)))
-
-#ifndef PRINT_ERROR
-#define PRINT_ERROR(msg, ...) fprintf(stderr, "[libxcf] " msg "\n", ##__VA_ARGS__)
-#endif
-
 #define CHECK_VERSION(_xcf, _check, _version, _msg)                        \
   if(_check)                                                               \
   {                                                                        \
@@ -85,27 +45,48 @@
     return 0;                             \
   }
 
-#define TILE_SIZE 64
-
 typedef struct xcf_parasite_t
 {
   char *name;
   uint32_t flags;
   uint32_t length;
-  uint8_t *data;
+  const uint8_t *data;
+  // set for parasites added with XCF_PARASITE_BY_REFERENCE. data belongs to the user then
+  xcf_release_func_t release;
+  void *release_user;
   struct xcf_parasite_t *next;
 } xcf_parasite_t;
 
+struct xcf_encoded_layer_t
+{
+  xcf_precision_t precision;
+  uint8_t compression;
+  xcf_type_t type;
+  uint32_t width, height, bpp;
+
+  // the encoded tiles, one after the other. offsets are relative to the start of data
+  uint64_t n_tiles;
+  uint64_t *offsets;
+  uint8_t *data;
+  uint64_t size;
+};
+
 struct xcf_t
 {
   FILE *fd;
+  const char *filename; // from the arena, to remove the file when writing gets cancelled
+  int static_memory;    // opened with xcf_open_static(), all memory was given by the user
+  char *stdio_buffer;   // for fd of static handles, stdio would allocate one otherwise
   xcf_state_t state; // this library is a state machine, see state.dot
+  int cancelled;
 
   uint32_t n_layers, n_channels;
   uint32_t next_layer, next_channel; // the number of the next layer or channel to write
 
   uint32_t omit_base_alpha;
 
+  uint64_t memory_limit; // for everything the handle holds, 0 is no limit
+
   int min_version; // the minimal version required for the features used. this gets bumped while writing the image
 
   // fields in the image header
@@ -121,8 +102,13 @@ struct xcf_t
 
     // some properties. instead of writing them in xcf_set() we postpone writing until finalizing the header so
     // we can have sane defaults while still allowing the user to set it
-    // TODO: p_colormap // min_version for that is 1
     uint8_t p_compression; // we only support zlib and uncompressed. rle is missing
+    int zlib_level;        // not stored in the file, only how hard zlib tries
+
+    // the colormap of indexed images. when it wasn't set by the user it gets filled while adding layers and is
+    // written to colormap in the end
+    xcf_palette_t palette;
+    uint64_t colormap;
 
     // parasites. this is a single linked list
     xcf_parasite_t *parasites;
@@ -156,8 +142,46 @@ struct xcf_t
 
     // parasites. this is a single linked list
     xcf_parasite_t *parasites;
+
+    // the entry in layer_stats
+    xcf_layer_stats_t *stats;
   } child;
 
+  // names and parasites are allocated from here. it lives as long as the file is written
+  xcf_arena_t arena;
+
+  // kept around for all layers and channels
+  xcf_tile_encoder_t encoder;
+  uint64_t *offsets;  // of the tiles in the level being written
+  size_t offsets_allocated;
+
+  // counters for xcf_get_stats(). the time spent encoding tiles is counted in the encoders
+  xcf_stats_t stats;
+  xcf_layer_stats_t *layer_stats; // for all layers and channels, allocated with the image header
+
+  // set with xcf_set_trace(). it stays in place when the handle is reset
+  xcf_trace_t trace;
+
+  // set with xcf_set_progress(). it stays in place when the handle is reset as well
+  struct
+  {
+    xcf_progress_func_t func;
+    void *user;
+    uint32_t n_tiles;
+  } progress;
+
+#ifdef XCF_ENABLE_THREADS
+  // parallel encoding when the scheduler is running. tile n is encoded in slot n % n_slots
+  xcf_task_group_t *tasks;
+  struct xcf_tile_slot_t
+  {
+    xcf_tile_encoder_t encoder;
+    const uint8_t *result;
+    size_t length;
+  } *slots;
+  uint32_t n_slots;
+  uint32_t n_tiles_x; // of the level being written
+#endif
 };
 
 
@@ -170,6 +194,26 @@ static int xcf_pointer_size(XCF *xcf)
     return 8;
 }
 
+// number of channels stored per pixel for a layer or channel type
+static int xcf_type_channels(const xcf_type_t type)
+{
+  switch(type)
+  {
+    case XCF_TYPE_RGB:             return 3;
+    case XCF_TYPE_RGB_ALPHA:       return 4;
+    case XCF_TYPE_GRAYSCALE:       return 1;
+    case XCF_TYPE_GRAYSCALE_ALPHA: return 2;
+    case XCF_TYPE_INDEXED:         return 1;
+    case XCF_TYPE_INDEXED_ALPHA:   return 2;
+  }
+  return 0;
+}
+
+static uint64_t xcf_n_tiles(const uint32_t width, const uint32_t height)
+{
+  return (uint64_t)((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+}
+
 static uint32_t xcf_strlen(const char *value)
 {
   if(!value || !*value)
@@ -178,19 +222,157 @@ static uint32_t xcf_strlen(const char *value)
 }
 
 
+// the memory held by a handle and the limit set with XCF_MEMORY_LIMIT
+
+static uint64_t xcf_memory_used(const XCF *xcf)
+{
+  uint64_t used = sizeof(XCF) + xcf->arena.allocated + xcf->offsets_allocated
+                  + xcf_tile_encoder_memory(&xcf->encoder) + xcf_palette_memory(&xcf->image.palette);
+#ifdef XCF_ENABLE_THREADS
+  used += (uint64_t)xcf->n_slots * sizeof(*xcf->slots);
+  for(uint32_t i = 0; i < xcf->n_slots; i++)
+    used += xcf_tile_encoder_memory(&xcf->slots[i].encoder);
+#endif
+  return used;
+}
+
+// update the peak after allocating. extra is memory that is only held for a moment, on top of the handle
+static void xcf_count_memory(XCF *xcf, const uint64_t extra)
+{
+  xcf->stats.peak_memory_bytes = MAX(xcf->stats.peak_memory_bytes, xcf_memory_used(xcf) + extra);
+}
+
+// returns 0 when holding needed bytes in total would go over the limit
+static int xcf_check_memory(XCF *xcf, const uint64_t needed, const char *what)
+{
+  if(!xcf->memory_limit || needed <= xcf->memory_limit) return 1;
+  PRINT_ERROR("error: %s needs %" PRIu64 " bytes, more than the memory limit of %" PRIu64 " bytes", what, needed,
+              xcf->memory_limit);
+  return 0;
+}
+
+#ifdef XCF_ENABLE_THREADS
+static void xcf_free_slots(XCF *xcf)
+{
+  xcf_task_group_free(xcf->tasks);
+  for(uint32_t i = 0; i < xcf->n_slots; i++)
+  {
+    // the slots can be replaced while writing, their time is kept in the statistics of the handle
+    xcf->stats.gather_ns += xcf->slots[i].encoder.gather_ns;
+    xcf->stats.compress_ns += xcf->slots[i].encoder.compress_ns;
+    xcf_tile_encoder_cleanup(&xcf->slots[i].encoder);
+  }
+  xcf_free(xcf->slots);
+  xcf->tasks = NULL;
+  xcf->slots = NULL;
+  xcf->n_slots = 0;
+}
+#endif
+
+// free the buffers of the encoder of the handle. they get allocated again the next time it's used
+static void xcf_free_encoder(XCF *xcf)
+{
+  xcf->stats.gather_ns += xcf->encoder.gather_ns;
+  xcf->stats.compress_ns += xcf->encoder.compress_ns;
+  xcf_tile_encoder_cleanup(&xcf->encoder);
+}
+
+// make sure that extra bytes fit on top of what the handle holds. buffers that are only kept to be used again are
+// given up for that when needed, they get allocated again as far as the limit allows
+static int xcf_make_room(XCF *xcf, const uint64_t extra, const char *what)
+{
+  if(!xcf->memory_limit) return 1;
+#ifdef XCF_ENABLE_THREADS
+  if(xcf_memory_used(xcf) + extra > xcf->memory_limit) xcf_free_slots(xcf);
+#endif
+  if(xcf_memory_used(xcf) + extra > xcf->memory_limit) xcf_free_encoder(xcf);
+  if(xcf_memory_used(xcf) + extra > xcf->memory_limit)
+  {
+    xcf_free(xcf->offsets);
+    xcf->offsets = NULL;
+    xcf->offsets_allocated = 0;
+  }
+  return xcf_check_memory(xcf, xcf_memory_used(xcf) + extra, what);
+}
+
+// make sure the encoder of the handle can encode the source while holding extra bytes on top, without going over
+// the memory limit. what can be given up for that is: the encoders of the scheduler and buffers of the encoder that
+// are bigger than needed, from an earlier layer
+static int xcf_reserve_encoder(XCF *xcf, const xcf_source_t *source, const int n_channels, const uint64_t extra)
+{
+  if(!xcf->memory_limit) return 1;
+
+  xcf_tile_encoder_t *encoder = &xcf->encoder;
+  for(;;)
+  {
+    const uint64_t needed = xcf_memory_used(xcf) - xcf_tile_encoder_memory(encoder) + extra
+                            + xcf_tile_encoder_need(encoder, source, n_channels, xcf->image.precision,
+                                                    xcf->image.p_compression);
+    if(needed <= xcf->memory_limit) return 1;
+#ifdef XCF_ENABLE_THREADS
+    if(xcf->n_slots)
+    {
+      xcf_free_slots(xcf);
+      continue;
+    }
+#endif
+    if(!xcf_tile_encoder_memory(encoder)) return xcf_check_memory(xcf, needed, "encoding the layer");
+    xcf_free_encoder(xcf);
+  }
+}
+
+// handles opened with xcf_open_static() only have the memory they were given. returns 0 for them when what needs
+// more than that
+static int xcf_check_static(XCF *xcf, const char *what)
+{
+  if(!xcf->static_memory) return 1;
+  PRINT_ERROR("error: %s needs memory that handles opened with xcf_open_static() don't have", what);
+  return 0;
+}
+
+
 // functions for writing to a file, taking endianess into account
 
+// all writes and seeks go through these, so they show up in the statistics. the small writes of headers and
+// properties only land in the buffer of stdio, reading the clock would cost more than they do. only the bulk data
+// and seeks, which flush the buffer, are timed
+static size_t xcf_fwrite(XCF *xcf, const void *data, const size_t size, const size_t n)
+{
+  const size_t res = fwrite(data, size, n, xcf->fd);
+  xcf->stats.write_calls++;
+  xcf->stats.bytes_written += res * size;
+  return res;
+}
+
+// for tiles, batches of pointers and other bulk data
+static size_t xcf_fwrite_timed(XCF *xcf, const void *data, const size_t size, const size_t n)
+{
+  const uint64_t start = xcf_now_ns();
+  const size_t res = xcf_fwrite(xcf, data, size, n);
+  xcf->stats.io_ns += xcf_now_ns() - start;
+  return res;
+}
+
+static int xcf_fseek(XCF *xcf, const long offset, const int whence)
+{
+  const uint64_t start = xcf_now_ns();
+  const int res = fseek(xcf->fd, offset, whence);
+  xcf->stats.io_ns += xcf_now_ns() - start;
+  xcf->stats.seeks++;
+  return res;
+}
+
 static int xcf_write_uint8(XCF *xcf, const uint8_t value) __attribute__ ((warn_unused_result));
 static int xcf_write_uint8(XCF *xcf, const uint8_t value)
 {
-  return fwrite(&value, sizeof(value), 1, xcf->fd) == 1;
+  return xcf_fwrite(xcf, &value, sizeof(value), 1) == 1;
 }
 
 static int xcf_write_uint32(XCF *xcf, const uint32_t value) __attribute__ ((warn_unused_result));
 static int xcf_write_uint32(XCF *xcf, const uint32_t value)
 {
   const uint32_t value_be = htobe32(value);
-  return fwrite(&value_be, sizeof(value_be), 1, xcf->fd) == 1;
+  return xcf_fwrite(xcf, &value_be, sizeof(value_be), 1) == 1;
 }
 
 static int xcf_write_float(XCF *xcf, const float value) __attribute__ ((warn_unused_result));
@@ -199,14 +381,14 @@ static int xcf_write_float(XCF *xcf, const float value)
   union {float f; uint32_t i;} v;
   v.f = value;
   const uint32_t value_be = htobe32(v.i);
-  return fwrite(&value_be, sizeof(value_be), 1, xcf->fd) == 1;
+  return xcf_fwrite(xcf, &value_be, sizeof(value_be), 1) == 1;
 }
 
 static int xcf_write_uint64(XCF *xcf, const uint64_t value) __attribute__ ((warn_unused_result));
 static int xcf_write_uint64(XCF *xcf, const uint64_t value)
 {
   const uint64_t value_be = htobe64(value);
-  return fwrite(&value_be, sizeof(value_be), 1, xcf->fd) == 1;
+  return xcf_fwrite(xcf, &value_be, sizeof(value_be), 1) == 1;
 }
 
 static int xcf_write_pointer(XCF *xcf, const uint64_t value) __attribute__ ((warn_unused_result));
@@ -227,7 +409,7 @@ static int xcf_write_string(XCF *xcf, const char *value)
   {
     const size_t len = strlen(value);
     if(!xcf_write_uint32(xcf, len + 1)) return 0;
-    return fwrite(value, 1, len + 1, xcf->fd) == len + 1;
+    return xcf_fwrite(xcf, value, 1, len + 1) == len + 1;
   }
 }
 
@@ -248,75 +430,126 @@ static int xcf_write_parasites(XCF *xcf, const xcf_parasite_t *head)
   for(const xcf_parasite_t *parasite = head; parasite; parasite = parasite->next)
   {
     if(!xcf_write_string(xcf, parasite->name)) return 0;
-    if(!xcf_write_uint32(xcf, parasite->flags)) return 0;
+    if(!xcf_write_uint32(xcf, parasite->flags & ~XCF_PARASITE_BY_REFERENCE)) return 0;
     if(!xcf_write_uint32(xcf, parasite->length)) return 0;
-    if(fwrite(parasite->data, 1, parasite->length, xcf->fd) != parasite->length) return 0;
+    if(xcf_fwrite_timed(xcf, parasite->data, 1, parasite->length) != parasite->length) return 0;
   }
   return 1;
 }
 
-// add a parasite to the list if it's not there or change the existing one if it's already present
-// returns the new start of the list
-static xcf_parasite_t *xcf_parasites_add(xcf_parasite_t *head, const char *name, const uint32_t flags,
-                                         const uint32_t length, const uint8_t *data)
+// hand borrowed data back to the user. it's safe to call this more than once
+static void xcf_parasite_release(xcf_parasite_t *parasite)
+{
+  if(parasite->release) parasite->release((void *)parasite->data, parasite->release_user);
+  parasite->release = NULL;
+  parasite->data = NULL;
+}
+
+static void xcf_parasites_release(xcf_parasite_t *head)
+{
+  for(xcf_parasite_t *parasite = head; parasite; parasite = parasite->next)
+    xcf_parasite_release(parasite);
+}
+
+// add a parasite to the list if it's not there or change the existing one if it's already present.
+// all memory comes from the arena, the old data of a changed parasite is only freed with it. with
+// XCF_PARASITE_BY_REFERENCE in flags the data isn't copied but kept until the parasite is written.
+// returns 0 when running out of memory, the data still belongs to the caller then
+static int xcf_parasites_add(xcf_arena_t *arena, xcf_parasite_t **head, const char *name, const uint32_t flags,
+                             const uint32_t length, const uint8_t *data, xcf_release_func_t release,
+                             void *release_user)
 {
+  const int by_reference = (flags & XCF_PARASITE_BY_REFERENCE) != 0;
+
   // without a name there is nothing to add later
-  if(!name) return head;
+  if(!name)
+  {
+    if(by_reference && release) release((void *)data, release_user);
+    return 1;
+  }
 
-  xcf_parasite_t *parasite;
+  xcf_parasite_t *parasite, *last = NULL;
+  for(parasite = *head; parasite; last = parasite, parasite = parasite->next)
+    if(!strcmp(name, parasite->name))
+      break; // update a parasite that was set earlier
 
-  if(!head)
+  const uint8_t *stored = data;
+  if(!by_reference)
   {
-    parasite = (xcf_parasite_t *)malloc(sizeof(xcf_parasite_t));
-    parasite->name = strdup(name);
-    parasite->next = NULL;
-    head = parasite;
+    uint8_t *copy = (uint8_t *)xcf_arena_alloc(arena, length);
+    if(!copy) return 0;
+    memcpy(copy, data, length);
+    stored = copy;
   }
-  else
+
+  if(!parasite)
   {
-    xcf_parasite_t *last;
-    for(last = NULL, parasite = head; parasite; last = parasite, parasite = parasite->next)
-    {
-      if(!strcmp(name, parasite->name))
-      {
-        // update a parasite that was set earlier
-        free(parasite->data);
-        parasite->data = NULL;
-        parasite->length = 0;
-        break;
-      }
-    }
-    if(!parasite)
-    {
-      // allocate a new one and append it
-      parasite = (xcf_parasite_t *)malloc(sizeof(xcf_parasite_t));
-      parasite->name = strdup(name);
-      parasite->next = NULL;
+    // allocate a new one and append it
+    parasite = (xcf_parasite_t *)xcf_arena_alloc(arena, sizeof(xcf_parasite_t));
+    if(!parasite) return 0;
+    parasite->name = xcf_arena_strdup(arena, name);
+    if(!parasite->name) return 0;
+    parasite->release = NULL;
+    parasite->next = NULL;
+    if(last)
       last->next = parasite;
-    }
+    else
+      *head = parasite;
   }
+  else
+    xcf_parasite_release(parasite);
 
   parasite->flags = flags;
   parasite->length = length;
-  parasite->data = (uint8_t *)malloc(length);
-  memcpy(parasite->data, data, length);
+  parasite->data = stored;
+  parasite->release = by_reference ? release : NULL;
+  parasite->release_user = release_user;
 
-  return head;
+  return 1;
+}
+
+// copy the name of the current layer or channel into the arena
+static int xcf_set_name(XCF *xcf, const char *name)
+{
+  if(!xcf_make_room(xcf, strlen(name) + 1, "copying the name")) return 0;
+  if(!(xcf->child.name = xcf_arena_strdup(&xcf->arena, name)))
+  {
+    if(xcf->static_memory)
+      PRINT_ERROR("error: the name '%s' doesn't fit into the names_size given to xcf_open_static()", name);
+    else
+      PRINT_ERROR("error: out of memory, can't copy the name '%s'", name);
+    return 0;
+  }
+  xcf_count_memory(xcf, 0);
+  return 1;
 }
 
-static void xcf_parasites_free(xcf_parasite_t *head)
+// read the arguments of XCF_PROP_PARASITES from ap and add the parasite to the list
+static int xcf_parasites_set(XCF *xcf, xcf_parasite_t **head, va_list *ap)
 {
-  while(head)
+  const char *name = va_arg(*ap, char *);
+  const uint32_t flags = va_arg(*ap, uint32_t);
+  const uint32_t length = va_arg(*ap, uint32_t);
+  const uint8_t *data = va_arg(*ap, uint8_t *);
+  xcf_release_func_t release = NULL;
+  void *release_user = NULL;
+  if(flags & XCF_PARASITE_BY_REFERENCE)
+  {
+    release = va_arg(*ap, xcf_release_func_t);
+    release_user = va_arg(*ap, void *);
+  }
+
+  // parasites that aren't taken by reference get copied
+  if(!(flags & XCF_PARASITE_BY_REFERENCE) && !xcf_make_room(xcf, length, "copying the parasite"))
+    return 0;
+
+  if(!xcf_parasites_add(&xcf->arena, head, name, flags, length, data, release, release_user))
   {
-    xcf_parasite_t *next = head->next;
-    free(head->name);
-    free(head->data);
-    head->name = NULL;
-    head->data = NULL;
-    head->next = NULL;
-    free(head);
-    head = next;
+    PRINT_ERROR("error: out of memory");
+    return 0;
   }
+  xcf_count_memory(xcf, 0);
+  return 1;
 }
 
 
@@ -338,6 +571,19 @@ static int xcf_write_image_header(XCF *xcf)
     return 0;
   }
 
+  if(xcf->image.base_type == XCF_BASE_TYPE_INDEXED && xcf->image.precision != XCF_PRECISION_I_8_G)
+  {
+    PRINT_ERROR("error: indexed images have to use XCF_PRECISION_I_8_G");
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+  if(xcf->image.base_type != XCF_BASE_TYPE_INDEXED && xcf->image.palette.fixed)
+  {
+    PRINT_ERROR("error: a colormap can only be used for indexed images");
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
   CHECK_VERSION(xcf, (xcf->image.precision != XCF_PRECISION_I_8_G), 7, "image precision other than 8 bit gamma");
   CHECK_VERSION(xcf, xcf->image.precision > XCF_PRECISION_I_8_G, 12, "image encoding other than 8 bit integer");
   CHECK_VERSION(xcf, xcf->image.p_compression == XCF_PROP_COMPRESSION_ZLIB, 8, "zlib compression")
@@ -345,6 +591,22 @@ static int xcf_write_image_header(XCF *xcf)
   const size_t image_size_estimate = 0; // TODO
   CHECK_VERSION(xcf, (image_size_estimate >= ((int64_t) 1 << 32)), 11, "an image size bigger than 4GB");
 
+  XCF_TRACE(&xcf->trace, XCF_TRACE_HEADER, 1, 0);
+
+  // the statistics of all layers and channels
+  const uint32_t n_children = xcf->n_layers + xcf->n_channels;
+  if(n_children > 0)
+  {
+    xcf->layer_stats = (xcf_layer_stats_t *)xcf_arena_alloc(&xcf->arena, n_children * sizeof(xcf_layer_stats_t));
+    if(!xcf->layer_stats)
+    {
+      PRINT_ERROR("error: out of memory");
+      xcf->state = XCF_STATE_ERROR;
+      return 0;
+    }
+    memset(xcf->layer_stats, 0, n_children * sizeof(xcf_layer_stats_t));
+  }
+
   char version[9 + 4 + 1] = "gimp xcf ";
   const int v = abs(xcf->image.version);
   if(v == 0)
@@ -357,7 +619,7 @@ static int xcf_write_image_header(XCF *xcf)
     xcf->state = XCF_STATE_ERROR;
     return 0;
   }
-  if(fwrite(version, 1, sizeof(version), xcf->fd) != sizeof(version))
+  if(xcf_fwrite(xcf, version, 1, sizeof(version)) != sizeof(version))
   {
     PRINT_ERROR("error: can't write to file");
     xcf->state = XCF_STATE_ERROR;
@@ -370,13 +632,23 @@ static int xcf_write_image_header(XCF *xcf)
   CHECK_IO(xcf, xcf_write_uint32(xcf, xcf->image.precision), 1);
 
   // write properties and parasites
-  // TODO: colormap -- min_version is 1 for that
+  // colormap. when it's not known yet all 256 entries are reserved and filled in when closing the file
+  if(xcf->image.base_type == XCF_BASE_TYPE_INDEXED)
+  {
+    const uint32_t n_colors = xcf->image.palette.fixed ? xcf->image.palette.n_colors : 256;
+    CHECK_IO(xcf, xcf_write_uint32(xcf, XCF_PROP_COLORMAP), 1);
+    CHECK_IO(xcf, xcf_write_uint32(xcf, 4 + 3 * n_colors), 1);
+    CHECK_IO(xcf, xcf_write_uint32(xcf, n_colors), 1);
+    xcf->image.colormap = ftell(xcf->fd);
+    CHECK_IO(xcf, xcf_fwrite(xcf, xcf->image.palette.colors, 1, 3 * n_colors), 3 * n_colors);
+  }
   // compression
   CHECK_IO(xcf, xcf_write_uint32(xcf, XCF_PROP_COMPRESSION), 1);
   CHECK_IO(xcf, xcf_write_uint32(xcf, 1), 1);
   CHECK_IO(xcf, xcf_write_uint8(xcf, xcf->image.p_compression), 1);
   // parasites
   CHECK_IO(xcf, xcf_write_parasites(xcf, xcf->image.parasites), 1);
+  xcf_parasites_release(xcf->image.parasites);
 
   // close the property list by adding PROP_END
   CHECK_IO(xcf, xcf_write_uint32(xcf, 0), 1); // type
@@ -384,14 +656,15 @@ static int xcf_write_image_header(XCF *xcf)
 
   // add dummy pointer lists for layers and channels and remember the file offset so we can set it later
   xcf->image.layer_list = ftell(xcf->fd);
-  CHECK_IO(xcf, fseek(xcf->fd, xcf_pointer_size(xcf) * xcf->n_layers, SEEK_CUR), 0);
+  CHECK_IO(xcf, xcf_fseek(xcf, xcf_pointer_size(xcf) * xcf->n_layers, SEEK_CUR), 0);
   CHECK_IO(xcf, xcf_write_pointer(xcf, 0), 1);
 
   xcf->image.channel_list = ftell(xcf->fd);
-  CHECK_IO(xcf, fseek(xcf->fd, xcf_pointer_size(xcf) * xcf->n_channels, SEEK_CUR), 0);
+  CHECK_IO(xcf, xcf_fseek(xcf, xcf_pointer_size(xcf) * xcf->n_channels, SEEK_CUR), 0);
   CHECK_IO(xcf, xcf_write_pointer(xcf, 0), 1);
 
   xcf->state = XCF_STATE_MAIN;
+  XCF_TRACE(&xcf->trace, XCF_TRACE_HEADER, 0, 0);
   return 1;
 }
 
@@ -401,32 +674,20 @@ static int xcf_register_pointer(XCF *xcf, uint32_t list_start, uint32_t n)
 {
   const uint64_t list_entry = list_start + n * xcf_pointer_size(xcf);
   uint64_t current_pos = ftell(xcf->fd);
-  CHECK_IO(xcf, fseek(xcf->fd, list_entry, SEEK_SET), 0);
+  CHECK_IO(xcf, xcf_fseek(xcf, list_entry, SEEK_SET), 0);
   CHECK_IO(xcf, xcf_write_pointer(xcf, current_pos), 1);
-  CHECK_IO(xcf, fseek(xcf->fd, 0, SEEK_END), 0);
+  CHECK_IO(xcf, xcf_fseek(xcf, 0, SEEK_END), 0);
   return 1;
 }
 
-static int xcf_write_layer_header(XCF *xcf)
+// the type of the current layer. it has to be the same as the one for the whole image
+static int xcf_layer_type(XCF *xcf, xcf_type_t *type)
 {
-  if(xcf->state != XCF_STATE_LAYER)
-  {
-    PRINT_ERROR("error: there is no layer header to be written");
-    xcf->state = XCF_STATE_ERROR;
-    return 0;
-  }
-
-  // store pointer in the global layer list
-  CHECK_IO(xcf, xcf_register_pointer(xcf, xcf->image.layer_list, xcf->child.n), 1);
-
-  CHECK_IO(xcf, xcf_write_uint32(xcf, xcf->child.width), 1);
-  CHECK_IO(xcf, xcf_write_uint32(xcf, xcf->child.height), 1);
-  // the type has to be the same as the one for the whole image.
   switch(xcf->image.base_type)
   {
-    case XCF_BASE_TYPE_RGB:       xcf->child.type = XCF_TYPE_RGB_ALPHA;       break;
-    case XCF_BASE_TYPE_GRAYSCALE: xcf->child.type = XCF_TYPE_GRAYSCALE_ALPHA; break;
-    case XCF_BASE_TYPE_INDEXED:   xcf->child.type = XCF_TYPE_INDEXED_ALPHA;   break;
+    case XCF_BASE_TYPE_RGB:       *type = XCF_TYPE_RGB_ALPHA;       break;
+    case XCF_BASE_TYPE_GRAYSCALE: *type = XCF_TYPE_GRAYSCALE_ALPHA; break;
+    case XCF_BASE_TYPE_INDEXED:   *type = XCF_TYPE_INDEXED_ALPHA;   break;
     default:
     {
       const char *name = xcf_get_base_type_name(xcf->image.base_type);
@@ -441,8 +702,26 @@ static int xcf_write_layer_header(XCF *xcf)
   // the base layer can have no alpha channel. omit it to get smaller files
   // this is configurable with XCF_OMIT_BASE_ALPHA so the user can have alpha data for the base layer!
   if(xcf->omit_base_alpha && xcf->next_layer == xcf->n_layers)
-    xcf->child.type -= 1;
+    *type -= 1;
+
+  return 1;
+}
+
+static int xcf_write_layer_header(XCF *xcf)
+{
+  if(xcf->state != XCF_STATE_LAYER)
+  {
+    PRINT_ERROR("error: there is no layer header to be written");
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
 
+  // store pointer in the global layer list
+  CHECK_IO(xcf, xcf_register_pointer(xcf, xcf->image.layer_list, xcf->child.n), 1);
+
+  CHECK_IO(xcf, xcf_write_uint32(xcf, xcf->child.width), 1);
+  CHECK_IO(xcf, xcf_write_uint32(xcf, xcf->child.height), 1);
+  CHECK_IO(xcf, xcf_layer_type(xcf, &xcf->child.type), 1);
   CHECK_IO(xcf, xcf_write_uint32(xcf, xcf->child.type), 1);
   CHECK_IO(xcf, xcf_write_string(xcf, xcf->child.name), 1);
 
@@ -505,6 +784,7 @@ static int xcf_write_layer_header(XCF *xcf)
   }
   // parasites
   CHECK_IO(xcf, xcf_write_parasites(xcf, xcf->child.parasites), 1);
+  xcf_parasites_release(xcf->child.parasites);
 
   // close the property list by adding PROP_END
   CHECK_IO(xcf, xcf_write_uint32(xcf, 0), 1); // type
@@ -564,6 +844,7 @@ static int xcf_write_channel_header(XCF *xcf)
   }
   // parasites
   CHECK_IO(xcf, xcf_write_parasites(xcf, xcf->child.parasites), 1);
+  xcf_parasites_release(xcf->child.parasites);
 
   // close the property list by adding PROP_END
   CHECK_IO(xcf, xcf_write_uint32(xcf, 0), 1); // type
@@ -578,62 +859,13 @@ static int xcf_write_channel_header(XCF *xcf)
   return 1;
 }
 
-// data_channels is the number of color channels in the data passed in
-// n_channels is the number of channels that get written
-// these may differ to make it easier for the user to pass in image data that he already has
-// channel_size is the number of bytes per channel per pixel. for a float rgb image it is 4
-static int xcf_add_hierarchy(XCF *xcf, const void *data, const uint32_t width, const uint32_t height,
-                             const int data_channels, const int n_channels, const int channel_size)
+// write the hierarchy and level structures up to the list of tile pointers. the space for the pointers is
+// reserved, their file offset is returned in tiles_list so they can be filled in once the tiles are written
+static int xcf_write_level_start(XCF *xcf, const uint32_t width, const uint32_t height, const uint32_t bpp,
+                                 uint64_t *tiles_list) __attribute__((warn_unused_result));
+static int xcf_write_level_start(XCF *xcf, const uint32_t width, const uint32_t height, const uint32_t bpp,
+                                 uint64_t *tiles_list)
 {
-  int res = 0;
-  const uint32_t bpp = n_channels * channel_size;
-
-  unsigned char *data_fixed = (unsigned char *)data;
-  int free_data_fixed = 0;
-  // make sure that the data has the right number of channels
-  if(n_channels != data_channels)
-  {
-//     printf("channels need adaption\n");
-
-    const size_t data_bpp = data_channels * channel_size;
-    data_fixed = (unsigned char *)calloc((size_t)width * height, n_channels * channel_size);
-    free_data_fixed = 1;
-    if(n_channels < data_channels)
-    {
-      // just drop all extra channels
-      for(uint32_t y = 0; y < height; y++)
-        for(uint32_t x = 0; x < width; x++)
-          memcpy(data_fixed + y * width * bpp + x * bpp, ((uint8_t *)data) + y * width * data_bpp + x * data_bpp, bpp);
-    }
-    else
-    {
-      // add extra channels. the last one (alpha) will be fully opaque, the others will be 0
-      unsigned char *alpha_data = (unsigned char *)malloc(channel_size);
-      if(xcf->image.precision == XCF_PRECISION_F_16_L || xcf->image.precision == XCF_PRECISION_F_16_G)
-        *((uint16_t *)alpha_data) = 0x3c00; // 1.0 in half float
-      else if(xcf->image.precision == XCF_PRECISION_F_32_L || xcf->image.precision == XCF_PRECISION_F_32_G)
-        *((float *)alpha_data) = 1.0;
-      else if(xcf->image.precision == XCF_PRECISION_F_64_L || xcf->image.precision == XCF_PRECISION_F_64_G)
-        *((double *)alpha_data) = 1.0;
-      else
-        memset(alpha_data, 0xff, channel_size);
-
-      for(uint32_t y = 0; y < height; y++)
-      {
-        for(uint32_t x = 0; x < width; x++)
-        {
-          memcpy(data_fixed + y * width * bpp + x * bpp,
-                 ((unsigned char *)data) + y * width * data_bpp + x * data_bpp,
-                 data_bpp);
-          // make the layer opaque if it has an alpha channel
-          if(n_channels == 2 || n_channels == 4)
-            memcpy(data_fixed + y * width * bpp + x * bpp + (n_channels - 1) * channel_size, alpha_data, channel_size);
-        }
-      }
-      free(alpha_data);
-    }
-  }
-
   CHECK_IO(xcf, xcf_write_uint32(xcf, width), 1);
   CHECK_IO(xcf, xcf_write_uint32(xcf, height), 1);
   CHECK_IO(xcf, xcf_write_uint32(xcf, bpp), 1);
@@ -645,142 +877,305 @@ static int xcf_add_hierarchy(XCF *xcf, const void *data, const uint32_t width, c
   CHECK_IO(xcf, xcf_write_pointer(xcf, 0), 1);
 
   // add level structure
-  const uint32_t n_tiles = ceilf((float)width / TILE_SIZE) * ceilf((float)height / TILE_SIZE);
+  const uint64_t n_tiles = xcf_n_tiles(width, height);
   CHECK_IO(xcf, xcf_write_uint32(xcf, width), 1);
   CHECK_IO(xcf, xcf_write_uint32(xcf, height), 1);
 
   // links to tiles. will be filled in later
-  const uint32_t tiles_list = ftell(xcf->fd);
-  CHECK_IO(xcf, fseek(xcf->fd, n_tiles * xcf_pointer_size(xcf), SEEK_CUR), 0);
+  *tiles_list = ftell(xcf->fd);
+  CHECK_IO(xcf, xcf_fseek(xcf, n_tiles * xcf_pointer_size(xcf), SEEK_CUR), 0);
   CHECK_IO(xcf, xcf_write_pointer(xcf, 0), 1);
 
-  // add tiles
-  const size_t tile_size = (size_t)bpp * TILE_SIZE * TILE_SIZE;
-  const size_t dest_len = compressBound(tile_size);
-  unsigned char *tile_compressed = (unsigned char *)malloc(dest_len);
-
-  void *tile = malloc(tile_size);
+  return 1;
+}
 
-  for(uint32_t y = 0, tile_number = 0; y < height; y += TILE_SIZE)
+// fill in the list of tile pointers reserved by xcf_write_level_start(). the tiles are at base + offsets[i]
+static int xcf_write_tile_pointers(XCF *xcf, const uint64_t tiles_list, const uint64_t base, const uint64_t *offsets,
+                                   const uint64_t n_tiles) __attribute__((warn_unused_result));
+static int xcf_write_tile_pointers(XCF *xcf, const uint64_t tiles_list, const uint64_t base, const uint64_t *offsets,
+                                   const uint64_t n_tiles)
+{
+  // the pointers are encoded in batches, so big layers don't need one fwrite() per tile
+  uint8_t buffer[512 * 8];
+  const int pointer_size = xcf_pointer_size(xcf);
+  const size_t batch = sizeof(buffer) / pointer_size;
+  CHECK_IO(xcf, xcf_fseek(xcf, tiles_list, SEEK_SET), 0);
+  for(uint64_t i = 0; i < n_tiles; i += batch)
   {
-    const uint32_t y_end = MIN(y + TILE_SIZE - 1, height - 1);
-    const uint32_t tile_h = y_end - y + 1;
-    for(uint32_t x = 0; x < width; x += TILE_SIZE, tile_number++)
-    {
-      // put the pointer into the tile list
-      const uint64_t _current_pos = ftell(xcf->fd);
-      CHECK_IO(xcf, fseek(xcf->fd, tiles_list + xcf_pointer_size(xcf) * tile_number, SEEK_SET), 0);
-      CHECK_IO(xcf, xcf_write_pointer(xcf, _current_pos), 1);
-      CHECK_IO(xcf, fseek(xcf->fd, 0, SEEK_END), 0);
-
-      const uint32_t x_end = MIN(x + TILE_SIZE - 1, width - 1);
-      const uint32_t tile_w = x_end - x + 1;
+    const size_t n = MIN(batch, n_tiles - i);
+    xcf_encode_pointers(buffer, pointer_size, base, offsets + i, n);
+    CHECK_IO(xcf, xcf_fwrite_timed(xcf, buffer, pointer_size, n), n);
+  }
+  CHECK_IO(xcf, xcf_fseek(xcf, 0, SEEK_END), 0);
+  return 1;
+}
 
-      // channel size can be 1 (8 bit), 2 (16 bit), 4 (32 bit) or 8 (64 bit)
-      if(channel_size == 1)
-      {
-        uint8_t *data8 = (uint8_t *)data_fixed;
-        uint8_t *tile8 = (uint8_t *)tile;
-        for(uint32_t tile_y = 0; tile_y < tile_h; tile_y++)
-        {
-          for(uint32_t tile_x = 0; tile_x < tile_w; tile_x++)
-          {
-            for(int c = 0; c < n_channels; c++)
-            {
-              const uint8_t value = data8[(y + tile_y) * n_channels * width + (x + tile_x) * n_channels + c];
-              tile8[tile_y * n_channels * tile_w + tile_x * n_channels + c] = value;
-            }
-          }
-        }
-      }
-      else if(channel_size == 2)
-      {
-        uint16_t *data16 = (uint16_t *)data_fixed;
-        uint16_t *tile16 = (uint16_t *)tile;
-        for(uint32_t tile_y = 0; tile_y < tile_h; tile_y++)
-        {
-          for(uint32_t tile_x = 0; tile_x < tile_w; tile_x++)
-          {
-            for(int c = 0; c < n_channels; c++)
-            {
-              const uint16_t value = data16[(y + tile_y) * n_channels * width + (x + tile_x) * n_channels + c];
-              tile16[tile_y * n_channels * tile_w + tile_x * n_channels + c] = htobe16(value);
-            }
-          }
-        }
-      }
-      else if(channel_size == 4)
-      {
-        uint32_t *data32 = (uint32_t *)data_fixed;
-        uint32_t *tile32 = (uint32_t *)tile;
-        for(uint32_t tile_y = 0; tile_y < tile_h; tile_y++)
-        {
-          for(uint32_t tile_x = 0; tile_x < tile_w; tile_x++)
-          {
-            for(int c = 0; c < n_channels; c++)
-            {
-              const uint32_t value = data32[(y + tile_y) * n_channels * width + (x + tile_x) * n_channels + c];
-              tile32[tile_y * n_channels * tile_w + tile_x * n_channels + c] = htobe32(value);
-            }
-          }
-        }
-      }
-      else if(channel_size == 8)
-      {
-        uint64_t *data64 = (uint64_t *)data_fixed;
-        uint64_t *tile64 = (uint64_t *)tile;
-        for(uint32_t tile_y = 0; tile_y < tile_h; tile_y++)
-        {
-          for(uint32_t tile_x = 0; tile_x < tile_w; tile_x++)
-          {
-            for(int c = 0; c < n_channels; c++)
-            {
-              const uint64_t value = data64[(y + tile_y) * n_channels * width + (x + tile_x) * n_channels + c];
-              tile64[tile_y * n_channels * tile_w + tile_x * n_channels + c] = htobe64(value);
-            }
-          }
-        }
-      }
-      else
-      {
-        PRINT_ERROR("error: channel size of %d bytes is not supported", channel_size);
-        goto end;
-      }
+// make room for the offsets of n_tiles tiles
+static int xcf_grow_offsets(XCF *xcf, const uint64_t n_tiles)
+{
+  if(xcf->static_memory)
+  {
+    if(n_tiles * sizeof(uint64_t) <= xcf->offsets_allocated) return 1;
+    PRINT_ERROR("error: the layer is bigger than the one passed to xcf_open_static()");
+    return 0;
+  }
 
-      const size_t src_len = bpp * tile_w * tile_h;
-      if(xcf->image.p_compression == XCF_PROP_COMPRESSION_ZLIB)
-      {
-        // use zlib to compress the tile
-        unsigned long _dest_len = dest_len;
-        const int zlib_res = compress(tile_compressed, &_dest_len, tile, src_len);
-        if(zlib_res != Z_OK)
-        {
-          PRINT_ERROR("error: can't compress tile: %d", zlib_res);
-          goto end;
-        }
-        if(fwrite(tile_compressed, 1, _dest_len, xcf->fd) != _dest_len)
-        {
-          PRINT_ERROR("error: can't write image data");
-          goto end;
-        }
-      }
-      else if(xcf->image.p_compression == XCF_PROP_COMPRESSION_NONE)
-      {
-        if(fwrite(tile, 1, src_len, xcf->fd) != src_len)
-        {
-          PRINT_ERROR("error: can't write image data");
-          goto end;
-        }
-      }
-    }
+  uint8_t *offsets = (uint8_t *)xcf->offsets;
+  if(!xcf_grow(&offsets, &xcf->offsets_allocated, n_tiles * sizeof(uint64_t)))
+  {
+    xcf->offsets = NULL;
+    PRINT_ERROR("error: out of memory");
+    return 0;
   }
+  xcf->offsets = (uint64_t *)offsets;
+  return 1;
+}
 
-  res = 1;
+// add the pixel data of the current layer or channel to the statistics. raw is its size before compression
+static void xcf_count_level(XCF *xcf, const uint64_t raw, const uint64_t compressed, const uint64_t n_tiles,
+                            const uint64_t n_deduplicated)
+{
+  xcf_layer_stats_t *layer = xcf->child.stats;
+  layer->raw_bytes += raw;
+  layer->compressed_bytes += compressed;
+  layer->tiles_written += n_tiles;
+  layer->tiles_deduplicated += n_deduplicated;
+
+  xcf->stats.raw_bytes += raw;
+  xcf->stats.compressed_bytes += compressed;
+  xcf->stats.tiles_written += n_tiles;
+  xcf->stats.tiles_deduplicated += n_deduplicated;
+}
+
+static uint64_t xcf_encoder_scratch(const xcf_tile_encoder_t *encoder)
+{
+  return encoder->input_allocated + encoder->tile_allocated + encoder->tile_compressed_allocated
+         + encoder->scratch_allocated;
+}
+
+// update the peak of the scratch buffers after they grew
+static void xcf_count_scratch(XCF *xcf)
+{
+  uint64_t size = xcf_encoder_scratch(&xcf->encoder) + xcf->offsets_allocated;
+#ifdef XCF_ENABLE_THREADS
+  for(uint32_t i = 0; i < xcf->n_slots; i++)
+    size += xcf_encoder_scratch(&xcf->slots[i].encoder);
+#endif
+  xcf->stats.peak_scratch_bytes = MAX(xcf->stats.peak_scratch_bytes, size);
+  xcf_count_memory(xcf, 0);
+}
+
+// the user asked to stop. what was written so far is of no use, so the file gets removed right away
+static void xcf_cancel(XCF *xcf)
+{
+  if(xcf->fd) fclose(xcf->fd);
+  xcf->fd = NULL;
+  if(xcf->filename && remove(xcf->filename) != 0)
+    PRINT_ERROR("error: can't remove '%s' after cancelling", xcf->filename);
+  xcf->cancelled = 1;
+}
+
+// called after every tile written. returns 0 when the user cancelled, the file is gone then
+static int xcf_report_progress(XCF *xcf, const uint64_t tiles_done, const uint64_t tiles_total)
+{
+  if(!xcf->progress.func) return 1;
+  if(tiles_done != tiles_total && (!xcf->progress.n_tiles || tiles_done % xcf->progress.n_tiles != 0)) return 1;
+
+  xcf_progress_t progress;
+  progress.index = (uint32_t)(xcf->child.stats - xcf->layer_stats);
+  progress.tiles_done = tiles_done;
+  progress.tiles_total = tiles_total;
+  progress.bytes_written = xcf->stats.bytes_written;
+  if(xcf->progress.func(xcf->progress.user, &progress)) return 1;
+
+  xcf_cancel(xcf);
+  return 0;
+}
+
+#ifdef XCF_ENABLE_THREADS
+static int xcf_encode_task(void *user, const uint64_t task)
+{
+  XCF *xcf = (XCF *)user;
+  struct xcf_tile_slot_t *slot = &xcf->slots[task % xcf->n_slots];
+  const uint32_t x = (task % xcf->n_tiles_x) * TILE_SIZE;
+  const uint32_t y = (task / xcf->n_tiles_x) * TILE_SIZE;
+  return xcf_encode_tile(&slot->encoder, x, y, &slot->result, &slot->length);
+}
+
+// the number of tiles that can be in flight, at most n_slots, while holding extra bytes on top without going over
+// the memory limit. the encoder of the handle is given up for them. 0 when not even 2 fit, encoding in parallel
+// doesn't help then
+static uint32_t xcf_afford_slots(XCF *xcf, const xcf_source_t *source, const int n_channels, uint32_t n_slots,
+                                 const uint64_t extra)
+{
+  if(!xcf->memory_limit) return n_slots;
+
+  xcf_tile_encoder_t fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  const xcf_precision_t precision = xcf->image.precision;
+  const uint8_t compression = xcf->image.p_compression;
+  const uint64_t slot_need = sizeof(*xcf->slots) + xcf_tile_encoder_need(&fresh, source, n_channels, precision,
+                                                                         compression);
+  uint64_t used = xcf_memory_used(xcf) - xcf_tile_encoder_memory(&xcf->encoder) + extra;
+  for(uint32_t i = 0; i < xcf->n_slots; i++)
+    used -= sizeof(*xcf->slots) + xcf_tile_encoder_memory(&xcf->slots[i].encoder);
+
+  for(; n_slots >= 2; n_slots--)
+  {
+    // the slots that are there already are kept when their number stays the same, with their buffers
+    uint64_t needed = used + n_slots * slot_need;
+    if(n_slots == xcf->n_slots)
+    {
+      needed = used;
+      for(uint32_t i = 0; i < n_slots; i++)
+        needed += sizeof(*xcf->slots) + xcf_tile_encoder_need(&xcf->slots[i].encoder, source, n_channels,
+                                                              precision, compression);
+    }
+    if(needed <= xcf->memory_limit) return n_slots;
+  }
+  return 0;
+}
+
+// like xcf_add_hierarchy(), but the tiles get encoded by the scheduler. they are still written in order
+static int xcf_add_hierarchy_parallel(XCF *xcf, const xcf_source_t *source, const uint32_t width,
+                                      const uint32_t height, const int n_channels, const uint32_t n_slots,
+                                      const uint64_t tiles_list)
+{
+  if(xcf->memory_limit) xcf_free_encoder(xcf);
+  if(xcf->n_slots != n_slots)
+  {
+    xcf_free_slots(xcf);
+    xcf->slots = (struct xcf_tile_slot_t *)xcf_calloc(n_slots, sizeof(struct xcf_tile_slot_t));
+    if(xcf->slots) xcf->n_slots = n_slots;
+    xcf->tasks = xcf_task_group_new(xcf_encode_task, xcf, n_slots);
+    if(!xcf->slots || !xcf->tasks)
+    {
+      PRINT_ERROR("error: out of memory");
+      return 0;
+    }
+  }
+
+  const uint64_t n_tiles = xcf_n_tiles(width, height);
+  if(!xcf_grow_offsets(xcf, n_tiles)) return 0;
+
+  for(uint32_t i = 0; i < n_slots; i++)
+  {
+    if(!xcf_tile_encoder_init(&xcf->slots[i].encoder, source, width, height, n_channels, xcf->image.precision,
+                              xcf->image.p_compression, xcf->image.zlib_level))
+      return 0;
+    xcf->slots[i].encoder.trace = &xcf->trace;
+  }
+  xcf_count_scratch(xcf);
+  xcf->n_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+  int res = 0;
+  const uint64_t data_start = ftell(xcf->fd);
+  uint64_t submitted = 0, written;
+  uint64_t offset = 0;
+  for(written = 0; written < n_tiles; written++)
+  {
+    while(submitted < n_tiles && submitted < written + n_slots)
+      xcf_task_submit(xcf->tasks, submitted++);
+
+    if(!xcf_task_wait(xcf->tasks, written)) goto end;
+
+    const struct xcf_tile_slot_t *slot = &xcf->slots[written % n_slots];
+    XCF_TRACE(&xcf->trace, XCF_TRACE_WRITE, 1, written);
+    if(xcf_fwrite_timed(xcf, slot->result, 1, slot->length) != slot->length)
+    {
+      PRINT_ERROR("error: can't write image data");
+      goto end;
+    }
+    XCF_TRACE(&xcf->trace, XCF_TRACE_WRITE, 0, written);
+    xcf->offsets[written] = offset;
+    offset += slot->length;
+
+    if(!xcf_report_progress(xcf, written + 1, n_tiles)) goto end;
+  }
+
+  res = xcf_write_tile_pointers(xcf, tiles_list, data_start, xcf->offsets, n_tiles);
+  if(res) xcf_count_level(xcf, (uint64_t)width * height * n_channels * xcf_precision_size(xcf->image.precision),
+                          offset, n_tiles, 0);
+
+end:
+  // the slots can only be used again once everything that was submitted is done
+  for(uint64_t task = written + 1; task < submitted; task++)
+    xcf_task_wait(xcf->tasks, task);
+  return res;
+}
+#endif
+
+// n_channels is the number of channels that get written. the source can have a different number of channels
+// and a different precision, it gets converted while writing
+static int xcf_add_hierarchy(XCF *xcf, const xcf_source_t *source, const uint32_t width, const uint32_t height,
+                             const int n_channels)
+{
+  int res = 0;
+  const uint32_t bpp = n_channels * xcf_precision_size(xcf->image.precision);
+  xcf_tile_encoder_t *encoder = &xcf->encoder;
+
+  uint64_t tiles_list;
+  if(!xcf_write_level_start(xcf, width, height, bpp, &tiles_list)) goto end;
+
+  // the offsets of the tiles need to fit into the memory limit as well
+  const uint64_t n_tiles = xcf_n_tiles(width, height);
+  const uint64_t offsets_extra = n_tiles * sizeof(uint64_t) > xcf->offsets_allocated
+                                 ? n_tiles * sizeof(uint64_t) - xcf->offsets_allocated : 0;
+
+#ifdef XCF_ENABLE_THREADS
+  // static handles have no memory for the slots
+  const int n_threads = xcf->static_memory ? 0 : xcf_scheduler_threads();
+  if(n_threads > 0)
+  {
+    // enough tiles in flight to keep all workers busy while the writer is waiting for the next one, as long as
+    // the memory limit allows. with less than 2 it's written without the scheduler
+    const uint32_t n_slots = xcf_afford_slots(xcf, source, n_channels, MIN(2 * (n_threads + 1), 64),
+                                              offsets_extra);
+    if(n_slots)
+    {
+      res = xcf_add_hierarchy_parallel(xcf, source, width, height, n_channels, n_slots, tiles_list);
+      goto end;
+    }
+  }
+#endif
+
+  if(!xcf_reserve_encoder(xcf, source, n_channels, offsets_extra)) goto end;
+  if(!xcf_tile_encoder_init(encoder, source, width, height, n_channels, xcf->image.precision, xcf->image.p_compression,
+                            xcf->image.zlib_level)
+     || !xcf_grow_offsets(xcf, n_tiles))
+    goto end;
+  encoder->trace = &xcf->trace;
+  xcf_count_scratch(xcf);
+
+  // add tiles. the pointers to them are filled in once all are written
+  const uint64_t data_start = ftell(xcf->fd);
+  uint64_t offset = 0;
+  for(uint32_t y = 0, tile_number = 0; y < height; y += TILE_SIZE)
+  {
+    for(uint32_t x = 0; x < width; x += TILE_SIZE, tile_number++)
+    {
+      const uint8_t *tile;
+      size_t length;
+      if(!xcf_encode_tile(encoder, x, y, &tile, &length)) goto end;
+
+      XCF_TRACE(&xcf->trace, XCF_TRACE_WRITE, 1, tile_number);
+      if(xcf_fwrite_timed(xcf, tile, 1, length) != length)
+      {
+        PRINT_ERROR("error: can't write image data");
+        goto end;
+      }
+      XCF_TRACE(&xcf->trace, XCF_TRACE_WRITE, 0, tile_number);
+      xcf->offsets[tile_number] = offset;
+      offset += length;
+
+      if(!xcf_report_progress(xcf, (uint64_t)tile_number + 1, n_tiles)) goto end;
+    }
+  }
+
+  res = xcf_write_tile_pointers(xcf, tiles_list, data_start, xcf->offsets, n_tiles);
+  if(res) xcf_count_level(xcf, (uint64_t)width * height * bpp, offset, n_tiles, 0);
 
   end:
-  free(tile);
-  free(tile_compressed);
-  if(free_data_fixed) free(data_fixed);
   if(!res) xcf->state = XCF_STATE_ERROR;
   return res;
 }
@@ -788,70 +1183,293 @@ static int xcf_add_hierarchy(XCF *xcf, const void *data, const uint32_t width, c
 
 // public api
 
+// the defaults of a new file. everything else is 0
+static void xcf_init_defaults(XCF *xcf)
+{
+  xcf->state = XCF_STATE_IMAGE;
+  xcf->image.p_compression = XCF_PROP_COMPRESSION_ZLIB;
+  xcf->image.zlib_level = XCF_ZLIB_LEVEL_DEFAULT;
+  xcf->min_version = 1;
+  xcf->image.version = 12;
+  xcf->omit_base_alpha = 1; // don't save an alpha channel in the base layer by default
+}
+
 XCF *xcf_open(const char *filename)
 {
-  XCF *xcf = (XCF *)calloc(1, sizeof(XCF));
+  XCF *xcf = (XCF *)xcf_calloc(1, sizeof(XCF));
   if(!xcf) return NULL;
 
   if(!(xcf->fd = fopen(filename, "wb")))
   {
-    free(xcf);
+    xcf_free(xcf);
     return NULL;
   }
 
-  xcf->state = XCF_STATE_IMAGE;
-  xcf->image.p_compression = XCF_PROP_COMPRESSION_ZLIB;
-  xcf->min_version = 1;
-  xcf->image.version = 12;
-  xcf->omit_base_alpha = 1; // don't save an alpha channel in the base layer by default
+  if(!(xcf->filename = xcf_arena_strdup(&xcf->arena, filename)))
+  {
+    fclose(xcf->fd);
+    remove(filename);
+    xcf_free(xcf);
+    return NULL;
+  }
+
+  xcf_init_defaults(xcf);
 
   return xcf;
 }
 
-int xcf_close(XCF *xcf)
+// the parts of the memory of a static handle, in this order. all of them are a multiple of 16 bytes. the encoder
+// comes last and gets the rest, how much zlib needs is only known to xcf_scratch_size()
+typedef struct xcf_static_layout_t
 {
-  if(!xcf) return 1;
+  size_t handle, offsets, stdio, arena;
+} xcf_static_layout_t;
 
-  if(xcf->state == XCF_STATE_ERROR)
+// returns the bytes needed without the encoder
+static size_t xcf_static_layout(xcf_static_layout_t *layout, const xcf_static_desc_t *desc)
+{
+  layout->handle = XCF_ALIGN(sizeof(XCF));
+  layout->offsets = XCF_ALIGN(xcf_n_tiles(desc->width, desc->height) * sizeof(uint64_t));
+  layout->stdio = XCF_ALIGN(BUFSIZ);
+  // everything in the arena is rounded up to 16 bytes. on top of the names and the statistics of the layers there
+  // is room for the header of the block and the small structures of parasites
+  layout->arena = XCF_ALIGN(desc->names_size) + (desc->n_children + 1) * 16
+                  + XCF_ALIGN(desc->n_children * sizeof(xcf_layer_stats_t)) + 4096;
+  // the memory given might not be aligned
+  return layout->handle + layout->offsets + layout->stdio + layout->arena + 15;
+}
+
+size_t xcf_scratch_size(const xcf_static_desc_t *desc)
+{
+  xcf_static_layout_t layout;
+  const size_t encoder = xcf_tile_encoder_static_size(desc->precision);
+  return encoder ? xcf_static_layout(&layout, desc) + encoder : 0;
+}
+
+XCF *xcf_open_static(const char *filename, void *memory, const size_t size, const xcf_static_desc_t *desc)
+{
+  xcf_static_layout_t layout;
+  const size_t needed = xcf_static_layout(&layout, desc);
+  if(!memory || size <= needed)
   {
-    PRINT_ERROR("error: the file is in error state. better add some error handling.");
-    return 0;
+    PRINT_ERROR("error: the memory given to xcf_open_static() is too small, see xcf_scratch_size()");
+    return NULL;
   }
 
-  int res = 1;
+  uint8_t *next = (uint8_t *)XCF_ALIGN((uintptr_t)memory);
+  XCF *xcf = (XCF *)next;
+  memset(xcf, 0, sizeof(XCF));
+  xcf->static_memory = 1;
+  next += layout.handle;
+  xcf->offsets = (uint64_t *)next;
+  xcf->offsets_allocated = layout.offsets;
+  next += layout.offsets;
+  xcf->stdio_buffer = (char *)next;
+  next += layout.stdio;
+  xcf_arena_init_static(&xcf->arena, next, layout.arena);
+  next += layout.arena;
+  if(!xcf_tile_encoder_init_static(&xcf->encoder, next, size - (next - (uint8_t *)memory), desc->precision))
+  {
+    PRINT_ERROR("error: the memory given to xcf_open_static() is too small, see xcf_scratch_size()");
+    return NULL;
+  }
 
-  if(xcf->state == XCF_STATE_IMAGE)
-    xcf_write_image_header(xcf);
+  // nothing to give back on errors, all memory belongs to the caller
+  if(!(xcf->fd = fopen(filename, "wb"))) return NULL;
+  setvbuf(xcf->fd, xcf->stdio_buffer, _IOFBF, BUFSIZ);
 
-  if(xcf->state != XCF_STATE_MAIN)
+  if(!(xcf->filename = xcf_arena_strdup(&xcf->arena, filename)))
   {
-    PRINT_ERROR("error: incomplete data written");
-    res = 0;
+    PRINT_ERROR("error: the file name is longer than names_size allows");
+    fclose(xcf->fd);
+    remove(filename);
+    return NULL;
   }
 
-  if(xcf->n_layers != xcf->next_layer || xcf->n_channels != xcf->next_channel)
+  xcf_init_defaults(xcf);
+
+  return xcf;
+}
+
+// write outstanding data and close the file, but keep the handle and its buffers
+static int xcf_finish(XCF *xcf)
+{
+  int res = 1;
+
+  if(xcf->cancelled)
+    res = 0; // the file is gone already
+  else if(xcf->state == XCF_STATE_ERROR)
   {
-    PRINT_ERROR("error: not all layers/channels were added. %u / %u layers and %u / %u channels written",
-                xcf->next_layer, xcf->n_layers, xcf->next_channel, xcf->n_channels);
+    PRINT_ERROR("error: the file is in error state. better add some error handling.");
     res = 0;
   }
+  else
+  {
+    if(xcf->state == XCF_STATE_IMAGE)
+      xcf_write_image_header(xcf);
+
+    if(xcf->state != XCF_STATE_MAIN)
+    {
+      PRINT_ERROR("error: incomplete data written");
+      res = 0;
+    }
+
+    if(xcf->n_layers != xcf->next_layer || xcf->n_channels != xcf->next_channel)
+    {
+      PRINT_ERROR("error: not all layers/channels were added. %u / %u layers and %u / %u channels written",
+                  xcf->next_layer, xcf->n_layers, xcf->next_channel, xcf->n_channels);
+      res = 0;
+    }
+
+    // the colors found while adding layers. unused entries stay black
+    if(xcf->image.colormap && !xcf->image.palette.fixed
+       && (xcf_fseek(xcf, xcf->image.colormap, SEEK_SET) != 0
+           || xcf_fwrite(xcf, xcf->image.palette.colors, 1, sizeof(xcf->image.palette.colors))
+              != sizeof(xcf->image.palette.colors)))
+    {
+      PRINT_ERROR("error: can't write the colormap");
+      res = 0;
+    }
+  }
 
 //   printf("version: %d\nmin_version: %d\npointer size: %d\nbase_type: %u\nprecision: %u\nwidth: %u\nheight: %u\nlayers: %u\nchannels: %u\n", xcf->image.version, xcf->min_version, xcf_pointer_size(xcf), xcf->image.base_type, xcf->image.precision, xcf->image.width, xcf->image.height, xcf->next_layer, xcf->next_channel);
 
-  if(xcf->fd) fclose(xcf->fd);
+  if(xcf->fd && fclose(xcf->fd) != 0)
+  {
+    PRINT_ERROR("error: can't close the file");
+    res = 0;
+  }
   xcf->fd = NULL;
-  free(xcf->child.name);
-  xcf->child.name = NULL;
-  xcf_parasites_free(xcf->image.parasites);
-  xcf->image.parasites = NULL;
-  xcf_parasites_free(xcf->child.parasites);
-  xcf->child.parasites = NULL;
-  xcf->state = XCF_STATE_ERROR; // just in case someone keeps using the memory
-  free(xcf);
+  xcf->state = XCF_STATE_ERROR; // nothing can be written until there is a new file
+
+  // borrowed parasite data of headers that were never written
+  xcf_parasites_release(xcf->image.parasites);
+  xcf_parasites_release(xcf->child.parasites);
+
+  return res;
+}
+
+int xcf_close(XCF *xcf)
+{
+  if(!xcf) return 1;
+
+  // everything gets freed, no matter if there was an error or not
+  XCF_TRACE(&xcf->trace, XCF_TRACE_CLOSE, 1, 0);
+  const int res = xcf_finish(xcf);
+  XCF_TRACE(&xcf->trace, XCF_TRACE_CLOSE, 0, 0);
+  xcf_tile_encoder_cleanup(&xcf->encoder);
+  if(!xcf->static_memory) xcf_free(xcf->offsets);
+#ifdef XCF_ENABLE_THREADS
+  xcf_free_slots(xcf);
+#endif
+  xcf_palette_free(&xcf->image.palette);
+  xcf_arena_free(&xcf->arena);
+  if(!xcf->static_memory) xcf_free(xcf);
+
+  return res;
+}
+
+int xcf_reset(XCF *xcf, const char *filename)
+{
+  if(!xcf) return 0;
+
+  XCF_TRACE(&xcf->trace, XCF_TRACE_CLOSE, 1, 0);
+  const int res = xcf_finish(xcf);
+  XCF_TRACE(&xcf->trace, XCF_TRACE_CLOSE, 0, 0);
+
+  // start from scratch, apart from the encoders and the arena with all their memory
+  XCF kept = *xcf;
+  memset(xcf, 0, sizeof(*xcf));
+  xcf->encoder = kept.encoder;
+  xcf->encoder.gather_ns = xcf->encoder.compress_ns = 0;
+  xcf->trace = kept.trace;
+  xcf->progress = kept.progress;
+  xcf->offsets = kept.offsets;
+  xcf->offsets_allocated = kept.offsets_allocated;
+  xcf->arena = kept.arena;
+  xcf->image.palette.nearest = kept.image.palette.nearest;
+  xcf->static_memory = kept.static_memory;
+  xcf->stdio_buffer = kept.stdio_buffer;
+  xcf_arena_reset(&xcf->arena);
+#ifdef XCF_ENABLE_THREADS
+  xcf->tasks = kept.tasks;
+  xcf->slots = kept.slots;
+  xcf->n_slots = kept.n_slots;
+  for(uint32_t i = 0; i < xcf->n_slots; i++)
+    xcf->slots[i].encoder.gather_ns = xcf->slots[i].encoder.compress_ns = 0;
+#endif
+
+  if(!(xcf->fd = fopen(filename, "wb")))
+  {
+    PRINT_ERROR("error: can't open '%s'", filename);
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+  if(xcf->stdio_buffer) setvbuf(xcf->fd, xcf->stdio_buffer, _IOFBF, BUFSIZ);
+
+  if(!(xcf->filename = xcf_arena_strdup(&xcf->arena, filename)))
+  {
+    PRINT_ERROR("error: out of memory");
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
+  xcf_init_defaults(xcf);
 
   return res;
 }
 
+int xcf_set_trace(XCF *xcf, xcf_trace_func_t func, void *user)
+{
+#ifdef XCF_ENABLE_TRACING
+  if(!xcf) return 0;
+  xcf->trace.func = func;
+  xcf->trace.user = user;
+  return 1;
+#else
+  (void)xcf;
+  (void)func;
+  (void)user;
+  PRINT_ERROR("error: libxcf was built without tracing");
+  return 0;
+#endif
+}
+
+int xcf_set_progress(XCF *xcf, xcf_progress_func_t func, void *user, const uint32_t n_tiles)
+{
+  if(!xcf) return 0;
+  xcf->progress.func = func;
+  xcf->progress.user = user;
+  xcf->progress.n_tiles = n_tiles;
+  return 1;
+}
+
+int xcf_get_stats(XCF *xcf, xcf_stats_t *stats)
+{
+  if(!xcf || !stats) return 0;
+
+  *stats = xcf->stats;
+  stats->peak_memory_bytes = MAX(stats->peak_memory_bytes, xcf_memory_used(xcf));
+  stats->gather_ns += xcf->encoder.gather_ns;
+  stats->compress_ns += xcf->encoder.compress_ns;
+#ifdef XCF_ENABLE_THREADS
+  for(uint32_t i = 0; i < xcf->n_slots; i++)
+  {
+    stats->gather_ns += xcf->slots[i].encoder.gather_ns;
+    stats->compress_ns += xcf->slots[i].encoder.compress_ns;
+  }
+#endif
+
+  // the layers only exist once the image header is written
+  stats->layers = xcf->layer_stats;
+  if(xcf->layer_stats)
+  {
+    stats->n_layers = xcf->n_layers;
+    stats->n_channels = xcf->n_channels;
+  }
+  return 1;
+}
+
 // set fields or properties. depending on the current state it's setting image, layer or channel data
 int xcf_set(XCF *xcf, xcf_field_t field, ...)
 {
@@ -882,6 +1500,30 @@ int xcf_set(XCF *xcf, xcf_field_t field, ...)
       case XCF_WIDTH:           xcf->image.width = va_arg(ap, uint32_t);             break;
       case XCF_HEIGHT:          xcf->image.height = va_arg(ap, uint32_t);            break;
       case XCF_PRECISION:       xcf->image.precision = va_arg(ap, xcf_precision_t);  break;
+      case XCF_MEMORY_LIMIT:
+        xcf->memory_limit = va_arg(ap, uint64_t);
+        if(xcf->static_memory)
+        {
+          // their memory is fixed already, none of it can be given up
+          PRINT_ERROR("error: handles opened with xcf_open_static() can't have a memory limit");
+          xcf->memory_limit = 0;
+          res = 0;
+        }
+        else
+          res = xcf_make_room(xcf, 0, "what was set so far");
+        break;
+      case XCF_ZLIB_LEVEL:
+      {
+        const int level = va_arg(ap, int);
+        if(level < XCF_ZLIB_LEVEL_ADAPTIVE || level > 9)
+        {
+          PRINT_ERROR("error: invalid zlib level %d", level);
+          res = 0;
+        }
+        else
+          xcf->image.zlib_level = level;
+        break;
+      }
       case XCF_PROP:
       {
         propid = va_arg(ap, uint32_t);
@@ -890,21 +1532,19 @@ int xcf_set(XCF *xcf, xcf_field_t field, ...)
           case XCF_PROP_END:
             // FIXME: shall we offer this at all?
             break;
-          // TODO
-          // case XCF_PROP_COLORMAP:
-          // break;
+          case XCF_PROP_COLORMAP:
+          {
+            const uint32_t n_colors = va_arg(ap, uint32_t);
+            const uint8_t *colors = va_arg(ap, uint8_t *);
+            res = xcf_palette_set(&xcf->image.palette, colors, n_colors);
+            break;
+          }
           case XCF_PROP_COMPRESSION:
             xcf->image.p_compression = va_arg(ap, int);
             break;
           case XCF_PROP_PARASITES:
-          {
-            const char *name = va_arg(ap, char *);
-            const uint32_t flags = va_arg(ap, uint32_t);
-            const uint32_t length = va_arg(ap, uint32_t);
-            const uint8_t *data = va_arg(ap, uint8_t *);
-            xcf->image.parasites = xcf_parasites_add(xcf->image.parasites, name, flags, length, data);
+            res = xcf_parasites_set(xcf, &xcf->image.parasites, &ap);
             break;
-          }
           default: res = 0;
         }
         break;
@@ -921,7 +1561,7 @@ int xcf_set(XCF *xcf, xcf_field_t field, ...)
     {
       case XCF_WIDTH:  xcf->child.width = va_arg(ap, uint32_t);      break;
       case XCF_HEIGHT: xcf->child.height = va_arg(ap, uint32_t);     break;
-      case XCF_NAME:   xcf->child.name = strdup(va_arg(ap, char *)); break;
+      case XCF_NAME:   res = xcf_set_name(xcf, va_arg(ap, char *));     break;
       case XCF_PROP:
       {
         propid = va_arg(ap, uint32_t);
@@ -945,14 +1585,8 @@ int xcf_set(XCF *xcf, xcf_field_t field, ...)
             xcf->child.p_offset_y = va_arg(ap, int32_t);
             break;
           case XCF_PROP_PARASITES:
-          {
-            const char *name = va_arg(ap, char *);
-            const uint32_t flags = va_arg(ap, uint32_t);
-            const uint32_t length = va_arg(ap, uint32_t);
-            const uint8_t *data = va_arg(ap, uint8_t *);
-            xcf->child.parasites = xcf_parasites_add(xcf->child.parasites, name, flags, length, data);
+            res = xcf_parasites_set(xcf, &xcf->child.parasites, &ap);
             break;
-          }
           case XCF_PROP_FLOAT_OPACITY:
             xcf->child.p_opacity = va_arg(ap, double);
             xcf->child.p_opacity = CLAMP(xcf->child.p_opacity, 0.0, 1.0);
@@ -983,7 +1617,7 @@ int xcf_set(XCF *xcf, xcf_field_t field, ...)
       // width and height have to be the same as in the parent, no need to allow setting it
       // case XCF_WIDTH:  xcf->child.width = va_arg(ap, uint32_t);   break;
       // case XCF_HEIGHT: xcf->child.height = va_arg(ap, uint32_t);  break;
-      case XCF_NAME:   xcf->child.name = strdup(va_arg(ap, char *)); break;
+      case XCF_NAME:   res = xcf_set_name(xcf, va_arg(ap, char *));     break;
       case XCF_PROP:
       {
         propid = va_arg(ap, uint32_t);
@@ -1004,14 +1638,8 @@ int xcf_set(XCF *xcf, xcf_field_t field, ...)
             }
             break;
           case XCF_PROP_PARASITES:
-          {
-            const char *name = va_arg(ap, char *);
-            const uint32_t flags = va_arg(ap, uint32_t);
-            const uint32_t length = va_arg(ap, uint32_t);
-            const uint8_t *data = va_arg(ap, uint8_t *);
-            xcf->child.parasites = xcf_parasites_add(xcf->child.parasites, name, flags, length, data);
+            res = xcf_parasites_set(xcf, &xcf->child.parasites, &ap);
             break;
-          }
           case XCF_PROP_FLOAT_OPACITY:
             xcf->child.p_opacity = va_arg(ap, double);
             xcf->child.p_opacity = CLAMP(xcf->child.p_opacity, 0.0, 1.0);
@@ -1078,7 +1706,8 @@ int xcf_set(XCF *xcf, xcf_field_t field, ...)
   return res;
 }
 
-int xcf_add_layer(XCF *xcf)
+// start a new layer with the default properties
+static int xcf_begin_layer(XCF *xcf)
 {
   if(xcf->state == XCF_STATE_ERROR)
   {
@@ -1105,11 +1734,11 @@ int xcf_add_layer(XCF *xcf)
 
   xcf->state = XCF_STATE_LAYER;
 
-  free(xcf->child.name);
-  xcf_parasites_free(xcf->child.parasites);
   memset(&xcf->child, 0, sizeof(xcf->child));
   xcf->child.n = xcf->next_layer;
+  xcf->child.stats = &xcf->layer_stats[xcf->child.n];
   xcf->next_layer++;
+  XCF_TRACE(&xcf->trace, XCF_TRACE_LAYER, 1, xcf->child.n);
 
   // set some defaults for the properties
   xcf->child.p_opacity = 1.0;
@@ -1125,6 +1754,87 @@ int xcf_add_layer(XCF *xcf)
   return 1;
 }
 
+int xcf_add_layer(XCF *xcf)
+{
+  return xcf_begin_layer(xcf);
+}
+
+void xcf_layer_desc_init(xcf_layer_desc_t *desc, const uint32_t width, const uint32_t height)
+{
+  memset(desc, 0, sizeof(*desc));
+  desc->width = width;
+  desc->height = height;
+  desc->opacity = 1.0;
+  desc->visible = 1;
+  desc->mode = -1;
+  desc->composite_mode = -1;
+  desc->composite_space = -1;
+  desc->blend_space = -1;
+}
+
+// hand the data of the parasites of a layer description from first on back, they didn't make it into the handle
+static void xcf_release_parasite_descs(const xcf_layer_desc_t *desc, const uint32_t first)
+{
+  if(!desc->parasites) return;
+  for(uint32_t i = first; i < desc->n_parasites; i++)
+    if(desc->parasites[i].release)
+      desc->parasites[i].release((void *)desc->parasites[i].data, desc->parasites[i].release_user);
+}
+
+int xcf_add_layer_desc(XCF *xcf, const xcf_layer_desc_t *desc)
+{
+  if(!xcf_begin_layer(xcf))
+  {
+    xcf_release_parasite_descs(desc, 0);
+    return 0;
+  }
+
+  if(desc->width == 0 || desc->height == 0 || (desc->n_parasites > 0 && !desc->parasites))
+  {
+    PRINT_ERROR("error: invalid layer description");
+    xcf_release_parasite_descs(desc, 0);
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
+  xcf->child.width = desc->width;
+  xcf->child.height = desc->height;
+  // the header is written before returning, so the name doesn't have to be copied
+  xcf->child.name = (char *)desc->name;
+  xcf->child.p_opacity = CLAMP(desc->opacity, 0.0, 1.0);
+  xcf->child.p_visible = desc->visible ? 1 : 0;
+  xcf->child.p_mode = desc->mode;
+  xcf->child.p_offset_x = desc->offset_x;
+  xcf->child.p_offset_y = desc->offset_y;
+  xcf->child.p_composite_mode = desc->composite_mode;
+  xcf->child.p_composite_space = desc->composite_space;
+  xcf->child.p_blend_space = desc->blend_space;
+
+  // for the same reason the parasites are always taken by reference
+  for(uint32_t i = 0; i < desc->n_parasites; i++)
+  {
+    const xcf_parasite_desc_t *parasite = &desc->parasites[i];
+    if(!xcf_parasites_add(&xcf->arena, &xcf->child.parasites, parasite->name,
+                          parasite->flags | XCF_PARASITE_BY_REFERENCE, parasite->length,
+                          (const uint8_t *)parasite->data, parasite->release, parasite->release_user))
+    {
+      PRINT_ERROR("error: out of memory");
+      // the ones added so far belong to the handle now
+      xcf_parasites_release(xcf->child.parasites);
+      xcf_release_parasite_descs(desc, i);
+      xcf->state = XCF_STATE_ERROR;
+      return 0;
+    }
+  }
+
+  if(!xcf_write_layer_header(xcf))
+  {
+    xcf_parasites_release(xcf->child.parasites);
+    return 0;
+  }
+  return 1;
+}
+
 // TODO: handle layer masks
 int xcf_add_channel(XCF *xcf)
 {
@@ -1153,11 +1863,11 @@ int xcf_add_channel(XCF *xcf)
 
   xcf->state = XCF_STATE_CHANNEL;
 
-  free(xcf->child.name);
-  xcf_parasites_free(xcf->child.parasites);
   memset(&xcf->child, 0, sizeof(xcf->child));
   xcf->child.n = xcf->next_channel;
+  xcf->child.stats = &xcf->layer_stats[xcf->n_layers + xcf->child.n];
   xcf->next_channel++;
+  XCF_TRACE(&xcf->trace, XCF_TRACE_CHANNEL, 1, xcf->child.n);
 
   // channels are always grayscale, i.e., single channel (how confusing, having two concepts called "channel")
   xcf->child.type = XCF_TYPE_GRAYSCALE;
@@ -1177,20 +1887,100 @@ int xcf_add_channel(XCF *xcf)
   return 1;
 }
 
-int xcf_add_data(XCF *xcf, const void *data, const int data_channels)
+// make sure that the palette has all the colors of the source, or the best approximation when they don't fit
+static int xcf_prepare_palette(XCF *xcf, const xcf_source_t *source, const uint32_t width, const uint32_t height,
+                               const int n_channels)
 {
-  if(xcf->state == XCF_STATE_ERROR)
+  xcf_palette_t *palette = &xcf->image.palette;
+  const int color_channels = n_channels == 2 ? 4 : 3;
+  const size_t row_size = (size_t)width * color_channels;
+  int res = 0;
+  xcf_histogram_t *histogram = NULL;
+  const size_t row_allocated = row_size + xcf_gather_scratch_size(source, color_channels, width);
+  uint8_t *row = NULL;
+  if(!xcf_check_static(xcf, "creating the palette")) goto end;
+  if(!xcf_make_room(xcf, row_allocated, "creating the palette")) goto end;
+  row = (uint8_t *)xcf_malloc(row_allocated);
+  if(!row) goto end;
+  xcf_count_memory(xcf, row_allocated);
+  uint8_t *scratch = row + row_size;
+  const xcf_gather_kernel_t kernel = xcf_gather_select(source, color_channels, XCF_PRECISION_I_8_G);
+
+  // try to get away with an exact palette first. when that fails the colors it added are dropped again, the
+  // approximation has to decide on the free entries
+  palette->approximate = 0;
+  const xcf_palette_t before = *palette;
+  int exact = 1;
+  for(uint32_t y = 0; y < height && exact; y++)
   {
-    PRINT_ERROR("error: the file is in error state. better add some error handling.");
-    return 0;
+    xcf_gather_row(source, 0, y, width, row, color_channels, XCF_PRECISION_I_8_G, kernel, scratch);
+    exact = xcf_palette_add(palette, row, color_channels, width);
   }
 
-  int res = 0;
+  if(!exact)
+  {
+    *palette = before;
+    if(!xcf_make_room(xcf, row_allocated + xcf_histogram_memory(), "approximating the palette")) goto end;
+    histogram = xcf_histogram_new();
+    if(!histogram) goto end;
+    for(uint32_t y = 0; y < height; y++)
+    {
+      xcf_gather_row(source, 0, y, width, row, color_channels, XCF_PRECISION_I_8_G, kernel, scratch);
+      xcf_histogram_add(histogram, row, color_channels, width);
+    }
+    if(!xcf_palette_approximate(palette, histogram)) goto end;
+    xcf_count_memory(xcf, row_allocated + xcf_histogram_memory() - xcf_palette_memory(palette));
+  }
 
-  if(xcf->state == XCF_STATE_LAYER)
-    res = xcf_write_layer_header(xcf);
-  else if(xcf->state == XCF_STATE_CHANNEL)
-    res = xcf_write_channel_header(xcf);
+  res = 1;
+
+end:
+  if(!res)
+  {
+    PRINT_ERROR("error: can't create the palette");
+    xcf->state = XCF_STATE_ERROR;
+  }
+  xcf_histogram_free(histogram);
+  xcf_free(row);
+  return res;
+}
+
+int xcf_add_data(XCF *xcf, const void *data, const int data_channels)
+{
+  xcf_data_t d;
+  memset(&d, 0, sizeof(d));
+  d.data = data;
+  d.channels = data_channels;
+  return xcf_add_data_ex(xcf, &d);
+}
+
+// write the header of the current layer or channel, right before its pixel data
+// the pixel data of the current layer or channel was written, go back to the main state
+static void xcf_end_child(XCF *xcf)
+{
+  XCF_TRACE(&xcf->trace,
+            xcf->state == XCF_STATE_CHANNEL || xcf->state == XCF_STATE_CHANNEL_INTERMEDIATE
+              ? XCF_TRACE_CHANNEL : XCF_TRACE_LAYER,
+            0, xcf->child.n);
+  xcf->state = XCF_STATE_MAIN;
+}
+
+static int xcf_start_data(XCF *xcf)
+{
+  if(xcf->state == XCF_STATE_ERROR)
+  {
+    PRINT_ERROR("error: the file is in error state. better add some error handling.");
+    return 0;
+  }
+
+  int res = 0;
+
+  if(xcf->state == XCF_STATE_LAYER)
+    res = xcf_write_layer_header(xcf);
+  else if(xcf->state == XCF_STATE_LAYER_INTERMEDIATE)
+    res = 1; // added with xcf_add_layer_desc()
+  else if(xcf->state == XCF_STATE_CHANNEL)
+    res = xcf_write_channel_header(xcf);
 
   if(!res)
   {
@@ -1199,45 +1989,671 @@ int xcf_add_data(XCF *xcf, const void *data, const int data_channels)
     return 0;
   }
 
+  return 1;
+}
+
+int xcf_add_data_ex(XCF *xcf, const xcf_data_t *data)
+{
+  if(!xcf_start_data(xcf)) return 0;
+
+  const xcf_precision_t precision = data->precision ? data->precision : xcf->image.precision;
+  if(!xcf_precision_size(precision) || data->channels < 1 || (!data->data && !data->planes[0]))
+  {
+    PRINT_ERROR("error: invalid description of the data");
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
+  xcf_source_t source;
+  xcf_source_init(&source, data->data, xcf->child.width, data->channels, precision);
+  if(!xcf_source_set_memory(&source, data->planes, data->stride, xcf->child.width)
+     || !xcf_source_set_layout(&source, data->order, data->premultiplied))
+  {
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
   // add hierarchy structure
-  int n_channels = 0;
-  switch(xcf->child.type)
-  {
-    case XCF_TYPE_RGB:             n_channels = 3; break;
-    case XCF_TYPE_RGB_ALPHA:       n_channels = 4; break;
-    case XCF_TYPE_GRAYSCALE:       n_channels = 1; break;
-    case XCF_TYPE_GRAYSCALE_ALPHA: n_channels = 2; break;
-    case XCF_TYPE_INDEXED:         n_channels = 1; break;
-    case XCF_TYPE_INDEXED_ALPHA:   n_channels = 2; break;
-  }
-  int channel_size = 0;
-  switch(xcf->image.precision)
-  {
-    case XCF_PRECISION_I_8_L:
-    case XCF_PRECISION_I_8_G:
-      channel_size = 1;
-      break;
-    case XCF_PRECISION_I_16_L:
-    case XCF_PRECISION_I_16_G:
-    case XCF_PRECISION_F_16_L:
-    case XCF_PRECISION_F_16_G:
-      channel_size = 2;
-      break;
-    case XCF_PRECISION_I_32_L:
-    case XCF_PRECISION_I_32_G:
-    case XCF_PRECISION_F_32_L:
-    case XCF_PRECISION_F_32_G:
-      channel_size = 4;
-      break;
-    case XCF_PRECISION_F_64_L:
-    case XCF_PRECISION_F_64_G:
-      channel_size = 8;
-      break;
-  }
-
-  res = xcf_add_hierarchy(xcf, data, xcf->child.width, xcf->child.height, data_channels, n_channels, channel_size);
-
-  if(res) xcf->state = XCF_STATE_MAIN;
+  const int n_channels = xcf_type_channels(xcf->child.type);
+
+  // indexed layers take either the indices or colors that get mapped to the palette
+  if(xcf->child.type == XCF_TYPE_INDEXED || xcf->child.type == XCF_TYPE_INDEXED_ALPHA)
+  {
+    if(data->channels >= 3)
+    {
+      if(!xcf_prepare_palette(xcf, &source, xcf->child.width, xcf->child.height, n_channels)) return 0;
+      source.palette = &xcf->image.palette;
+    }
+    else if(precision != XCF_PRECISION_I_8_G)
+    {
+      PRINT_ERROR("error: the indices of indexed layers have to be 8 bit");
+      xcf->state = XCF_STATE_ERROR;
+      return 0;
+    }
+  }
+
+  const int res = xcf_add_hierarchy(xcf, &source, xcf->child.width, xcf->child.height, n_channels);
+
+  if(res) xcf_end_child(xcf);
+
+  return res;
+}
+
+int xcf_add_data_cb(XCF *xcf, xcf_tile_provider_t provider, void *user)
+{
+  if(!xcf_start_data(xcf)) return 0;
+
+  // the provider fills tiles in the format used by the file, apart from the byte order
+  const int n_channels = xcf_type_channels(xcf->child.type);
+  xcf_source_t source;
+  xcf_source_init(&source, NULL, TILE_SIZE, n_channels, xcf->image.precision);
+  source.provider = provider;
+  source.user = user;
+
+  const int res = xcf_add_hierarchy(xcf, &source, xcf->child.width, xcf->child.height, n_channels);
+
+  if(res) xcf_end_child(xcf);
+
+  return res;
+}
+
+int xcf_add_fill(XCF *xcf, const void *pixel, const int channels)
+{
+  if(!xcf_start_data(xcf)) return 0;
+
+  int res = 0;
+  const int n_channels = xcf_type_channels(xcf->child.type);
+
+  // like with xcf_add_data_ex() an indexed layer takes either an index or a color that gets mapped to the palette
+  const void *fill = pixel;
+  int fill_channels = channels;
+  uint8_t index[2];
+  if((xcf->child.type == XCF_TYPE_INDEXED || xcf->child.type == XCF_TYPE_INDEXED_ALPHA) && pixel && channels >= 3)
+  {
+    xcf_source_t color;
+    xcf_source_init(&color, pixel, 1, channels, xcf->image.precision);
+    if(!xcf_prepare_palette(xcf, &color, 1, 1, n_channels)) return 0;
+    xcf_palette_map(&xcf->image.palette, (const uint8_t *)pixel, MIN(channels, 4), index, n_channels, 1);
+    fill = index;
+    fill_channels = n_channels;
+  }
+
+  const uint32_t width = xcf->child.width, height = xcf->child.height;
+  const uint32_t bpp = n_channels * xcf_precision_size(xcf->image.precision);
+  const size_t pixel_size = (size_t)fill_channels * xcf_precision_size(xcf->image.precision);
+  const uint64_t n_tiles = xcf_n_tiles(width, height);
+  uint8_t *row = NULL;
+  uint64_t *offsets = NULL;
+  xcf_tile_encoder_t *encoder = &xcf->encoder;
+  encoder->trace = &xcf->trace;
+
+  // there are at most 4 distinct tiles: full ones, the ones at the right and bottom edges and the one in the corner.
+  // GIMP derives the size of a tile from the pointer to the next one, so they can't share their data in the file.
+  // instead every tile is a copy of one of these
+  struct { uint32_t width, height; uint8_t *data; size_t length; } blobs[4];
+  memset(blobs, 0, sizeof(blobs));
+  const uint32_t edge_w = width % TILE_SIZE ? width % TILE_SIZE : TILE_SIZE;
+  const uint32_t edge_h = height % TILE_SIZE ? height % TILE_SIZE : TILE_SIZE;
+  blobs[0].width = TILE_SIZE; blobs[0].height = TILE_SIZE;
+  blobs[1].width = edge_w;    blobs[1].height = TILE_SIZE;
+  blobs[2].width = TILE_SIZE; blobs[2].height = edge_h;
+  blobs[3].width = edge_w;    blobs[3].height = edge_h;
+
+  if(!xcf_precision_size(xcf->image.precision) || fill_channels < 1)
+  {
+    PRINT_ERROR("error: invalid fill pixel");
+    goto end;
+  }
+  if(!xcf_check_static(xcf, "xcf_add_fill()")) goto end;
+
+  // the source is a row of pixels. with a stride of 0 it's the source for a whole tile
+  xcf_source_t source;
+  xcf_source_init(&source, NULL, TILE_SIZE, fill_channels, xcf->image.precision);
+  source.stride = 0;
+
+  // the row, the offsets and up to 4 encoded tiles are held on top of the encoder
+  const uint64_t extra = pixel_size * TILE_SIZE + n_tiles * sizeof(uint64_t)
+                         + 4 * (uint64_t)compressBound(bpp * TILE_SIZE * TILE_SIZE);
+  if(!xcf_reserve_encoder(xcf, &source, n_channels, extra)) goto end;
+
+  row = (uint8_t *)xcf_malloc(pixel_size * TILE_SIZE);
+  offsets = (uint64_t *)xcf_malloc(n_tiles * sizeof(uint64_t));
+  if(!row || !offsets)
+  {
+    PRINT_ERROR("error: out of memory");
+    goto end;
+  }
+  for(int i = 0; i < TILE_SIZE; i++)
+    memcpy(row + i * pixel_size, fill, pixel_size);
+  source.data = row;
+
+  uint64_t n_encoded = 0;
+  for(int i = 0; i < 4; i++)
+  {
+    // the smaller tiles only exist when the layer isn't a multiple of the tile size
+    const int partial_x = i & 1, partial_y = i & 2;
+    if((partial_x ? width % TILE_SIZE == 0 : width < TILE_SIZE)
+       || (partial_y ? height % TILE_SIZE == 0 : height < TILE_SIZE))
+      continue;
+    const uint8_t *tile;
+    if(!xcf_tile_encoder_init(encoder, &source, blobs[i].width, blobs[i].height, n_channels, xcf->image.precision,
+                              xcf->image.p_compression, xcf->image.zlib_level)
+       || !xcf_encode_tile(encoder, 0, 0, &tile, &blobs[i].length))
+      goto end;
+    xcf_count_scratch(xcf);
+    n_encoded++;
+    blobs[i].data = (uint8_t *)xcf_malloc(blobs[i].length);
+    if(!blobs[i].data)
+    {
+      PRINT_ERROR("error: out of memory");
+      goto end;
+    }
+    memcpy(blobs[i].data, tile, blobs[i].length);
+  }
+  xcf_count_memory(xcf, pixel_size * TILE_SIZE + n_tiles * sizeof(uint64_t) + blobs[0].length + blobs[1].length
+                          + blobs[2].length + blobs[3].length);
+
+  uint64_t tiles_list;
+  if(!xcf_write_level_start(xcf, width, height, bpp, &tiles_list)) goto end;
+
+  const uint64_t data_start = ftell(xcf->fd);
+  uint64_t offset = 0;
+  for(uint32_t y = 0, tile_number = 0; y < height; y += TILE_SIZE)
+  {
+    for(uint32_t x = 0; x < width; x += TILE_SIZE, tile_number++)
+    {
+      const int blob = (width - x < TILE_SIZE ? 1 : 0) + (height - y < TILE_SIZE ? 2 : 0);
+      XCF_TRACE(&xcf->trace, XCF_TRACE_WRITE, 1, tile_number);
+      if(xcf_fwrite_timed(xcf, blobs[blob].data, 1, blobs[blob].length) != blobs[blob].length)
+      {
+        PRINT_ERROR("error: can't write image data");
+        goto end;
+      }
+      XCF_TRACE(&xcf->trace, XCF_TRACE_WRITE, 0, tile_number);
+      offsets[tile_number] = offset;
+      offset += blobs[blob].length;
+    }
+  }
+  if(!xcf_write_tile_pointers(xcf, tiles_list, data_start, offsets, n_tiles)) goto end;
+  xcf_count_level(xcf, (uint64_t)width * height * bpp, offset, n_tiles, n_tiles - n_encoded);
+
+  res = 1;
+  xcf_end_child(xcf);
+
+end:
+  for(int i = 0; i < 4; i++)
+    xcf_free(blobs[i].data);
+  xcf_free(row);
+  xcf_free(offsets);
+  if(!res) xcf->state = XCF_STATE_ERROR;
+  return res;
+}
+
+int xcf_copy_layer(XCF *xcf, const char *filename, const uint32_t layer_index)
+{
+  if(xcf->state == XCF_STATE_ERROR)
+  {
+    PRINT_ERROR("error: the file is in error state. better add some error handling.");
+    return 0;
+  }
+
+  if(xcf->state != XCF_STATE_LAYER)
+  {
+    PRINT_ERROR("error: no open layer to copy data into");
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
+  if(!xcf_check_static(xcf, "xcf_copy_layer()"))
+  {
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
+  int res = 0;
+  xcf_info_t info;
+  xcf_info_layer_t layer;
+  xcf_reader_t *reader = NULL;
+  uint64_t *tiles = NULL;
+  memset(&info, 0, sizeof(info));
+  memset(&layer, 0, sizeof(layer));
+
+  // the reader and the pointers to the tiles are held on top of the handle while copying
+  if(!xcf_make_room(xcf, sizeof(xcf_reader_t), "reading the layer to copy")) goto end;
+  reader = (xcf_reader_t *)xcf_calloc(1, sizeof(xcf_reader_t));
+  if(!reader)
+  {
+    PRINT_ERROR("error: out of memory");
+    goto end;
+  }
+  xcf_count_memory(xcf, sizeof(xcf_reader_t));
+
+  if(!xcf_reader_open(reader, filename, "rb"))
+  {
+    PRINT_ERROR("error: can't open '%s' for reading", filename);
+    goto end;
+  }
+
+  uint64_t offset;
+  if(!xcf_read_image_header(reader, &info, 0, &offset)) goto corrupt;
+
+  // we copy the compressed tiles verbatim, so they have to be usable as they are
+  if(info.precision != xcf->image.precision)
+  {
+    PRINT_ERROR("error: can't copy a layer with precision '%s' into an image with precision '%s'",
+                xcf_get_precision_name(info.precision), xcf_get_precision_name(xcf->image.precision));
+    goto end;
+  }
+  if(info.compression != xcf->image.p_compression)
+  {
+    PRINT_ERROR("error: can't copy a layer with compression '%s' into an image with compression '%s'",
+                xcf_get_compression_name(info.compression), xcf_get_compression_name(xcf->image.p_compression));
+    goto end;
+  }
+
+  uint64_t layer_offset = 0;
+  for(uint32_t i = 0; i <= layer_index; i++)
+  {
+    if(!xcf_reader_pointer(reader, &offset, &layer_offset)) goto corrupt;
+    if(!layer_offset)
+    {
+      PRINT_ERROR("error: '%s' has no layer %u", filename, layer_index);
+      goto end;
+    }
+  }
+
+  uint64_t hierarchy;
+  if(!xcf_read_layer_header(reader, layer_offset, &layer, 0, &hierarchy)) goto corrupt;
+
+  xcf_type_t type;
+  if(!xcf_layer_type(xcf, &type)) goto end;
+  if(layer.type != type)
+  {
+    PRINT_ERROR("error: can't copy a layer of type '%s' into a layer of type '%s'",
+                xcf_get_type_name(layer.type), xcf_get_type_name(type));
+    goto end;
+  }
+
+  // the indices only keep their colors when the colormaps agree
+  if(type == XCF_TYPE_INDEXED || type == XCF_TYPE_INDEXED_ALPHA)
+  {
+    uint8_t colors[256 * 3];
+    uint64_t colormap = reader->colormap;
+    if(!colormap || !xcf_reader_read(reader, &colormap, colors, 3 * reader->n_colors)) goto corrupt;
+    if(!xcf_palette_merge(&xcf->image.palette, colors, reader->n_colors))
+    {
+      PRINT_ERROR("error: the colormap of '%s' doesn't match the one of the image", filename);
+      goto end;
+    }
+  }
+
+  // read the hierarchy, the level and the pointers to the tiles
+  uint32_t width, height, bpp, level_width, level_height;
+  uint64_t level;
+  offset = hierarchy;
+  if(!xcf_reader_uint32(reader, &offset, &width)
+     || !xcf_reader_uint32(reader, &offset, &height)
+     || !xcf_reader_uint32(reader, &offset, &bpp)
+     || !xcf_reader_pointer(reader, &offset, &level))
+    goto corrupt;
+  offset = level;
+  if(!xcf_reader_uint32(reader, &offset, &level_width) || !xcf_reader_uint32(reader, &offset, &level_height))
+    goto corrupt;
+  if(width != layer.width || height != layer.height || level_width != width || level_height != height
+     || bpp != (uint32_t)(xcf_type_channels(type) * xcf_precision_size(xcf->image.precision)))
+    goto corrupt;
+
+  const uint64_t n_tiles = xcf_n_tiles(width, height);
+  if(n_tiles == 0) goto corrupt;
+  if(!xcf_make_room(xcf, sizeof(xcf_reader_t) + n_tiles * sizeof(uint64_t), "copying the layer")) goto end;
+  tiles = (uint64_t *)xcf_malloc(n_tiles * sizeof(uint64_t));
+  if(!tiles)
+  {
+    PRINT_ERROR("error: out of memory");
+    goto end;
+  }
+  xcf_count_memory(xcf, sizeof(xcf_reader_t) + n_tiles * sizeof(uint64_t));
+
+  // all tiles get copied as one block from the lowest to the end of the highest offset
+  uint64_t first = UINT64_MAX, last = 0, last_tile = 0;
+  for(uint64_t i = 0; i < n_tiles; i++)
+  {
+    if(!xcf_reader_pointer(reader, &offset, &tiles[i]) || !tiles[i]) goto corrupt;
+    first = MIN(first, tiles[i]);
+    if(tiles[i] >= last)
+    {
+      last = tiles[i];
+      last_tile = i;
+    }
+  }
+
+  uint64_t last_length;
+  if(info.compression == XCF_PROP_COMPRESSION_NONE)
+  {
+    const uint32_t n_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const uint32_t x = (last_tile % n_tiles_x) * TILE_SIZE;
+    const uint32_t y = (last_tile / n_tiles_x) * TILE_SIZE;
+    last_length = (uint64_t)MIN(TILE_SIZE, width - x) * MIN(TILE_SIZE, height - y) * bpp;
+  }
+  else if(!xcf_reader_zlib_length(reader, last, &last_length))
+    goto corrupt;
+
+  // the size is defined by the source layer
+  xcf->child.width = width;
+  xcf->child.height = height;
+  if(!xcf_write_layer_header(xcf)) goto end;
+
+  uint64_t tiles_list;
+  if(!xcf_write_level_start(xcf, width, height, bpp, &tiles_list)) goto end;
+
+  const uint64_t data_start = ftell(xcf->fd);
+  const uint64_t length = last + last_length - first;
+  const uint64_t start = xcf_now_ns();
+  if(!xcf_reader_copy(reader, first, length, xcf->fd))
+  {
+    PRINT_ERROR("error: can't copy image data");
+    goto end;
+  }
+  xcf->stats.io_ns += xcf_now_ns() - start;
+  xcf->stats.write_calls++;
+  xcf->stats.bytes_written += length;
+
+  // the only thing that changes are the pointers to the tiles
+  if(!xcf_write_tile_pointers(xcf, tiles_list, data_start - first, tiles, n_tiles)) goto end;
+  xcf_count_level(xcf, (uint64_t)width * height * bpp, length, n_tiles, 0);
+
+  xcf_end_child(xcf);
+  res = 1;
+  goto end;
+
+corrupt:
+  PRINT_ERROR("error: '%s' is not a valid xcf file or layer %u is broken", filename, layer_index);
+
+end:
+  xcf_free(tiles);
+  xcf_info_layer_clear(&layer);
+  xcf_info_clear(&info);
+  if(reader) xcf_reader_close(reader);
+  xcf_free(reader);
+  if(!res) xcf->state = XCF_STATE_ERROR;
+  return res;
+}
+
+xcf_encoded_layer_t *xcf_encode_layer(const xcf_precision_t precision, const xcf_prop_compression_t compression,
+                                      const xcf_type_t type, const uint32_t width, const uint32_t height,
+                                      const void *data, const int data_channels)
+{
+  const int n_channels = xcf_type_channels(type);
+  const int channel_size = xcf_precision_size(precision);
+  if(!n_channels || !channel_size || width == 0 || height == 0)
+  {
+    PRINT_ERROR("error: can't encode a layer with these parameters");
+    return NULL;
+  }
+  // indices only mean something with the colormap of one image, and there is no palette to map colors to
+  if(type == XCF_TYPE_INDEXED || type == XCF_TYPE_INDEXED_ALPHA)
+  {
+    PRINT_ERROR("error: indexed layers can't be encoded on their own");
+    return NULL;
+  }
+
+  int res = 0;
+  xcf_tile_encoder_t encoder;
+  memset(&encoder, 0, sizeof(encoder));
+
+  xcf_encoded_layer_t *layer = (xcf_encoded_layer_t *)xcf_calloc(1, sizeof(xcf_encoded_layer_t));
+  if(!layer) goto end;
+  layer->precision = precision;
+  layer->compression = compression;
+  layer->type = type;
+  layer->width = width;
+  layer->height = height;
+  layer->bpp = n_channels * channel_size;
+  layer->n_tiles = xcf_n_tiles(width, height);
+  layer->offsets = (uint64_t *)xcf_malloc(layer->n_tiles * sizeof(uint64_t));
+  if(!layer->offsets) goto end;
+
+  xcf_source_t source;
+  xcf_source_init(&source, data, width, data_channels, precision);
+  if(!xcf_tile_encoder_init(&encoder, &source, width, height, n_channels, precision, compression,
+                            XCF_ZLIB_LEVEL_DEFAULT))
+    goto end;
+
+  uint64_t allocated = 0;
+  for(uint32_t y = 0, tile_number = 0; y < height; y += TILE_SIZE)
+  {
+    for(uint32_t x = 0; x < width; x += TILE_SIZE, tile_number++)
+    {
+      const uint8_t *tile;
+      size_t length;
+      if(!xcf_encode_tile(&encoder, x, y, &tile, &length)) goto end;
+
+      if(layer->size + length > allocated)
+      {
+        allocated = MAX(2 * allocated, layer->size + length);
+        uint8_t *new_data = (uint8_t *)xcf_realloc(layer->data, allocated);
+        if(!new_data)
+        {
+          PRINT_ERROR("error: out of memory");
+          goto end;
+        }
+        layer->data = new_data;
+      }
+      memcpy(layer->data + layer->size, tile, length);
+      layer->offsets[tile_number] = layer->size;
+      layer->size += length;
+    }
+  }
+
+  res = 1;
+
+end:
+  xcf_tile_encoder_cleanup(&encoder);
+  if(!res)
+  {
+    xcf_encoded_layer_free(layer);
+    return NULL;
+  }
+  return layer;
+}
+
+void xcf_encoded_layer_free(xcf_encoded_layer_t *layer)
+{
+  if(!layer) return;
+  xcf_free(layer->offsets);
+  xcf_free(layer->data);
+  xcf_free(layer);
+}
+
+int xcf_add_encoded_layer(XCF *xcf, const xcf_encoded_layer_t *layer)
+{
+  if(xcf->state == XCF_STATE_ERROR)
+  {
+    PRINT_ERROR("error: the file is in error state. better add some error handling.");
+    return 0;
+  }
+
+  xcf_type_t type;
+  if(xcf->state == XCF_STATE_LAYER)
+  {
+    if(!xcf_layer_type(xcf, &type)) return 0;
+  }
+  else if(xcf->state == XCF_STATE_CHANNEL)
+    type = xcf->child.type;
+  else
+  {
+    PRINT_ERROR("error: no open layer or channel to add data to");
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
 
+  if(layer->precision != xcf->image.precision
+     || layer->compression != xcf->image.p_compression
+     || layer->type != type)
+  {
+    PRINT_ERROR("error: the encoded layer doesn't match the image. it has precision '%s', compression '%s' and type '%s'",
+                xcf_get_precision_name(layer->precision), xcf_get_compression_name(layer->compression),
+                xcf_get_type_name(layer->type));
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+  if(xcf->state == XCF_STATE_CHANNEL && (layer->width != xcf->image.width || layer->height != xcf->image.height))
+  {
+    PRINT_ERROR("error: the size of a channel has to match the image");
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
+  xcf->child.width = layer->width;
+  xcf->child.height = layer->height;
+  // these print their own errors, not all of them are about io
+  const int header = xcf->state == XCF_STATE_LAYER ? xcf_write_layer_header(xcf) : xcf_write_channel_header(xcf);
+  uint64_t tiles_list;
+  if(!header || !xcf_write_level_start(xcf, layer->width, layer->height, layer->bpp, &tiles_list))
+  {
+    xcf->state = XCF_STATE_ERROR;
+    return 0;
+  }
+
+  // the tiles are written as one block, afterwards we only have to relocate the pointers
+  const uint64_t data_start = ftell(xcf->fd);
+  CHECK_IO(xcf, xcf_fwrite_timed(xcf, layer->data, 1, layer->size), layer->size);
+  CHECK_IO(xcf, xcf_write_tile_pointers(xcf, tiles_list, data_start, layer->offsets, layer->n_tiles), 1);
+  xcf_count_level(xcf, (uint64_t)layer->width * layer->height * layer->bpp, layer->size, layer->n_tiles, 0);
+
+  xcf_end_child(xcf);
+  return 1;
+}
+
+int xcf_update_region(const char *filename, const uint32_t layer_index, const uint32_t x, const uint32_t y,
+                      const uint32_t width, const uint32_t height, const void *data, const int data_channels)
+{
+  int res = 0;
+  xcf_info_t info;
+  xcf_info_layer_t layer;
+  uint8_t *tile = NULL;
+  uint8_t *scratch = NULL;
+  memset(&info, 0, sizeof(info));
+  memset(&layer, 0, sizeof(layer));
+
+  xcf_reader_t *reader = (xcf_reader_t *)xcf_calloc(1, sizeof(xcf_reader_t));
+  if(!reader) goto end;
+
+  if(!xcf_reader_open(reader, filename, "r+b"))
+  {
+    PRINT_ERROR("error: can't open '%s' for updating", filename);
+    goto end;
+  }
+
+  uint64_t offset;
+  if(!xcf_read_image_header(reader, &info, 0, &offset)) goto corrupt;
+
+  // only uncompressed tiles have a fixed size that allows overwriting them
+  if(info.compression != XCF_PROP_COMPRESSION_NONE)
+  {
+    PRINT_ERROR("error: only files with compression '%s' can be updated in place, '%s' uses '%s'",
+                xcf_get_compression_name(XCF_PROP_COMPRESSION_NONE), filename,
+                xcf_get_compression_name(info.compression));
+    goto end;
+  }
+
+  uint64_t layer_offset = 0;
+  for(uint32_t i = 0; i <= layer_index; i++)
+  {
+    if(!xcf_reader_pointer(reader, &offset, &layer_offset)) goto corrupt;
+    if(!layer_offset)
+    {
+      PRINT_ERROR("error: '%s' has no layer %u", filename, layer_index);
+      goto end;
+    }
+  }
+
+  uint64_t hierarchy;
+  if(!xcf_read_layer_header(reader, layer_offset, &layer, 0, &hierarchy)) goto corrupt;
+
+  if(width == 0 || height == 0 || x >= layer.width || y >= layer.height
+     || width > layer.width - x || height > layer.height - y)
+  {
+    PRINT_ERROR("error: region %ux%u+%u+%u is outside of layer %u with size %ux%u",
+                width, height, x, y, layer_index, layer.width, layer.height);
+    goto end;
+  }
+
+  const int n_channels = xcf_type_channels(layer.type);
+  const int channel_size = xcf_precision_size(info.precision);
+  const size_t bpp = (size_t)n_channels * channel_size;
+
+  uint32_t stored_bpp;
+  uint64_t level;
+  offset = hierarchy + 2 * sizeof(uint32_t);
+  if(!xcf_reader_uint32(reader, &offset, &stored_bpp) || !xcf_reader_pointer(reader, &offset, &level)) goto corrupt;
+  if(!n_channels || stored_bpp != bpp) goto corrupt;
+  const uint64_t tiles_list = level + 2 * sizeof(uint32_t);
+
+  xcf_source_t source;
+  xcf_source_init(&source, data, width, data_channels, info.precision);
+
+  tile = (uint8_t *)xcf_malloc(bpp * TILE_SIZE * TILE_SIZE);
+  scratch = (uint8_t *)xcf_malloc(xcf_gather_scratch_size(&source, n_channels, TILE_SIZE));
+  if(!tile || !scratch) goto end;
+  const xcf_gather_kernel_t kernel = xcf_gather_select(&source, n_channels, info.precision);
+
+  // only the tiles touched by the region get written
+  const uint32_t n_tiles_x = (layer.width + TILE_SIZE - 1) / TILE_SIZE;
+  const uint32_t x_end = x + width, y_end = y + height;
+  for(uint32_t tile_y = y / TILE_SIZE * TILE_SIZE; tile_y < y_end; tile_y += TILE_SIZE)
+  {
+    for(uint32_t tile_x = x / TILE_SIZE * TILE_SIZE; tile_x < x_end; tile_x += TILE_SIZE)
+    {
+      const uint64_t tile_number = (uint64_t)(tile_y / TILE_SIZE) * n_tiles_x + tile_x / TILE_SIZE;
+      uint64_t pointer_offset = tiles_list + tile_number * reader->pointer_size;
+      uint64_t tile_offset;
+      if(!xcf_reader_pointer(reader, &pointer_offset, &tile_offset) || !tile_offset) goto corrupt;
+
+      const uint32_t tile_w = MIN(TILE_SIZE, layer.width - tile_x);
+      const uint32_t tile_h = MIN(TILE_SIZE, layer.height - tile_y);
+
+      // the part of the tile covered by the region
+      const uint32_t x0 = MAX(x, tile_x), x1 = MIN(x_end, tile_x + tile_w);
+      const uint32_t y0 = MAX(y, tile_y), y1 = MIN(y_end, tile_y + tile_h);
+      const size_t row_length = (size_t)(x1 - x0) * bpp;
+
+      for(uint32_t row = y0; row < y1; row++)
+        xcf_gather_row(&source, x0 - x, row - y, x1 - x0, tile + (size_t)(row - y0) * row_length,
+                       n_channels, info.precision, kernel, scratch);
+
+      const uint64_t start = tile_offset + ((uint64_t)(y0 - tile_y) * tile_w + (x0 - tile_x)) * bpp;
+      if(x0 == tile_x && x1 == tile_x + tile_w)
+      {
+        // full rows of the tile are consecutive in the file
+        if(!xcf_reader_write(reader, start, tile, row_length * (y1 - y0))) goto io_error;
+      }
+      else
+      {
+        for(uint32_t row = y0; row < y1; row++)
+          if(!xcf_reader_write(reader, start + (uint64_t)(row - y0) * tile_w * bpp,
+                               tile + (size_t)(row - y0) * row_length, row_length))
+            goto io_error;
+      }
+    }
+  }
+
+  res = 1;
+  goto end;
+
+io_error:
+  PRINT_ERROR("error: io error");
+  goto end;
+
+corrupt:
+  PRINT_ERROR("error: '%s' is not a valid xcf file or layer %u is broken", filename, layer_index);
+
+end:
+  xcf_free(tile);
+  xcf_free(scratch);
+  xcf_info_layer_clear(&layer);
+  xcf_info_clear(&info);
+  if(reader) xcf_reader_close(reader);
+  xcf_free(reader);
   return res;
 }
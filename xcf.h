@@ -1,6 +1,11 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // the authoritative source for these values is the GIMP source code!
 // any discrepancy is a bug in this file
@@ -42,8 +47,13 @@ typedef enum xcf_parasite_flag_t
 {
   XCF_PARASITE_PERSISTENT = 1,
   XCF_PARASITE_UNDOABLE = 2,
+  // not written to the file. the data isn't copied, two more arguments follow it: an xcf_release_func_t that
+  // gets called once the data isn't needed any longer (may be NULL) and a user pointer that is passed to it
+  XCF_PARASITE_BY_REFERENCE = 1 << 30,
 } xcf_parasite_flag_t;
 
+typedef void (*xcf_release_func_t)(void *data, void *user);
+
 typedef enum xcf_props_t
 {
   XCF_PROP_END = 0,
@@ -165,11 +175,20 @@ typedef enum xcf_field_t
   XCF_N_LAYERS,
   XCF_N_CHANNELS,
   XCF_OMIT_BASE_ALPHA,
+  XCF_ZLIB_LEVEL,
+  XCF_MEMORY_LIMIT, // in bytes, passed as a uint64_t. 0 is no limit
 
   // layer specific
 //   XCF_TYPE
 } xcf_field_t;
 
+// values of XCF_ZLIB_LEVEL besides the levels 0 - 9 of zlib
+typedef enum xcf_zlib_level_t
+{
+  XCF_ZLIB_LEVEL_ADAPTIVE = -2, // choose per tile, from a quick look at how much structure it has
+  XCF_ZLIB_LEVEL_DEFAULT = -1   // Z_DEFAULT_COMPRESSION
+} xcf_zlib_level_t;
+
 // internal state machine. see state.dot
 typedef enum xcf_state_t
 {
@@ -185,17 +204,304 @@ typedef enum xcf_state_t
 
 typedef struct xcf_t XCF;
 
+// the functions used for all memory allocations of libxcf. user is passed to every call
+typedef struct xcf_allocator_t
+{
+  void *(*malloc)(size_t size, void *user);
+  void *(*realloc)(void *ptr, size_t size, void *user);
+  void (*free)(void *ptr, void *user);
+  void *user;
+} xcf_allocator_t;
+
+// replace the allocator for the whole process. NULL goes back to malloc() and friends.
+// only call this while no XCF handles or other objects of libxcf are alive
+void xcf_set_allocator(const xcf_allocator_t *allocator);
+
+// start the process wide thread pool with n_threads workers. afterwards the tiles of all handles get encoded in
+// parallel, with the handles taking turns. when cpus isn't NULL worker i is pinned to cpus[i % n_cpus] (only on
+// Linux). returns 0 when libxcf was built without ENABLE_THREADS
+int xcf_scheduler_start(const int n_threads, const int *cpus, const int n_cpus);
+// stop the thread pool. handles that are still writing continue in their own thread
+void xcf_scheduler_stop(void);
+// the number of running workers, 0 when the scheduler isn't running
+int xcf_scheduler_threads(void);
+
 XCF *xcf_open(const char *filename);
 int xcf_close(XCF *xcf);
 
+// what a handle opened with xcf_open_static() has to be able to write
+typedef struct xcf_static_desc_t
+{
+  uint32_t width, height;    // of the biggest layer or channel
+  xcf_precision_t precision; // of the image
+  uint32_t n_children;       // the number of layers and channels
+  size_t names_size;         // the bytes of all names, the file name included, and of parasites that get copied
+} xcf_static_desc_t;
+
+// the bytes of memory xcf_open_static() needs for desc. the state of zlib is measured by setting one up, this
+// allocates. 0 when that failed
+size_t xcf_scratch_size(const xcf_static_desc_t *desc);
+// like xcf_open(), but everything the handle needs comes from memory, which has to stay around until xcf_close().
+// afterwards libxcf doesn't allocate anything, writing what doesn't fit into desc fails. only fopen() in the c
+// library allocates. the scheduler isn't used and xcf_add_fill(), xcf_copy_layer() and indexed layers from colors
+// aren't supported
+XCF *xcf_open_static(const char *filename, void *memory, const size_t size, const xcf_static_desc_t *desc);
+
+// finish the current file like xcf_close() and start a new one, keeping the buffers of the handle.
+// returns 0 when there was an error with the old file. the new one is usable anyway, unless it couldn't be created
+int xcf_reset(XCF *xcf, const char *filename);
+
+// what was written for a layer or channel
+typedef struct xcf_layer_stats_t
+{
+  uint64_t raw_bytes;          // the pixel data in the format of the file, before compression
+  uint64_t compressed_bytes;   // the pixel data as it was written
+  uint64_t tiles_written;
+  uint64_t tiles_deduplicated; // tiles that are a copy of another one and weren't encoded again, see xcf_add_fill()
+} xcf_layer_stats_t;
+
+// counters of a handle since xcf_open() or the last xcf_reset(). they are always on, collecting them costs a few
+// clock reads per tile. small writes of headers and properties are counted but not timed
+typedef struct xcf_stats_t
+{
+  uint64_t bytes_written; // everything passed to the file, including pointers that are filled in later
+  // the sums of all layers and channels
+  uint64_t raw_bytes, compressed_bytes, tiles_written, tiles_deduplicated;
+  // the time spent in the stages of writing pixel data. with the scheduler running, gathering and compressing
+  // are summed over all threads
+  uint64_t gather_ns, compress_ns, io_ns;
+  uint64_t write_calls, seeks;
+  uint64_t peak_scratch_bytes; // of the buffers for encoding tiles, without the state of zlib
+  uint64_t peak_memory_bytes;  // all memory held by the handle, including zlib, palettes and parasites
+  // one entry per layer followed by one per channel, in the order they were added. the ones not written yet are 0.
+  // this points into the handle and is valid until it is used the next time
+  const xcf_layer_stats_t *layers;
+  uint32_t n_layers, n_channels;
+} xcf_stats_t;
+
+// fill in the current counters of the handle. call it before xcf_close()
+int xcf_get_stats(XCF *xcf, xcf_stats_t *stats);
+
+// where writing the pixel data of a layer or channel is at
+typedef struct xcf_progress_t
+{
+  uint32_t index;                   // of the layer or channel, the channels follow the layers like in xcf_stats_t
+  uint64_t tiles_done, tiles_total; // of the layer or channel
+  uint64_t bytes_written;           // to the file so far
+} xcf_progress_t;
+
+// called from the thread writing the file. return 0 to cancel, the partial file gets removed then
+typedef int (*xcf_progress_func_t)(void *user, const xcf_progress_t *progress);
+
+// call func every n_tiles tiles written by xcf_add_data(), xcf_add_data_ex() and xcf_add_data_cb() and once all
+// tiles of a layer or channel are written. with n_tiles = 0 only the latter. NULL stops it. this stays in place with
+// xcf_reset()
+int xcf_set_progress(XCF *xcf, xcf_progress_func_t func, void *user, const uint32_t n_tiles);
+
+// the stages of writing a file that can be traced
+typedef enum xcf_trace_kind_t
+{
+  XCF_TRACE_HEADER = 0, // writing the image header
+  XCF_TRACE_LAYER,      // from adding a layer until its pixel data is written. index is the number of the layer
+  XCF_TRACE_CHANNEL,    // the same for channels
+  XCF_TRACE_GATHER,     // converting the pixels of a tile. index is the number of the tile in the layer
+  XCF_TRACE_COMPRESS,   // compressing a tile
+  XCF_TRACE_WRITE,      // writing a tile to the file
+  XCF_TRACE_CLOSE       // finishing the file in xcf_close() or xcf_reset()
+} xcf_trace_kind_t;
+
+typedef struct xcf_trace_event_t
+{
+  xcf_trace_kind_t kind;
+  int begin;        // 1 when the stage starts, 0 when it ends
+  uint64_t time_ns; // of a monotonic clock
+  uint32_t index;
+} xcf_trace_event_t;
+
+// called from the thread doing the work. with the scheduler running that can be any of its workers
+typedef void (*xcf_trace_func_t)(void *user, const xcf_trace_event_t *event);
+
+// trace the handle by calling func for the start and end of every stage, NULL stops it. this stays in place with
+// xcf_reset(). returns 0 when libxcf was built without ENABLE_TRACING
+int xcf_set_trace(XCF *xcf, xcf_trace_func_t func, void *user);
+
+// a sink for the events that writes a Chrome trace, to be opened in Perfetto or chrome://tracing. pass
+// xcf_chrome_trace_event as func and the trace as user to xcf_set_trace(). it can be shared by several handles
+typedef struct xcf_chrome_trace_t xcf_chrome_trace_t;
+
+xcf_chrome_trace_t *xcf_chrome_trace_open(const char *filename);
+void xcf_chrome_trace_event(void *trace, const xcf_trace_event_t *event);
+// stop tracing on all handles using it before closing it
+int xcf_chrome_trace_close(xcf_chrome_trace_t *trace);
+
 // set fields or properties. depending on the current state it's setting image, layer or channel data
 int xcf_set(XCF *xcf, xcf_field_t field, ...);
 
 int xcf_add_layer(XCF *xcf);
 int xcf_add_channel(XCF *xcf);
 
+// a parasite in a xcf_layer_desc_t. the data isn't copied, release works like for XCF_PARASITE_BY_REFERENCE
+typedef struct xcf_parasite_desc_t
+{
+  const char *name;
+  uint32_t flags;
+  uint32_t length;
+  const void *data;
+  xcf_release_func_t release; // may be NULL
+  void *release_user;
+} xcf_parasite_desc_t;
+
+// everything about a layer that can be set with xcf_set(), in one struct. use xcf_layer_desc_init() to get the
+// same defaults as xcf_add_layer()
+typedef struct xcf_layer_desc_t
+{
+  uint32_t width, height;
+  const char *name;
+  float opacity; // 0.0 - 1.0
+  int visible;
+  int32_t mode;  // xcf_prop_mode_t or -1 for normal mode
+  int32_t offset_x, offset_y;
+  int32_t composite_mode, composite_space, blend_space; // -1 to not set them
+  const xcf_parasite_desc_t *parasites;
+  uint32_t n_parasites;
+} xcf_layer_desc_t;
+
+void xcf_layer_desc_init(xcf_layer_desc_t *desc, const uint32_t width, const uint32_t height);
+
+// add a layer and set all its fields at once. the layer header is written right away, so nothing in desc is
+// needed afterwards. the pixel data has to follow with xcf_add_data(), xcf_add_data_ex(), xcf_add_data_cb() or
+// xcf_add_fill(). the release callbacks of all parasites are called before returning, also when it fails
+int xcf_add_layer_desc(XCF *xcf, const xcf_layer_desc_t *desc);
+
 // add pixel data to the current layer or channel
 int xcf_add_data(XCF *xcf, const void *data, const int data_channels);
 
+// the order of the channels in the data. for grayscale data only the position of alpha matters
+typedef enum xcf_channel_order_t
+{
+  XCF_CHANNEL_ORDER_RGBA = 0,
+  XCF_CHANNEL_ORDER_BGRA,
+  XCF_CHANNEL_ORDER_ARGB,
+  XCF_CHANNEL_ORDER_ABGR
+} xcf_channel_order_t;
+
+// a description of pixel data for xcf_add_data_ex(). fields that are 0 get sensible defaults
+typedef struct xcf_data_t
+{
+  const void *data;
+  int channels;              // the number of channels per pixel, like data_channels of xcf_add_data()
+  xcf_precision_t precision; // precision of the data. it's converted to the precision of the image while writing.
+                             // 0 means that it's the same as the image
+  xcf_channel_order_t order; // the order of the channels in a pixel
+  int premultiplied;         // the colors are premultiplied with alpha. XCF uses straight alpha, so this gets undone
+  size_t stride;             // the number of bytes from one row to the next. 0 means that the rows are tightly packed
+  const void *planes[4];     // planar data, one pointer per channel. when planes[0] is set, data isn't used
+} xcf_data_t;
+
+// like xcf_add_data() but with more control over the format of the data
+int xcf_add_data_ex(XCF *xcf, const xcf_data_t *data);
+
+// called for every tile of the current layer or channel. buffer has to be filled with width * height pixels in the
+// precision of the image and with the channels of the layer, tightly packed in host byte order. return 0 to abort
+// writing. without the scheduler the tiles are asked for in the order they get written, while it runs the workers
+// call provider at the same time and in any order, so it has to be reentrant and must not depend on that order
+typedef int (*xcf_tile_provider_t)(void *user, const uint32_t x, const uint32_t y, const uint32_t width,
+                                   const uint32_t height, void *buffer);
+
+// like xcf_add_data() but the pixel data is asked for one tile at a time, so it never has to exist as a whole
+int xcf_add_data_cb(XCF *xcf, xcf_tile_provider_t provider, void *user);
+
+// fill the current layer or channel with a single color. pixel has channels values in the precision of the image.
+// for indexed layers it's either the index and alpha, or a color that gets mapped to the colormap like with
+// xcf_add_data()
+int xcf_add_fill(XCF *xcf, const void *pixel, const int channels);
+
+// copy a layer from an existing file into the current layer without decoding and re-compressing the pixel data.
+// the source file has to use the same precision and compression, and the layer type has to match. the size of
+// the layer is taken from the source, everything else (name, offsets, properties, ...) is what was set with
+// xcf_set() on the current layer. indexed layers need a colormap that starts with the one of the source file, a
+// colormap that wasn't set gets the missing colors of the source
+int xcf_copy_layer(XCF *xcf, const char *filename, const uint32_t layer_index);
+
+// layers can be encoded once and then added to any number of files. this is useful when writing several files
+// that share some layers, as the pixel data doesn't have to be compressed again for every file.
+// the result of xcf_encode_layer() doesn't depend on a file, it can be used with any XCF that has the same
+// precision and compression. type is the layer type it's meant for, for example XCF_TYPE_RGB_ALPHA for a
+// normal layer in a RGB image. data and data_channels work like for xcf_add_data(). indexed types aren't supported,
+// the indices would depend on the colormap of the image
+typedef struct xcf_encoded_layer_t xcf_encoded_layer_t;
+
+xcf_encoded_layer_t *xcf_encode_layer(const xcf_precision_t precision, const xcf_prop_compression_t compression,
+                                      const xcf_type_t type, const uint32_t width, const uint32_t height,
+                                      const void *data, const int data_channels);
+void xcf_encoded_layer_free(xcf_encoded_layer_t *layer);
+
+// use an encoded layer as the data of the current layer or channel. the size is taken from the encoded layer
+int xcf_add_encoded_layer(XCF *xcf, const xcf_encoded_layer_t *layer);
+
+
+// overwrite a region of a layer in an existing file. this only works for files written with
+// XCF_PROP_COMPRESSION_NONE, as those have tiles with a fixed size. only the tiles touched by the region are
+// written, so the cost doesn't depend on the size of the image.
+// data has to be in the precision of the image with width * height pixels. data_channels works like for xcf_add_data()
+int xcf_update_region(const char *filename, const uint32_t layer_index, const uint32_t x, const uint32_t y,
+                      const uint32_t width, const uint32_t height, const void *data, const int data_channels);
+
+
+// fast scanning of existing files. only the image header, the property lists and the layer headers are read,
+// tile data is never touched. this is meant for indexing lots of files, not for loading them
+
+typedef enum xcf_scan_flag_t
+{
+  XCF_SCAN_LAYERS = 1,         // also read the layer headers, not just the image header
+  XCF_SCAN_PARASITE_DATA = 2,  // keep the payload of parasites. without this only name, flags and length are filled in
+} xcf_scan_flag_t;
+
+typedef struct xcf_info_parasite_t
+{
+  char *name;
+  uint32_t flags;
+  uint32_t length;
+  uint8_t *data; // NULL unless XCF_SCAN_PARASITE_DATA was passed
+} xcf_info_parasite_t;
+
+typedef struct xcf_info_layer_t
+{
+  uint32_t width, height;
+  xcf_type_t type;
+  char *name;
+
+  float opacity;
+  uint32_t visible;
+  int32_t mode;
+  int32_t offset_x, offset_y;
+
+  uint32_t n_parasites;
+  xcf_info_parasite_t *parasites;
+} xcf_info_layer_t;
+
+typedef struct xcf_info_t
+{
+  int version;
+  uint32_t width, height;
+  xcf_base_type_t base_type;
+  xcf_precision_t precision;
+  xcf_prop_compression_t compression;
+
+  uint32_t n_layers, n_channels;
+  xcf_info_layer_t *layers; // n_layers entries if XCF_SCAN_LAYERS was passed, NULL otherwise
+
+  uint32_t n_parasites;
+  xcf_info_parasite_t *parasites;
+} xcf_info_t;
+
+// returns NULL when the file can't be read or isn't an XCF file. free the result with xcf_info_free()
+xcf_info_t *xcf_scan(const char *filename, const int flags);
+void xcf_info_free(xcf_info_t *info);
+
 #define XCF_INTERNAL_INCLUDES
 #include "xcf_names.h"
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,291 @@
+#pragma once
+
+// a header only C++17 wrapper around libxcf. it adds RAII handles, builders for layers and channels instead of the
+// varargs of xcf_set() and pixel data whose type has to match the precision of the image at compile time.
+// errors are reported with exceptions, the details were printed by libxcf already
+
+#include "xcf.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace xcf
+{
+
+class error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// the bits of a half float. C++17 has no type for them, this keeps them apart from 16 bit integers
+struct half
+{
+  uint16_t bits;
+};
+
+// the type of a single channel value for every precision
+template<xcf_precision_t P> struct precision_traits;
+template<> struct precision_traits<XCF_PRECISION_I_8_L> { using type = uint8_t; };
+template<> struct precision_traits<XCF_PRECISION_I_8_G> { using type = uint8_t; };
+template<> struct precision_traits<XCF_PRECISION_I_16_L> { using type = uint16_t; };
+template<> struct precision_traits<XCF_PRECISION_I_16_G> { using type = uint16_t; };
+template<> struct precision_traits<XCF_PRECISION_I_32_L> { using type = uint32_t; };
+template<> struct precision_traits<XCF_PRECISION_I_32_G> { using type = uint32_t; };
+template<> struct precision_traits<XCF_PRECISION_F_16_L> { using type = half; };
+template<> struct precision_traits<XCF_PRECISION_F_16_G> { using type = half; };
+template<> struct precision_traits<XCF_PRECISION_F_32_L> { using type = float; };
+template<> struct precision_traits<XCF_PRECISION_F_32_G> { using type = float; };
+template<> struct precision_traits<XCF_PRECISION_F_64_L> { using type = double; };
+template<> struct precision_traits<XCF_PRECISION_F_64_G> { using type = double; };
+
+template<xcf_precision_t P> using channel_t = typename precision_traits<P>::type;
+
+static_assert(sizeof(half) == 2, "half has to be 16 bit");
+
+namespace detail
+{
+inline void check(const int res, const char *what)
+{
+  if(!res) throw error(std::string(what) + " failed");
+}
+
+// the type of the elements of a contiguous range like std::vector, std::array, std::span or a C array
+template<typename Range>
+using element_t = std::remove_cv_t<std::remove_pointer_t<decltype(std::data(std::declval<const Range &>()))>>;
+} // namespace detail
+
+// the settings of a layer, passed to Writer::add_layer()
+class Layer
+{
+public:
+  Layer(const uint32_t width, const uint32_t height) { xcf_layer_desc_init(&desc_, width, height); }
+
+  Layer &name(std::string name) { name_ = std::move(name); return *this; }
+  Layer &opacity(const float opacity) { desc_.opacity = opacity; return *this; }
+  Layer &visible(const bool visible) { desc_.visible = visible; return *this; }
+  Layer &mode(const xcf_prop_mode_t mode) { desc_.mode = mode; return *this; }
+  Layer &offset(const int32_t x, const int32_t y) { desc_.offset_x = x; desc_.offset_y = y; return *this; }
+  Layer &composite_mode(const xcf_prop_composite_mode_t mode) { desc_.composite_mode = mode; return *this; }
+  Layer &composite_space(const xcf_prop_composite_blend_space_t space) { desc_.composite_space = space; return *this; }
+  Layer &blend_space(const xcf_prop_composite_blend_space_t space) { desc_.blend_space = space; return *this; }
+  // the data isn't copied, it has to stay around until the layer was added
+  Layer &parasite(std::string name, const uint32_t flags, const void *data, const uint32_t length)
+  {
+    parasite_names_.push_back(std::move(name));
+    parasites_.push_back({ nullptr, flags, length, data, nullptr, nullptr });
+    return *this;
+  }
+
+private:
+  template<xcf_precision_t> friend class Writer;
+
+  xcf_layer_desc_t desc_;
+  std::string name_;
+  // the names are filled in when adding the layer, the strings can move until then
+  std::vector<std::string> parasite_names_;
+  std::vector<xcf_parasite_desc_t> parasites_;
+};
+
+// the settings of a channel, passed to Writer::add_channel(). channels always have the size of the image
+class Channel
+{
+public:
+  Channel &name(std::string name) { name_ = std::move(name); return *this; }
+  Channel &opacity(const float opacity) { opacity_ = opacity; return *this; }
+  Channel &visible(const bool visible) { visible_ = visible; return *this; }
+  Channel &color(const float r, const float g, const float b) { color_ = { r, g, b }; return *this; }
+
+private:
+  template<xcf_precision_t> friend class Writer;
+
+  std::string name_;
+  float opacity_ = 1.0f;
+  bool visible_ = true;
+  std::array<float, 3> color_ = { 0.0f, 0.0f, 0.0f };
+};
+
+// a file being written, in precision P. it is closed when the writer goes out of scope, call close() to find out
+// whether that worked
+template<xcf_precision_t P>
+class Writer
+{
+public:
+  using channel_type = channel_t<P>;
+
+  explicit Writer(const std::string &filename) : xcf_(xcf_open(filename.c_str()))
+  {
+    if(!xcf_) throw error("can't open '" + filename + "'");
+    // the destructor doesn't run when the constructor throws
+    try
+    {
+      set(XCF_PRECISION, P);
+    }
+    catch(...)
+    {
+      xcf_close(std::exchange(xcf_, nullptr));
+      throw;
+    }
+  }
+
+  ~Writer()
+  {
+    if(xcf_) xcf_close(xcf_);
+  }
+
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  Writer(Writer &&other) noexcept
+    : xcf_(std::exchange(other.xcf_, nullptr)), width_(other.width_), height_(other.height_),
+      child_width_(other.child_width_), child_height_(other.child_height_)
+  {
+  }
+
+  Writer &operator=(Writer &&other) noexcept
+  {
+    if(this != &other)
+    {
+      if(xcf_) xcf_close(xcf_);
+      xcf_ = std::exchange(other.xcf_, nullptr);
+      width_ = other.width_;
+      height_ = other.height_;
+      child_width_ = other.child_width_;
+      child_height_ = other.child_height_;
+    }
+    return *this;
+  }
+
+  // the handle, to use the C api for anything not covered here
+  XCF *get() const { return xcf_; }
+
+  void close()
+  {
+    const int res = xcf_close(std::exchange(xcf_, nullptr));
+    detail::check(res, "xcf_close()");
+  }
+
+  // image settings, these have to come before the first layer or channel
+  Writer &set_size(const uint32_t width, const uint32_t height)
+  {
+    set(XCF_WIDTH, width);
+    set(XCF_HEIGHT, height);
+    width_ = width;
+    height_ = height;
+    return *this;
+  }
+  Writer &set_base_type(const xcf_base_type_t base_type) { return set(XCF_BASE_TYPE, base_type); }
+  Writer &set_layers(const uint32_t n_layers) { return set(XCF_N_LAYERS, n_layers); }
+  Writer &set_channels(const uint32_t n_channels) { return set(XCF_N_CHANNELS, n_channels); }
+  Writer &set_version(const int version) { return set(XCF_VERSION, version); }
+  Writer &set_omit_base_alpha(const bool omit) { return set(XCF_OMIT_BASE_ALPHA, static_cast<uint32_t>(omit)); }
+  Writer &set_compression(const xcf_prop_compression_t compression)
+  {
+    return set(XCF_PROP, static_cast<uint32_t>(XCF_PROP_COMPRESSION), static_cast<int>(compression));
+  }
+  // 0 - 9, XCF_ZLIB_LEVEL_DEFAULT or XCF_ZLIB_LEVEL_ADAPTIVE
+  Writer &set_zlib_level(const int level) { return set(XCF_ZLIB_LEVEL, level); }
+  // in bytes, 0 is no limit
+  Writer &set_memory_limit(const uint64_t bytes) { return set(XCF_MEMORY_LIMIT, bytes); }
+  // 8 bit RGB triplets
+  Writer &set_colormap(const uint8_t *colors, const uint32_t n_colors)
+  {
+    return set(XCF_PROP, static_cast<uint32_t>(XCF_PROP_COLORMAP), n_colors, colors);
+  }
+
+  Writer &add_layer(const Layer &layer)
+  {
+    std::vector<xcf_parasite_desc_t> parasites = layer.parasites_;
+    for(size_t i = 0; i < parasites.size(); i++) parasites[i].name = layer.parasite_names_[i].c_str();
+
+    xcf_layer_desc_t desc = layer.desc_;
+    desc.name = layer.name_.empty() ? nullptr : layer.name_.c_str();
+    desc.parasites = parasites.empty() ? nullptr : parasites.data();
+    desc.n_parasites = static_cast<uint32_t>(parasites.size());
+    detail::check(xcf_add_layer_desc(xcf_, &desc), "xcf_add_layer_desc()");
+    child_width_ = desc.width;
+    child_height_ = desc.height;
+    return *this;
+  }
+
+  Writer &add_channel(const Channel &channel = Channel())
+  {
+    detail::check(xcf_add_channel(xcf_), "xcf_add_channel()");
+    if(!channel.name_.empty()) set(XCF_NAME, channel.name_.c_str());
+    set(XCF_PROP, static_cast<uint32_t>(XCF_PROP_FLOAT_OPACITY), static_cast<double>(channel.opacity_));
+    set(XCF_PROP, static_cast<uint32_t>(XCF_PROP_VISIBLE), static_cast<uint32_t>(channel.visible_));
+    set(XCF_PROP, static_cast<uint32_t>(XCF_PROP_FLOAT_COLOR), static_cast<double>(channel.color_[0]),
+        static_cast<double>(channel.color_[1]), static_cast<double>(channel.color_[2]));
+    child_width_ = width_;
+    child_height_ = height_;
+    return *this;
+  }
+
+  // the pixels of the current layer or channel with Channels values per pixel, tightly packed. the values are in
+  // Source precision, which defaults to the one of the image. anything else gets converted while writing.
+  // data can be any contiguous range: std::vector, std::array, std::span, a C array, ...
+  template<int Channels, xcf_precision_t Source = P, typename Range>
+  Writer &add_data(const Range &data, const xcf_channel_order_t order = XCF_CHANNEL_ORDER_RGBA,
+                   const bool premultiplied = false)
+  {
+    static_assert(Channels >= 1 && Channels <= 4, "pixels have 1 to 4 channels");
+    static_assert(std::is_same_v<detail::element_t<Range>, channel_t<Source>>,
+                  "the type of the data doesn't match its precision");
+    return add_data<Channels, Source>(std::data(data), std::size(data), order, premultiplied);
+  }
+
+  template<int Channels, xcf_precision_t Source = P>
+  Writer &add_data(const channel_t<Source> *data, const size_t n_values,
+                   const xcf_channel_order_t order = XCF_CHANNEL_ORDER_RGBA, const bool premultiplied = false)
+  {
+    static_assert(Channels >= 1 && Channels <= 4, "pixels have 1 to 4 channels");
+    if(n_values < static_cast<size_t>(child_width_) * child_height_ * Channels)
+      throw error("not enough pixel data for the layer");
+
+    xcf_data_t desc = {};
+    desc.data = data;
+    desc.channels = Channels;
+    desc.precision = Source;
+    desc.order = order;
+    desc.premultiplied = premultiplied;
+    detail::check(xcf_add_data_ex(xcf_, &desc), "xcf_add_data_ex()");
+    return *this;
+  }
+
+  // fill the current layer or channel with a single color
+  template<size_t Channels>
+  Writer &add_fill(const std::array<channel_type, Channels> &pixel)
+  {
+    static_assert(Channels >= 1 && Channels <= 4, "pixels have 1 to 4 channels");
+    detail::check(xcf_add_fill(xcf_, pixel.data(), static_cast<int>(Channels)), "xcf_add_fill()");
+    return *this;
+  }
+
+  xcf_stats_t stats() const
+  {
+    xcf_stats_t stats;
+    detail::check(xcf_get_stats(xcf_, &stats), "xcf_get_stats()");
+    return stats;
+  }
+
+private:
+  template<typename... Args>
+  Writer &set(const xcf_field_t field, Args... args)
+  {
+    detail::check(xcf_set(xcf_, field, args...), "xcf_set()");
+    return *this;
+  }
+
+  XCF *xcf_ = nullptr;
+  uint32_t width_ = 0, height_ = 0;
+  uint32_t child_width_ = 0, child_height_ = 0; // of the current layer or channel
+};
+
+} // namespace xcf
@@ -0,0 +1,201 @@
+#include "xcf.h"
+#include "xcf_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// memory management. everything libxcf allocates goes through these, so the user can plug in their own allocator
+
+static void *xcf_default_malloc(size_t size, void *user)
+{
+  (void)user;
+  return malloc(size);
+}
+
+static void *xcf_default_realloc(void *ptr, size_t size, void *user)
+{
+  (void)user;
+  return realloc(ptr, size);
+}
+
+static void xcf_default_free(void *ptr, void *user)
+{
+  (void)user;
+  free(ptr);
+}
+
+static xcf_allocator_t allocator = { xcf_default_malloc, xcf_default_realloc, xcf_default_free, NULL };
+
+void xcf_set_allocator(const xcf_allocator_t *new_allocator)
+{
+  if(new_allocator && new_allocator->malloc && new_allocator->realloc && new_allocator->free)
+    allocator = *new_allocator;
+  else
+  {
+    allocator.malloc = xcf_default_malloc;
+    allocator.realloc = xcf_default_realloc;
+    allocator.free = xcf_default_free;
+    allocator.user = NULL;
+  }
+}
+
+void *xcf_malloc(size_t size)
+{
+  return allocator.malloc(size ? size : 1, allocator.user);
+}
+
+void *xcf_calloc(size_t n, size_t size)
+{
+  if(size && n > SIZE_MAX / size) return NULL;
+  void *ptr = xcf_malloc(n * size);
+  if(ptr) memset(ptr, 0, n * size);
+  return ptr;
+}
+
+void *xcf_realloc(void *ptr, size_t size)
+{
+  return allocator.realloc(ptr, size ? size : 1, allocator.user);
+}
+
+void xcf_free(void *ptr)
+{
+  if(ptr) allocator.free(ptr, allocator.user);
+}
+
+char *xcf_strdup(const char *s)
+{
+  const size_t length = strlen(s) + 1;
+  char *copy = (char *)xcf_malloc(length);
+  if(copy) memcpy(copy, s, length);
+  return copy;
+}
+
+int xcf_grow(uint8_t **buffer, size_t *allocated, const size_t size)
+{
+  if(*buffer && *allocated >= size) return 1;
+  xcf_free(*buffer);
+  *allocated = 0;
+  *buffer = (uint8_t *)xcf_malloc(size);
+  if(!*buffer) return 0;
+  *allocated = size;
+  return 1;
+}
+
+// zlib's hooks. without a pool everything goes through the global allocator
+void *xcf_zalloc(void *opaque, unsigned int items, unsigned int size)
+{
+  xcf_zlib_memory_t *memory = (xcf_zlib_memory_t *)opaque;
+  if(memory && memory->pool)
+  {
+    const size_t length = XCF_ALIGN((size_t)items * size);
+    if(memory->pool_size - memory->allocated < length) return NULL;
+    void *ptr = memory->pool + memory->allocated;
+    memory->allocated += length;
+    memset(ptr, 0, length);
+    return ptr;
+  }
+
+  void *ptr = xcf_calloc(items, size);
+  if(ptr && memory) memory->allocated += (size_t)items * size;
+  return ptr;
+}
+
+void xcf_zfree(void *opaque, void *ptr)
+{
+  const xcf_zlib_memory_t *memory = (const xcf_zlib_memory_t *)opaque;
+  if(memory && memory->pool) return;
+  xcf_free(ptr);
+}
+
+
+// the arena. blocks are never given back before xcf_arena_free(), resetting only rewinds them
+
+#define XCF_ARENA_BLOCK_SIZE 4096
+#define XCF_ARENA_ALIGN 16
+
+struct xcf_arena_block_t
+{
+  struct xcf_arena_block_t *next;
+  size_t size, used;
+  uint8_t *data;
+};
+
+void *xcf_arena_alloc(xcf_arena_t *arena, size_t size)
+{
+  size = (size + XCF_ARENA_ALIGN - 1) & ~(size_t)(XCF_ARENA_ALIGN - 1);
+  if(size == 0) size = XCF_ARENA_ALIGN;
+
+  xcf_arena_block_t *last = NULL;
+  for(xcf_arena_block_t *block = arena->current; block; last = block, block = block->next)
+  {
+    if(block->size - block->used >= size)
+    {
+      arena->current = block;
+      void *ptr = block->data + block->used;
+      block->used += size;
+      return ptr;
+    }
+  }
+
+  if(arena->fixed) return NULL;
+
+  // nothing left, append a new block. the header and the data are allocated in one go
+  const size_t header = (sizeof(xcf_arena_block_t) + XCF_ARENA_ALIGN - 1) & ~(size_t)(XCF_ARENA_ALIGN - 1);
+  const size_t block_size = MAX(size, XCF_ARENA_BLOCK_SIZE);
+  xcf_arena_block_t *block = (xcf_arena_block_t *)xcf_malloc(header + block_size);
+  if(!block) return NULL;
+  block->next = NULL;
+  block->size = block_size;
+  block->used = size;
+  block->data = (uint8_t *)block + header;
+  arena->allocated += header + block_size;
+  if(last)
+    last->next = block;
+  else
+    arena->first = block;
+  arena->current = block;
+  return block->data;
+}
+
+void xcf_arena_init_static(xcf_arena_t *arena, void *memory, const size_t size)
+{
+  const size_t header = (sizeof(xcf_arena_block_t) + XCF_ARENA_ALIGN - 1) & ~(size_t)(XCF_ARENA_ALIGN - 1);
+  xcf_arena_block_t *block = (xcf_arena_block_t *)memory;
+  block->next = NULL;
+  block->size = size > header ? size - header : 0;
+  block->used = 0;
+  block->data = (uint8_t *)block + header;
+  arena->first = arena->current = block;
+  arena->allocated = size;
+  arena->fixed = 1;
+}
+
+char *xcf_arena_strdup(xcf_arena_t *arena, const char *s)
+{
+  const size_t length = strlen(s) + 1;
+  char *copy = (char *)xcf_arena_alloc(arena, length);
+  if(copy) memcpy(copy, s, length);
+  return copy;
+}
+
+void xcf_arena_reset(xcf_arena_t *arena)
+{
+  for(xcf_arena_block_t *block = arena->first; block; block = block->next)
+    block->used = 0;
+  arena->current = arena->first;
+}
+
+void xcf_arena_free(xcf_arena_t *arena)
+{
+  xcf_arena_block_t *block = arena->fixed ? NULL : arena->first;
+  while(block)
+  {
+    xcf_arena_block_t *next = block->next;
+    xcf_free(block);
+    block = next;
+  }
+  arena->first = NULL;
+  arena->current = NULL;
+  arena->allocated = 0;
+  arena->fixed = 0;
+}
@@ -0,0 +1,414 @@
+#include "xcf.h"
+#include "xcf_internal.h"
+
+#include <math.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  // the f16c kernels are compiled for that instruction set only and picked at runtime
+  #define HAVE_F16C_DISPATCH
+  #include <immintrin.h>
+#endif
+
+// the integer part of the precision enum is the data type, the rest says if it's linear or gamma encoded
+#define PRECISION_TYPE(p) ((p) / 100)
+
+int xcf_precision_size(const xcf_precision_t precision)
+{
+  switch(precision)
+  {
+    case XCF_PRECISION_I_8_L:
+    case XCF_PRECISION_I_8_G:
+      return 1;
+    case XCF_PRECISION_I_16_L:
+    case XCF_PRECISION_I_16_G:
+    case XCF_PRECISION_F_16_L:
+    case XCF_PRECISION_F_16_G:
+      return 2;
+    case XCF_PRECISION_I_32_L:
+    case XCF_PRECISION_I_32_G:
+    case XCF_PRECISION_F_32_L:
+    case XCF_PRECISION_F_32_G:
+      return 4;
+    case XCF_PRECISION_F_64_L:
+    case XCF_PRECISION_F_64_G:
+      return 8;
+  }
+  return 0;
+}
+
+int xcf_precision_is_gamma(const xcf_precision_t precision)
+{
+  return precision % 100 == 50;
+}
+
+
+// half floats. the software versions round to nearest even, just like the hardware does
+
+static uint16_t xcf_float_to_half(const float value)
+{
+  union { float f; uint32_t i; } v;
+  v.f = value;
+  const uint32_t sign = v.i & 0x80000000u;
+  uint32_t x = v.i ^ sign;
+  uint16_t half;
+
+  if(x >= 0x47800000u)
+  {
+    // too big, inf or nan
+    half = x > 0x7f800000u ? 0x7e00 : 0x7c00;
+  }
+  else if(x < 0x38800000u)
+  {
+    // subnormal or zero. let the fpu do the rounding by aligning the mantissa at the bottom of a float
+    union { uint32_t i; float f; } magic, f;
+    magic.i = ((127 - 15) + (23 - 10) + 1) << 23;
+    f.i = x;
+    f.f += magic.f;
+    half = f.i - magic.i;
+  }
+  else
+  {
+    const uint32_t mantissa_odd = (x >> 13) & 1;
+    x += 0xc8000fffu; // rebias the exponent from 127 to 15 and round
+    x += mantissa_odd;
+    half = x >> 13;
+  }
+
+  return half | (sign >> 16);
+}
+
+static float xcf_half_to_float(const uint16_t half)
+{
+  union { uint32_t i; float f; } v, magic, was_infnan;
+  magic.i = (254 - 15) << 23;
+  was_infnan.i = (127 + 16) << 23;
+
+  v.i = (uint32_t)(half & 0x7fff) << 13;
+  v.f *= magic.f; // rebias the exponent, this also handles subnormals
+  if(v.f >= was_infnan.f)
+    v.i |= 255u << 23;
+  v.i |= (uint32_t)(half & 0x8000) << 16;
+  return v.f;
+}
+
+#ifdef HAVE_F16C_DISPATCH
+// the kernels use 256 bit registers, so the os has to have enabled avx as well. f16c alone isn't enough
+static int xcf_have_f16c(void)
+{
+  return __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx");
+}
+
+__attribute__((target("f16c,avx")))
+static void xcf_float_to_half_f16c(const float *src, uint16_t *dest, const size_t n)
+{
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8)
+    _mm_storeu_si128((__m128i *)(dest + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+  for(; i < n; i++)
+    dest[i] = xcf_float_to_half(src[i]);
+}
+
+__attribute__((target("f16c,avx")))
+static void xcf_half_to_float_f16c(const uint16_t *src, float *dest, const size_t n)
+{
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(dest + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+  for(; i < n; i++)
+    dest[i] = xcf_half_to_float(src[i]);
+}
+#endif
+
+
+// the transfer functions of sRGB, which is what GIMP uses for gamma encoded data.
+// values outside of [0, 1] are mirrored/extended, so nothing gets clipped for floating point data
+
+float xcf_linear_to_gamma(const float value)
+{
+  const float v = fabsf(value);
+  const float result = v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.0f / 2.4f) - 0.055f;
+  return value < 0.0f ? -result : result;
+}
+
+float xcf_gamma_to_linear(const float value)
+{
+  const float v = fabsf(value);
+  const float result = v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+  return value < 0.0f ? -result : result;
+}
+
+
+// conversion of whole rows. the switch is outside of the loops so the compiler can vectorize them
+
+void xcf_copy_values_be(uint8_t *dest, const uint8_t *src, const size_t n_values, const int channel_size)
+{
+  if(channel_size == 1)
+    memmove(dest, src, n_values);
+  else if(channel_size == 2)
+  {
+    for(size_t i = 0; i < n_values; i++)
+    {
+      uint16_t value;
+      memcpy(&value, src + i * 2, 2);
+      value = htobe16(value);
+      memcpy(dest + i * 2, &value, 2);
+    }
+  }
+  else if(channel_size == 4)
+  {
+    for(size_t i = 0; i < n_values; i++)
+    {
+      uint32_t value;
+      memcpy(&value, src + i * 4, 4);
+      value = htobe32(value);
+      memcpy(dest + i * 4, &value, 4);
+    }
+  }
+  else if(channel_size == 8)
+  {
+    for(size_t i = 0; i < n_values; i++)
+    {
+      uint64_t value;
+      memcpy(&value, src + i * 8, 8);
+      value = htobe64(value);
+      memcpy(dest + i * 8, &value, 8);
+    }
+  }
+}
+
+void xcf_copy_channel_be(uint8_t *dest, const size_t dest_stride, const uint8_t *src, const size_t src_stride,
+                         const size_t n, const int channel_size)
+{
+  switch(channel_size)
+  {
+    case 1:
+      for(size_t i = 0; i < n; i++)
+        dest[i * dest_stride] = src[i * src_stride];
+      break;
+    case 2:
+      for(size_t i = 0; i < n; i++)
+      {
+        uint16_t value;
+        memcpy(&value, src + i * src_stride, 2);
+        value = htobe16(value);
+        memcpy(dest + i * dest_stride, &value, 2);
+      }
+      break;
+    case 4:
+      for(size_t i = 0; i < n; i++)
+      {
+        uint32_t value;
+        memcpy(&value, src + i * src_stride, 4);
+        value = htobe32(value);
+        memcpy(dest + i * dest_stride, &value, 4);
+      }
+      break;
+    case 8:
+      for(size_t i = 0; i < n; i++)
+      {
+        uint64_t value;
+        memcpy(&value, src + i * src_stride, 8);
+        value = htobe64(value);
+        memcpy(dest + i * dest_stride, &value, 8);
+      }
+      break;
+  }
+}
+
+// fixed point unpremultiplying: one division per pixel for the reciprocal of alpha, the channels are then scaled
+// by multiplying with it. the result is rounded to nearest and clamped, broken data can have colors above alpha
+#define UNPREMULTIPLY_INT(type, max)                                                                    \
+  for(size_t i = 0; i < n; i++)                                                                         \
+  {                                                                                                     \
+    const size_t pixel = i * n_channels * sizeof(type);                                                 \
+    type a;                                                                                             \
+    memcpy(&a, src + pixel + alpha * sizeof(type), sizeof(type));                                       \
+    const uint64_t reciprocal = a ? (((uint64_t)(max) << 16) + a / 2) / a : 0;                          \
+    for(int c = 0; c < n_channels; c++)                                                                 \
+    {                                                                                                   \
+      type value;                                                                                       \
+      memcpy(&value, src + pixel + c * sizeof(type), sizeof(type));                                     \
+      if(c != alpha)                                                                                    \
+        value = (type)MIN((value * reciprocal + 0x8000) >> 16, (uint64_t)(max));                        \
+      memcpy(dest + pixel + c * sizeof(type), &value, sizeof(type));                                    \
+    }                                                                                                   \
+  }
+
+int xcf_unpremultiply(const uint8_t *src, uint8_t *dest, const size_t n, const int n_channels, const int alpha,
+                      const xcf_precision_t precision)
+{
+  switch(PRECISION_TYPE(precision))
+  {
+    case 1:
+      UNPREMULTIPLY_INT(uint8_t, 255)
+      return 1;
+    case 2:
+      UNPREMULTIPLY_INT(uint16_t, 65535)
+      return 1;
+    case 3:
+      // the fixed point product would overflow, a double keeps all 32 bits
+      for(size_t i = 0; i < n; i++)
+      {
+        const size_t pixel = i * n_channels * 4;
+        uint32_t a;
+        memcpy(&a, src + pixel + alpha * 4, 4);
+        const double reciprocal = a ? 4294967295.0 / a : 0.0;
+        for(int c = 0; c < n_channels; c++)
+        {
+          uint32_t value;
+          memcpy(&value, src + pixel + c * 4, 4);
+          if(c != alpha)
+          {
+            const double scaled = value * reciprocal + 0.5;
+            value = scaled < 4294967295.0 ? (uint32_t)scaled : 4294967295u;
+          }
+          memcpy(dest + pixel + c * 4, &value, 4);
+        }
+      }
+      return 1;
+    case 7:
+      // in double, going through float would drop the mantissa to 24 bits
+      for(size_t i = 0; i < n; i++)
+      {
+        const size_t pixel = i * n_channels * 8;
+        double a;
+        memcpy(&a, src + pixel + alpha * 8, 8);
+        const double reciprocal = a > 0.0 ? 1.0 / a : 0.0;
+        for(int c = 0; c < n_channels; c++)
+        {
+          double value;
+          memcpy(&value, src + pixel + c * 8, 8);
+          if(c != alpha) value *= reciprocal;
+          memcpy(dest + pixel + c * 8, &value, 8);
+        }
+      }
+      return 1;
+  }
+  return 0;
+}
+
+#undef UNPREMULTIPLY_INT
+
+void xcf_unpremultiply_float(float *data, const size_t n, const int n_channels, const int alpha)
+{
+  for(size_t i = 0; i < n; i++)
+  {
+    float *pixel = data + i * n_channels;
+    const float a = pixel[alpha];
+    const float reciprocal = a > 0.0f ? 1.0f / a : 0.0f;
+    for(int c = 0; c < n_channels; c++)
+      if(c != alpha) pixel[c] *= reciprocal;
+  }
+}
+
+void xcf_convert_to_float(const uint8_t *src, float *dest, const size_t n, const xcf_precision_t precision)
+{
+  switch(PRECISION_TYPE(precision))
+  {
+    case 1:
+      for(size_t i = 0; i < n; i++)
+        dest[i] = src[i] * (1.0f / 255.0f);
+      break;
+    case 2:
+      for(size_t i = 0; i < n; i++)
+      {
+        uint16_t value;
+        memcpy(&value, src + i * 2, 2);
+        dest[i] = value * (1.0f / 65535.0f);
+      }
+      break;
+    case 3:
+      for(size_t i = 0; i < n; i++)
+      {
+        uint32_t value;
+        memcpy(&value, src + i * 4, 4);
+        dest[i] = value * (1.0 / 4294967295.0);
+      }
+      break;
+    case 5:
+#ifdef HAVE_F16C_DISPATCH
+      if(xcf_have_f16c() && ((uintptr_t)src & 1) == 0)
+      {
+        xcf_half_to_float_f16c((const uint16_t *)src, dest, n);
+        break;
+      }
+#endif
+      for(size_t i = 0; i < n; i++)
+      {
+        uint16_t value;
+        memcpy(&value, src + i * 2, 2);
+        dest[i] = xcf_half_to_float(value);
+      }
+      break;
+    case 6:
+      memcpy(dest, src, n * sizeof(float));
+      break;
+    case 7:
+      for(size_t i = 0; i < n; i++)
+      {
+        double value;
+        memcpy(&value, src + i * 8, 8);
+        dest[i] = value;
+      }
+      break;
+  }
+}
+
+// clamp to [0, 1]. written like this so NaN ends up as 0
+#define CLAMP01(v) ((v) > 0.0f ? ((v) < 1.0f ? (v) : 1.0f) : 0.0f)
+
+void xcf_convert_from_float_be(const float *src, uint8_t *dest, const size_t n, const xcf_precision_t precision)
+{
+  switch(PRECISION_TYPE(precision))
+  {
+    case 1:
+      for(size_t i = 0; i < n; i++)
+        dest[i] = (uint8_t)(CLAMP01(src[i]) * 255.0f + 0.5f);
+      break;
+    case 2:
+      for(size_t i = 0; i < n; i++)
+      {
+        const uint16_t value = htobe16((uint16_t)(CLAMP01(src[i]) * 65535.0f + 0.5f));
+        memcpy(dest + i * 2, &value, 2);
+      }
+      break;
+    case 3:
+      for(size_t i = 0; i < n; i++)
+      {
+        const uint32_t value = htobe32((uint32_t)(CLAMP01(src[i]) * 4294967295.0 + 0.5));
+        memcpy(dest + i * 4, &value, 4);
+      }
+      break;
+    case 5:
+#ifdef HAVE_F16C_DISPATCH
+      if(xcf_have_f16c() && ((uintptr_t)dest & 1) == 0)
+      {
+        xcf_float_to_half_f16c(src, (uint16_t *)dest, n);
+        xcf_copy_values_be(dest, dest, n, 2);
+        break;
+      }
+#endif
+      for(size_t i = 0; i < n; i++)
+      {
+        const uint16_t value = htobe16(xcf_float_to_half(src[i]));
+        memcpy(dest + i * 2, &value, 2);
+      }
+      break;
+    case 6:
+      xcf_copy_values_be(dest, (const uint8_t *)src, n, 4);
+      break;
+    case 7:
+      for(size_t i = 0; i < n; i++)
+      {
+        union { double d; uint64_t i; } value;
+        value.d = src[i];
+        value.i = htobe64(value.i);
+        memcpy(dest + i * 8, &value.i, 8);
+      }
+      break;
+  }
+}
+
+#undef CLAMP01
+#undef PRECISION_TYPE
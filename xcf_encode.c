@@ -0,0 +1,746 @@
+#include "xcf.h"
+#include "xcf_internal.h"
+
+#include <math.h>
+#include <string.h>
+#include <zlib.h>
+
+// turning the pixel data of the user into encoded tiles. every stage is a function of its own so it can be
+// benchmarked without a file, see bench/xcf_stage_bench.c
+
+void xcf_source_init(xcf_source_t *source, const void *data, const uint32_t width, const int channels,
+                     const xcf_precision_t precision)
+{
+  source->data = (const uint8_t *)data;
+  source->channels = channels;
+  source->precision = precision;
+  source->stride = (size_t)width * channels * xcf_precision_size(precision);
+  for(int c = 0; c < 4; c++)
+  {
+    source->planes[c] = NULL;
+    source->order[c] = c;
+  }
+  source->alpha = -1;
+  source->provider = NULL;
+  source->user = NULL;
+  source->palette = NULL;
+}
+
+// use separate planes instead of interleaved data and/or rows that are further apart than the width of the layer.
+// a stride of 0 means that the rows are tightly packed
+int xcf_source_set_memory(xcf_source_t *source, const void * const planes[4], const size_t stride,
+                          const uint32_t width)
+{
+  const int channel_size = xcf_precision_size(source->precision);
+  const int planar = planes[0] != NULL;
+  const size_t row_size = (size_t)width * channel_size * (planar ? 1 : source->channels);
+
+  if(planar)
+  {
+    if(source->channels > 4)
+    {
+      PRINT_ERROR("error: planar data can have at most 4 channels");
+      return 0;
+    }
+    for(int c = 0; c < source->channels; c++)
+    {
+      if(!planes[c])
+      {
+        PRINT_ERROR("error: plane %d is missing", c);
+        return 0;
+      }
+      source->planes[c] = (const uint8_t *)planes[c];
+    }
+    source->data = NULL;
+  }
+
+  if(stride != 0 && stride < row_size)
+  {
+    PRINT_ERROR("error: the stride is smaller than a row");
+    return 0;
+  }
+  source->stride = stride ? stride : row_size;
+  return 1;
+}
+
+int xcf_source_set_layout(xcf_source_t *source, const xcf_channel_order_t order, const int premultiplied)
+{
+  const int channels = source->channels;
+  const int has_alpha = (channels == 2 || channels == 4);
+  const int alpha_first = (order == XCF_CHANNEL_ORDER_ARGB || order == XCF_CHANNEL_ORDER_ABGR);
+  const int reversed = (order == XCF_CHANNEL_ORDER_BGRA || order == XCF_CHANNEL_ORDER_ABGR);
+
+  if(order < XCF_CHANNEL_ORDER_RGBA || order > XCF_CHANNEL_ORDER_ABGR)
+  {
+    PRINT_ERROR("error: unknown channel order %d", order);
+    return 0;
+  }
+
+  // without alpha and with less than 3 colors most orders are the same
+  const int offset = (alpha_first && has_alpha) ? 1 : 0;
+  const int n_color = channels - has_alpha;
+  for(int c = 0; c < MIN(n_color, 4); c++)
+    source->order[c] = offset + ((reversed && n_color == 3) ? 2 - c : c);
+  if(has_alpha)
+    source->order[n_color] = alpha_first ? 0 : channels - 1;
+
+  source->alpha = (premultiplied && has_alpha) ? source->order[n_color] : -1;
+  return 1;
+}
+
+// the number of bytes needed as scratch space by xcf_gather_row() for a row of n_pixels
+size_t xcf_gather_scratch_size(const xcf_source_t *source, const int n_channels, const uint32_t n_pixels)
+{
+  const size_t source_bpp = (size_t)source->channels * xcf_precision_size(source->precision);
+  // with a palette the pixels are gathered as RGBA first
+  if(source->palette)
+    return (size_t)n_pixels * (4 + source_bpp + (source->channels + 4) * sizeof(float));
+  return (size_t)n_pixels * (source_bpp + (source->channels + n_channels) * sizeof(float));
+}
+
+// kernels for gathering rows of pixels that only have to be copied, one for every channel size, number of channels
+// in the source and in the tile, for interleaved and for planar data. with all of them known at compile time the
+// loops over the channels are unrolled and the compiler can vectorize the loop over the pixels. channels[c] points to
+// the source value of channel c of the first pixel, fill has the values of the channels missing in the source
+
+#define XCF_BE_8(x) (x)
+#define XCF_BE_16(x) htobe16(x)
+#define XCF_BE_32(x) htobe32(x)
+#define XCF_BE_64(x) htobe64(x)
+
+// pixel_stride is the number of values from one pixel to the next, the first n_copy channels come from the source
+#define GATHER_KERNEL(name, size, bits, pixel_stride, n_copy, n_channels)                                          \
+  static void name(uint8_t *dest, const uint8_t * const channels[4], const uint8_t *fill, const uint32_t n_pixels)  \
+  {                                                                                                                 \
+    for(uint32_t i = 0; i < n_pixels; i++)                                                                          \
+    {                                                                                                               \
+      for(int c = 0; c < n_channels; c++)                                                                           \
+      {                                                                                                             \
+        uint##bits##_t value;                                                                                       \
+        if(c < n_copy)                                                                                              \
+        {                                                                                                           \
+          memcpy(&value, channels[c] + (size_t)i * (pixel_stride * size), size);                                    \
+          value = XCF_BE_##bits(value);                                                                             \
+        }                                                                                                           \
+        else                                                                                                        \
+          memcpy(&value, fill + c * size, size);                                                                    \
+        memcpy(dest + ((size_t)i * n_channels + c) * size, &value, size);                                           \
+      }                                                                                                             \
+    }                                                                                                               \
+  }
+
+// the same channels in the same order, the whole row can be byte swapped in one go
+#define COPY_KERNEL(size, n_channels)                                                                               \
+  static void xcf_gather_copy_##size##_##n_channels(uint8_t *dest, const uint8_t * const channels[4],               \
+                                                     const uint8_t *fill, const uint32_t n_pixels)                 \
+  {                                                                                                                 \
+    (void)fill;                                                                                                     \
+    xcf_copy_values_be(dest, channels[0], (size_t)n_pixels * n_channels, size);                                     \
+  }
+
+#define GATHER_KERNELS(size, bits, data_channels)                                                                  \
+  GATHER_KERNEL(xcf_gather_##size##_##data_channels##_1, size, bits, data_channels, data_channels, 1)               \
+  GATHER_KERNEL(xcf_gather_##size##_##data_channels##_2, size, bits, data_channels, data_channels, 2)               \
+  GATHER_KERNEL(xcf_gather_##size##_##data_channels##_3, size, bits, data_channels, data_channels, 3)               \
+  GATHER_KERNEL(xcf_gather_##size##_##data_channels##_4, size, bits, data_channels, data_channels, 4)               \
+  GATHER_KERNEL(xcf_gather_planar_##size##_##data_channels##_1, size, bits, 1, data_channels, 1)                    \
+  GATHER_KERNEL(xcf_gather_planar_##size##_##data_channels##_2, size, bits, 1, data_channels, 2)                    \
+  GATHER_KERNEL(xcf_gather_planar_##size##_##data_channels##_3, size, bits, 1, data_channels, 3)                    \
+  GATHER_KERNEL(xcf_gather_planar_##size##_##data_channels##_4, size, bits, 1, data_channels, 4)
+
+#define ALL_KERNELS(size, bits)                                                                                     \
+  GATHER_KERNELS(size, bits, 1)                                                                                     \
+  GATHER_KERNELS(size, bits, 2)                                                                                     \
+  GATHER_KERNELS(size, bits, 3)                                                                                     \
+  GATHER_KERNELS(size, bits, 4)                                                                                     \
+  COPY_KERNEL(size, 1)                                                                                              \
+  COPY_KERNEL(size, 2)                                                                                              \
+  COPY_KERNEL(size, 3)                                                                                              \
+  COPY_KERNEL(size, 4)
+
+ALL_KERNELS(1, 8)
+ALL_KERNELS(2, 16)
+ALL_KERNELS(4, 32)
+ALL_KERNELS(8, 64)
+
+#define GATHER_TABLE_ROW(prefix, size, data_channels)                                                              \
+  { prefix##size##_##data_channels##_1, prefix##size##_##data_channels##_2,                                         \
+    prefix##size##_##data_channels##_3, prefix##size##_##data_channels##_4 }
+
+#define GATHER_TABLE(prefix, size)                                                                                  \
+  { GATHER_TABLE_ROW(prefix, size, 1), GATHER_TABLE_ROW(prefix, size, 2), GATHER_TABLE_ROW(prefix, size, 3),        \
+    GATHER_TABLE_ROW(prefix, size, 4) }
+
+#define COPY_TABLE(size)                                                                                            \
+  { xcf_gather_copy_##size##_1, xcf_gather_copy_##size##_2, xcf_gather_copy_##size##_3, xcf_gather_copy_##size##_4 }
+
+// indexed by channel size (1, 2, 4, 8), channels in the source and channels in the tile
+static const xcf_gather_kernel_t xcf_gather_kernels[4][4][4] = {
+  GATHER_TABLE(xcf_gather_, 1), GATHER_TABLE(xcf_gather_, 2), GATHER_TABLE(xcf_gather_, 4), GATHER_TABLE(xcf_gather_, 8)
+};
+static const xcf_gather_kernel_t xcf_planar_kernels[4][4][4] = {
+  GATHER_TABLE(xcf_gather_planar_, 1), GATHER_TABLE(xcf_gather_planar_, 2), GATHER_TABLE(xcf_gather_planar_, 4),
+  GATHER_TABLE(xcf_gather_planar_, 8)
+};
+static const xcf_gather_kernel_t xcf_copy_kernels[4][4] = {
+  COPY_TABLE(1), COPY_TABLE(2), COPY_TABLE(4), COPY_TABLE(8)
+};
+
+xcf_gather_kernel_t xcf_gather_select(const xcf_source_t *source, const int n_channels,
+                                      const xcf_precision_t precision)
+{
+  // conversions and premultiplied alpha take the long way
+  if(source->precision != precision || source->alpha >= 0) return NULL;
+  if(source->channels < 1 || source->channels > 4 || n_channels < 1 || n_channels > 4) return NULL;
+
+  int size_index;
+  switch(xcf_precision_size(precision))
+  {
+    case 1: size_index = 0; break;
+    case 2: size_index = 1; break;
+    case 4: size_index = 2; break;
+    case 8: size_index = 3; break;
+    default: return NULL;
+  }
+
+  int in_order = 1;
+  for(int c = 0; c < MIN(source->channels, n_channels); c++)
+    if(source->order[c] != c) in_order = 0;
+
+  if(source->planes[0]) return xcf_planar_kernels[size_index][source->channels - 1][n_channels - 1];
+  if(source->channels == n_channels && in_order) return xcf_copy_kernels[size_index][n_channels - 1];
+  return xcf_gather_kernels[size_index][source->channels - 1][n_channels - 1];
+}
+
+// the values of channels missing in the source: 0, apart from alpha which is fully opaque
+static void xcf_gather_fill(uint8_t *fill, const int n_channels, const xcf_precision_t precision)
+{
+  const float fill_float[4] = { 0.0, 0.0, 0.0, 1.0 };
+  xcf_convert_from_float_be(fill_float + 4 - n_channels, fill, n_channels, precision);
+  if(n_channels != 2 && n_channels != 4) memset(fill, 0, 4 * 8);
+}
+
+// copy n_pixels pixels starting at x, y from the source to dest, converting them to the format used in the file:
+// big endian, n_channels per pixel in R, G, B, A order, straight alpha, in the given precision.
+// when the source has more channels than needed the extra ones are dropped. when it has less, the missing ones
+// are filled with 0, except for alpha which is set to fully opaque
+void xcf_gather_row(const xcf_source_t *source, const uint32_t x, const uint32_t y, const uint32_t n_pixels,
+                    uint8_t *dest, const int n_channels, const xcf_precision_t precision,
+                    const xcf_gather_kernel_t kernel, uint8_t *scratch)
+{
+  const int channel_size = xcf_precision_size(precision);
+  const int source_channel_size = xcf_precision_size(source->precision);
+  const size_t source_bpp = (size_t)source->channels * source_channel_size;
+
+  if(kernel)
+  {
+    const uint8_t *channels[4] = { NULL, NULL, NULL, NULL };
+    if(source->data)
+    {
+      const uint8_t *src = source->data + (size_t)y * source->stride + (size_t)x * source_bpp;
+      for(int c = 0; c < MIN(source->channels, n_channels); c++)
+        channels[c] = src + source->order[c] * channel_size;
+    }
+    else
+    {
+      for(int c = 0; c < MIN(source->channels, n_channels); c++)
+        channels[c] = source->planes[source->order[c]] + (size_t)y * source->stride + (size_t)x * channel_size;
+    }
+    uint8_t fill[4 * 8];
+    if(source->channels < n_channels) xcf_gather_fill(fill, n_channels, precision);
+    kernel(dest, channels, fill, n_pixels);
+    return;
+  }
+
+  const size_t bpp = (size_t)n_channels * channel_size;
+  const int has_alpha = (n_channels == 2 || n_channels == 4);
+  const int n_copy = MIN(source->channels, n_channels);
+  int in_order = 1;
+  for(int c = 0; c < n_copy; c++)
+    if(source->order[c] != c) in_order = 0;
+
+  // where the channels of the first pixel are, and the bytes from one pixel to the next
+  const uint8_t *channels[4] = { NULL, NULL, NULL, NULL };
+  size_t pixel_stride = source_bpp;
+  const uint8_t *src = NULL;
+  if(source->data)
+  {
+    src = source->data + (size_t)y * source->stride + (size_t)x * source_bpp;
+    for(int c = 0; c < MIN(source->channels, 4); c++)
+      channels[c] = src + c * source_channel_size;
+  }
+  else
+  {
+    pixel_stride = source_channel_size;
+    for(int c = 0; c < source->channels; c++)
+      channels[c] = source->planes[c] + (size_t)y * source->stride + (size_t)x * source_channel_size;
+  }
+
+  int premultiplied = source->alpha >= 0;
+  const int convert = source->precision != precision;
+
+  // everything but copying channels needs interleaved pixels
+  if(!src && (premultiplied || convert || (source->channels == n_channels && in_order)))
+  {
+    for(int c = 0; c < source->channels; c++)
+      for(uint32_t i = 0; i < n_pixels; i++)
+        memcpy(scratch + i * source_bpp + c * source_channel_size, channels[c] + i * source_channel_size,
+               source_channel_size);
+    src = scratch;
+  }
+
+  // premultiplied integers and doubles get fixed first, other floats are unpremultiplied on the way through float
+  if(premultiplied
+     && xcf_unpremultiply(src, scratch, n_pixels, source->channels, source->alpha, source->precision))
+  {
+    src = scratch;
+    premultiplied = 0;
+  }
+  if(src == scratch)
+  {
+    pixel_stride = source_bpp;
+    for(int c = 0; c < MIN(source->channels, 4); c++)
+      channels[c] = src + c * source_channel_size;
+  }
+  scratch += (size_t)n_pixels * source_bpp;
+
+  if(!convert && !premultiplied)
+  {
+    if(source->channels == n_channels && in_order)
+    {
+      // the common case, nothing to do but byte swapping
+      xcf_copy_values_be(dest, src, (size_t)n_pixels * n_channels, channel_size);
+      return;
+    }
+
+    // only the number or order of channels differs, copy the values without converting them
+    for(int c = 0; c < n_copy; c++)
+      xcf_copy_channel_be(dest + c * channel_size, bpp, channels[source->order[c]], pixel_stride,
+                          n_pixels, channel_size);
+    if(n_copy < n_channels)
+    {
+      uint8_t fill[4 * 8];
+      xcf_gather_fill(fill, n_channels, precision);
+      for(uint32_t i = 0; i < n_pixels; i++)
+        memcpy(dest + i * bpp + n_copy * channel_size, fill + n_copy * channel_size, (n_channels - n_copy) * channel_size);
+    }
+    return;
+  }
+
+  // different precisions, go through float
+  float *in = (float *)scratch;
+  float *out = in + (size_t)n_pixels * source->channels;
+  xcf_convert_to_float(src, in, (size_t)n_pixels * source->channels, source->precision);
+  if(premultiplied)
+    xcf_unpremultiply_float(in, n_pixels, source->channels, source->alpha);
+
+  for(uint32_t i = 0; i < n_pixels; i++)
+  {
+    for(int c = 0; c < n_copy; c++)
+      out[i * n_channels + c] = in[i * source->channels + source->order[c]];
+    for(int c = n_copy; c < n_channels; c++)
+      out[i * n_channels + c] = 0.0;
+    if(has_alpha && n_copy < n_channels)
+      out[i * n_channels + n_channels - 1] = 1.0;
+  }
+
+  // color channels also have to be converted between linear and gamma encoding. alpha is always linear
+  const int n_color = n_channels - has_alpha;
+  if(xcf_precision_is_gamma(source->precision) != xcf_precision_is_gamma(precision))
+  {
+    float (*transfer)(const float) = xcf_precision_is_gamma(precision) ? xcf_linear_to_gamma : xcf_gamma_to_linear;
+    for(uint32_t i = 0; i < n_pixels; i++)
+      for(int c = 0; c < MIN(n_color, n_copy); c++)
+        out[i * n_channels + c] = transfer(out[i * n_channels + c]);
+  }
+
+  xcf_convert_from_float_be(out, dest, (size_t)n_pixels * n_channels, precision);
+}
+
+// like xcf_gather_row(), but colors of sources with a palette are mapped to indices first
+void xcf_gather_indexed_row(const xcf_source_t *source, const uint32_t x, const uint32_t y,
+                            const uint32_t n_pixels, uint8_t *dest, const int n_channels,
+                            const xcf_precision_t precision, const xcf_gather_kernel_t kernel, uint8_t *scratch)
+{
+  if(!source->palette)
+  {
+    xcf_gather_row(source, x, y, n_pixels, dest, n_channels, precision, kernel, scratch);
+    return;
+  }
+
+  const int color_channels = n_channels == 2 ? 4 : 3;
+  uint8_t *colors = scratch;
+  xcf_gather_row(source, x, y, n_pixels, colors, color_channels, XCF_PRECISION_I_8_G, kernel,
+                 scratch + (size_t)n_pixels * 4);
+  xcf_palette_map(source->palette, colors, color_channels, dest, n_channels, n_pixels);
+}
+
+
+// encoding of tiles. this is independent of the file, so the result can be written right away or kept in memory
+
+// set up the encoder for a new layer. buffers from earlier layers are reused when they are big enough.
+// the encoder has to be zeroed before it is used for the first time
+// what deflateInit() allocates, with every allocation rounded up like in the pool of a static encoder. that depends
+// on the version of zlib and how it was built (zlib-ng, LIT_MEM, ...), so it's measured. 0 when that failed
+static void *xcf_zalloc_measure(void *opaque, unsigned int items, unsigned int size)
+{
+  *(size_t *)opaque += XCF_ALIGN((size_t)items * size);
+  return xcf_calloc(items, size);
+}
+
+static void xcf_zfree_measure(void *opaque, void *ptr)
+{
+  (void)opaque;
+  xcf_free(ptr);
+}
+
+static size_t xcf_deflate_memory(void)
+{
+  size_t allocated = 0;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.zalloc = xcf_zalloc_measure;
+  stream.zfree = xcf_zfree_measure;
+  stream.opaque = &allocated;
+  // the same as in xcf_tile_encoder_init_stream()
+  if(deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) return 0;
+  deflateEnd(&stream);
+  return allocated;
+}
+
+// set up the stream of zlib, it's kept for all layers
+static int xcf_tile_encoder_init_stream(xcf_tile_encoder_t *encoder)
+{
+  // the same settings as compress() uses
+  encoder->stream.zalloc = xcf_zalloc;
+  encoder->stream.zfree = xcf_zfree;
+  encoder->stream.opaque = &encoder->stream_memory;
+  const int zlib_res = deflateInit(&encoder->stream, Z_DEFAULT_COMPRESSION);
+  if(zlib_res != Z_OK)
+  {
+    PRINT_ERROR("error: can't initialize zlib: %d", zlib_res);
+    return 0;
+  }
+  encoder->stream_ready = 1;
+  encoder->stream_level = Z_DEFAULT_COMPRESSION;
+  encoder->stream_strategy = Z_DEFAULT_STRATEGY;
+  return 1;
+}
+
+// the sizes of the buffers of an encoder for a layer, 0 when a buffer isn't needed
+typedef struct xcf_encoder_sizes_t
+{
+  size_t input, tile, tile_compressed, scratch;
+} xcf_encoder_sizes_t;
+
+static void xcf_encoder_sizes(xcf_encoder_sizes_t *sizes, const xcf_source_t *source, const int n_channels,
+                              const xcf_precision_t precision, const uint8_t compression)
+{
+  sizes->tile = (size_t)n_channels * xcf_precision_size(precision) * TILE_SIZE * TILE_SIZE;
+  sizes->scratch = xcf_gather_scratch_size(source, n_channels, TILE_SIZE);
+  sizes->input = source->provider ? source->stride * TILE_SIZE : 0;
+  sizes->tile_compressed = compression == XCF_PROP_COMPRESSION_ZLIB ? compressBound(sizes->tile) : 0;
+}
+
+// the biggest buffers any source can need for tiles in precision: 4 channels from a source with 4 channels of
+// doubles. providers fill the input in the precision of the file
+static void xcf_encoder_static_sizes(xcf_encoder_sizes_t *sizes, const xcf_precision_t precision)
+{
+  xcf_source_t source;
+  xcf_source_init(&source, NULL, TILE_SIZE, 4, XCF_PRECISION_F_64_L);
+  sizes->tile = (size_t)4 * xcf_precision_size(precision) * TILE_SIZE * TILE_SIZE;
+  sizes->scratch = xcf_gather_scratch_size(&source, 4, TILE_SIZE);
+  sizes->input = sizes->tile;
+  sizes->tile_compressed = compressBound(sizes->tile);
+}
+
+size_t xcf_tile_encoder_static_size(const xcf_precision_t precision)
+{
+  const size_t deflate_memory = xcf_deflate_memory();
+  if(!deflate_memory) return 0;
+  xcf_encoder_sizes_t sizes;
+  xcf_encoder_static_sizes(&sizes, precision);
+  return XCF_ALIGN(sizes.input) + XCF_ALIGN(sizes.tile) + XCF_ALIGN(sizes.tile_compressed) + XCF_ALIGN(sizes.scratch)
+         + deflate_memory;
+}
+
+int xcf_tile_encoder_init_static(xcf_tile_encoder_t *encoder, void *memory, const size_t size,
+                                 const xcf_precision_t precision)
+{
+  xcf_encoder_sizes_t sizes;
+  xcf_encoder_static_sizes(&sizes, precision);
+  const size_t buffers = XCF_ALIGN(sizes.input) + XCF_ALIGN(sizes.tile) + XCF_ALIGN(sizes.tile_compressed)
+                         + XCF_ALIGN(sizes.scratch);
+  if(size < buffers) return 0;
+
+  uint8_t *next = (uint8_t *)memory;
+  encoder->input = next;
+  encoder->input_allocated = sizes.input;
+  next += XCF_ALIGN(sizes.input);
+  encoder->tile = next;
+  encoder->tile_allocated = sizes.tile;
+  next += XCF_ALIGN(sizes.tile);
+  encoder->tile_compressed = next;
+  encoder->tile_compressed_allocated = sizes.tile_compressed;
+  next += XCF_ALIGN(sizes.tile_compressed);
+  encoder->scratch = next;
+  encoder->scratch_allocated = sizes.scratch;
+  next += XCF_ALIGN(sizes.scratch);
+  // zlib gets the rest. its stream is set up right away, so it's known whether that's enough
+  encoder->stream_memory.pool = next;
+  encoder->stream_memory.pool_size = size - buffers;
+  encoder->fixed = 1;
+  return xcf_tile_encoder_init_stream(encoder);
+}
+
+size_t xcf_tile_encoder_memory(const xcf_tile_encoder_t *encoder)
+{
+  return encoder->input_allocated + encoder->tile_allocated + encoder->tile_compressed_allocated
+         + encoder->scratch_allocated + encoder->stream_memory.allocated;
+}
+
+size_t xcf_tile_encoder_need(const xcf_tile_encoder_t *encoder, const xcf_source_t *source, const int n_channels,
+                             const xcf_precision_t precision, const uint8_t compression)
+{
+  xcf_encoder_sizes_t sizes;
+  xcf_encoder_sizes(&sizes, source, n_channels, precision, compression);
+  size_t need = MAX(encoder->input_allocated, sizes.input) + MAX(encoder->tile_allocated, sizes.tile)
+                + MAX(encoder->tile_compressed_allocated, sizes.tile_compressed)
+                + MAX(encoder->scratch_allocated, sizes.scratch);
+  if(encoder->stream_ready)
+    need += encoder->stream_memory.allocated;
+  else if(compression == XCF_PROP_COMPRESSION_ZLIB)
+    need += xcf_deflate_memory();
+  return need;
+}
+
+int xcf_tile_encoder_init(xcf_tile_encoder_t *encoder, const xcf_source_t *source, const uint32_t width,
+                          const uint32_t height, const int n_channels, const xcf_precision_t precision,
+                          const uint8_t compression, const int level)
+{
+  const int channel_size = xcf_precision_size(precision);
+  if(channel_size == 0 || xcf_precision_size(source->precision) == 0)
+  {
+    PRINT_ERROR("error: unsupported precision");
+    return 0;
+  }
+  if(compression != XCF_PROP_COMPRESSION_NONE && compression != XCF_PROP_COMPRESSION_ZLIB)
+  {
+    PRINT_ERROR("error: compression %d is not supported", compression);
+    return 0;
+  }
+  if(level < XCF_ZLIB_LEVEL_ADAPTIVE || level > 9)
+  {
+    PRINT_ERROR("error: invalid zlib level %d", level);
+    return 0;
+  }
+
+  encoder->source = *source;
+  encoder->width = width;
+  encoder->height = height;
+  encoder->n_channels = n_channels;
+  encoder->channel_size = channel_size;
+  encoder->precision = precision;
+  encoder->compression = compression;
+  encoder->level = level;
+  // with a palette the colors are gathered as 8 bit RGB(A) first
+  if(source->palette)
+    encoder->kernel = xcf_gather_select(source, n_channels == 2 ? 4 : 3, XCF_PRECISION_I_8_G);
+  else
+    encoder->kernel = xcf_gather_select(source, n_channels, precision);
+
+  xcf_encoder_sizes_t sizes;
+  xcf_encoder_sizes(&sizes, source, n_channels, precision, compression);
+  if(encoder->fixed)
+  {
+    if(sizes.tile > encoder->tile_allocated || sizes.scratch > encoder->scratch_allocated
+       || sizes.input > encoder->input_allocated || sizes.tile_compressed > encoder->tile_compressed_allocated)
+    {
+      PRINT_ERROR("error: the tiles need bigger buffers than the encoder has");
+      return 0;
+    }
+  }
+  else if(!xcf_grow(&encoder->tile, &encoder->tile_allocated, sizes.tile)
+     || !xcf_grow(&encoder->scratch, &encoder->scratch_allocated, sizes.scratch)
+     || (sizes.input && !xcf_grow(&encoder->input, &encoder->input_allocated, sizes.input))
+     || (sizes.tile_compressed
+         && !xcf_grow(&encoder->tile_compressed, &encoder->tile_compressed_allocated, sizes.tile_compressed)))
+  {
+    PRINT_ERROR("error: out of memory");
+    return 0;
+  }
+
+  if(compression == XCF_PROP_COMPRESSION_ZLIB && !encoder->stream_ready && !xcf_tile_encoder_init_stream(encoder))
+    return 0;
+
+  return 1;
+}
+
+// free everything. the encoder can be used again after this, just like after zeroing it
+void xcf_tile_encoder_cleanup(xcf_tile_encoder_t *encoder)
+{
+  if(!encoder->fixed)
+  {
+    xcf_free(encoder->input);
+    xcf_free(encoder->tile);
+    xcf_free(encoder->tile_compressed);
+    xcf_free(encoder->scratch);
+  }
+  if(encoder->stream_ready) deflateEnd(&encoder->stream);
+  memset(encoder, 0, sizeof(*encoder));
+}
+
+// gather the tile with its top left corner at x, y into the tile buffer, in the format used in the file.
+// returns its size in bytes, 0 when the provider of the source failed
+size_t xcf_tile_gather(xcf_tile_encoder_t *encoder, const uint32_t x, const uint32_t y)
+{
+  const uint32_t tile_w = MIN(TILE_SIZE, encoder->width - x);
+  const uint32_t tile_h = MIN(TILE_SIZE, encoder->height - y);
+  const size_t row_size = (size_t)encoder->n_channels * encoder->channel_size * tile_w;
+
+  if(encoder->source.provider)
+  {
+    // the provider writes the tile into the input buffer, tightly packed. from there it's the same as reading from
+    // memory provided by the user
+    if(!encoder->source.provider(encoder->source.user, x, y, tile_w, tile_h, encoder->input))
+    {
+      PRINT_ERROR("error: the tile provider failed for the tile at %" PRIu32 ", %" PRIu32, x, y);
+      return 0;
+    }
+    xcf_source_t source = encoder->source;
+    source.data = encoder->input;
+    source.stride = source.stride / TILE_SIZE * tile_w;
+    for(uint32_t tile_y = 0; tile_y < tile_h; tile_y++)
+      xcf_gather_indexed_row(&source, 0, tile_y, tile_w, encoder->tile + tile_y * row_size,
+                             encoder->n_channels, encoder->precision, encoder->kernel, encoder->scratch);
+  }
+  else
+  {
+    for(uint32_t tile_y = 0; tile_y < tile_h; tile_y++)
+      xcf_gather_indexed_row(&encoder->source, x, y + tile_y, tile_w, encoder->tile + tile_y * row_size,
+                             encoder->n_channels, encoder->precision, encoder->kernel, encoder->scratch);
+  }
+
+  return row_size * tile_h;
+}
+
+// pick the settings of zlib for a tile from the entropy of the differences between neighbouring pixels, taken from a
+// sample of its bytes. only smooth tiles get a higher level, that's where searching harder finds much more. flat
+// tiles are as small as they get with the lowest level already, noisy ones like photos hardly get smaller. tiles of
+// close to uniform noise are only run length encoded, there are no matches to look for at all. run length encoding
+// only sees runs of single bytes and not of whole pixels though, so it's kept for tiles with nothing else in them.
+// 5 and not 9 is the higher level because 9 can take many times as long on smooth tiles of higher precisions
+static void xcf_choose_level(const uint8_t *tile, const size_t length, const size_t bpp, int *level, int *strategy)
+{
+  // an odd step, so the samples don't always hit the same channel
+  const size_t step = (length / 1024) | 1;
+  uint32_t histogram[256] = { 0 };
+  uint32_t n = 0;
+  for(size_t i = bpp; i < length; i += step, n++)
+    histogram[(uint8_t)(tile[i] - tile[i - bpp])]++;
+
+  float entropy = 0.0f;
+  for(int i = 0; i < 256 && n > 0; i++)
+    if(histogram[i])
+    {
+      const float p = (float)histogram[i] / n;
+      entropy -= p * log2f(p);
+    }
+
+  *level = entropy >= 0.1f && entropy < 2.0f ? 5 : 1;
+  *strategy = entropy < 7.0f ? Z_DEFAULT_STRATEGY : Z_RLE;
+}
+
+// compress the first length bytes of the tile buffer with the compression of the encoder. the result points into
+// one of the scratch buffers and is valid until the next call
+int xcf_tile_compress(xcf_tile_encoder_t *encoder, const size_t length, const uint8_t **result,
+                      size_t *result_length)
+{
+  if(encoder->compression == XCF_PROP_COMPRESSION_ZLIB)
+  {
+    // use zlib to compress the tile. the buffer is big enough, so everything is done in one call
+    z_stream *stream = &encoder->stream;
+    int level = encoder->level, strategy = Z_DEFAULT_STRATEGY;
+    if(level == XCF_ZLIB_LEVEL_ADAPTIVE)
+      xcf_choose_level(encoder->tile, length, (size_t)encoder->n_channels * encoder->channel_size, &level, &strategy);
+    if(level != encoder->stream_level || strategy != encoder->stream_strategy)
+    {
+      // the stream was just reset, so nothing has to be flushed
+      const int zlib_res = deflateParams(stream, level, strategy);
+      if(zlib_res != Z_OK)
+      {
+        PRINT_ERROR("error: can't set the zlib level %d: %d", level, zlib_res);
+        return 0;
+      }
+      encoder->stream_level = level;
+      encoder->stream_strategy = strategy;
+    }
+    stream->next_in = encoder->tile;
+    stream->avail_in = length;
+    stream->next_out = encoder->tile_compressed;
+    stream->avail_out = encoder->tile_compressed_allocated;
+    int zlib_res = deflate(stream, Z_FINISH);
+    const size_t dest_len = stream->total_out;
+    if(zlib_res == Z_STREAM_END) zlib_res = deflateReset(stream);
+    else if(zlib_res == Z_OK) zlib_res = Z_BUF_ERROR;
+    if(zlib_res != Z_OK)
+    {
+      PRINT_ERROR("error: can't compress tile: %d", zlib_res);
+      deflateReset(stream);
+      return 0;
+    }
+    *result = encoder->tile_compressed;
+    *result_length = dest_len;
+  }
+  else
+  {
+    *result = encoder->tile;
+    *result_length = length;
+  }
+
+  return 1;
+}
+
+// encode the tile with its top left corner at x, y. the result points into one of the scratch buffers and is
+// valid until the next call
+int xcf_encode_tile(xcf_tile_encoder_t *encoder, const uint32_t x, const uint32_t y,
+                    const uint8_t **result, size_t *length)
+{
+#ifdef XCF_ENABLE_TRACING
+  const uint32_t tile = (y / TILE_SIZE) * ((encoder->width + TILE_SIZE - 1) / TILE_SIZE) + x / TILE_SIZE;
+#endif
+
+  XCF_TRACE(encoder->trace, XCF_TRACE_GATHER, 1, tile);
+  const uint64_t start = xcf_now_ns();
+  const size_t tile_length = xcf_tile_gather(encoder, x, y);
+  const uint64_t gathered = xcf_now_ns();
+  encoder->gather_ns += gathered - start;
+  XCF_TRACE(encoder->trace, XCF_TRACE_GATHER, 0, tile);
+  if(!tile_length) return 0;
+
+  XCF_TRACE(encoder->trace, XCF_TRACE_COMPRESS, 1, tile);
+  const int res = xcf_tile_compress(encoder, tile_length, result, length);
+  encoder->compress_ns += xcf_now_ns() - gathered;
+  XCF_TRACE(encoder->trace, XCF_TRACE_COMPRESS, 0, tile);
+  return res;
+}
+
+
+// the lists of tile pointers
+
+void xcf_encode_pointers(uint8_t *dest, const int pointer_size, const uint64_t base, const uint64_t *offsets,
+                         const size_t n)
+{
+  if(pointer_size == 8)
+    for(size_t i = 0; i < n; i++)
+    {
+      const uint64_t pointer = htobe64(base + offsets[i]);
+      memcpy(dest + i * 8, &pointer, 8);
+    }
+  else
+    for(size_t i = 0; i < n; i++)
+    {
+      const uint32_t pointer = htobe32((uint32_t)(base + offsets[i]));
+      memcpy(dest + i * 4, &pointer, 4);
+    }
+}
@@ -0,0 +1,413 @@
+#pragma once
+
+// internal helpers shared between the source files of libxcf. this is not part of the public api!
+
+#include "xcf.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <zlib.h>
+
+#if defined(_WIN32)
+  #include <windows.h>
+  #if BYTE_ORDER == LITTLE_ENDIAN
+    #if defined(_MSC_VER)
+      #define htobe16(x) _byteswap_ushort(x)
+      #define htobe32(x) _byteswap_ulong(x)
+      #define htobe64(x) _byteswap_uint64(x)
+    #elif defined(__GNUC__) || defined(__clang__)
+      #define htobe16(x) __builtin_bswap16(x)
+      #define htobe32(x) __builtin_bswap32(x)
+      #define htobe64(x) __builtin_bswap64(x)
+    #endif
+  #else
+    #define htobe16(x) (x)
+    #define htobe32(x) (x)
+    #define htobe64(x) (x)
+  #endif
+  // swapping is symmetric
+  #define be16toh(x) htobe16(x)
+  #define be32toh(x) htobe32(x)
+  #define be64toh(x) htobe64(x)
+#elif defined(__APPLE__)
+  #include <libkern/OSByteOrder.h>
+  #define htobe16(x) OSSwapHostToBigInt16(x)
+  #define htobe32(x) OSSwapHostToBigInt32(x)
+  #define htobe64(x) OSSwapHostToBigInt64(x)
+  #define be16toh(x) OSSwapBigToHostInt16(x)
+  #define be32toh(x) OSSwapBigToHostInt32(x)
+  #define be64toh(x) OSSwapBigToHostInt64(x)
+#elif defined(__OpenBSD__)
+  #include <sys/endian.h>
+#elif  defined(__DragonFly__) || defined(__FreeBSD__) || defined(__NetBSD__)
+  #include <sys/endian.h>
+//   #define htobe16(x) noideawhat(x)
+//   #define htobe32(x) noideawhat(x)
+//   #define htobe64(x) noideawhat(x)
+#else
+  #include <endian.h>
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+// round up to a multiple of 16 bytes, the alignment malloc() guarantees on 64 bit systems
+#define XCF_ALIGN(x) (((x) + 15) & ~(size_t)15)
+#define CLAMP(a, b, c) ((a) < (b) ? (b) : ((a) > (c) ? (c) : (a)))
+
+#ifndef PRINT_ERROR
+#define PRINT_ERROR(msg, ...) fprintf(stderr, "[libxcf] " msg "\n", ##__VA_ARGS__)
+#endif
+
+#define TILE_SIZE 64
+
+// a monotonic clock for the statistics of a handle
+static inline uint64_t xcf_now_ns(void)
+{
+#if defined(_WIN32)
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)((double)counter.QuadPart * 1e9 / frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+// memory management. all allocations go through the allocator set with xcf_set_allocator()
+
+void *xcf_malloc(size_t size);
+void *xcf_calloc(size_t n, size_t size);
+void *xcf_realloc(void *ptr, size_t size);
+void xcf_free(void *ptr);
+char *xcf_strdup(const char *s);
+// make sure that *buffer can hold at least size bytes. the old content is not kept
+int xcf_grow(uint8_t **buffer, size_t *allocated, const size_t size);
+// the memory zlib allocated for a stream. with a pool it is handed out from there front to back instead of coming
+// from the allocator, the pool is only given back as a whole
+typedef struct xcf_zlib_memory_t
+{
+  size_t allocated; // nothing is subtracted when zlib frees something
+  uint8_t *pool;
+  size_t pool_size;
+} xcf_zlib_memory_t;
+
+// for zalloc and zfree of a z_stream. opaque is NULL or points to an xcf_zlib_memory_t
+void *xcf_zalloc(void *opaque, unsigned int items, unsigned int size);
+void xcf_zfree(void *opaque, void *ptr);
+
+// an arena for the many small allocations like names and parasites. everything allocated from it is only freed
+// as a whole
+typedef struct xcf_arena_block_t xcf_arena_block_t;
+typedef struct xcf_arena_t
+{
+  xcf_arena_block_t *first, *current;
+  size_t allocated; // the size of all blocks together
+  int fixed;        // the only block is memory from xcf_arena_init_static(), no more get allocated
+} xcf_arena_t;
+
+// use size bytes of memory, aligned to 16 bytes, as the only block of the arena. it's never freed
+void xcf_arena_init_static(xcf_arena_t *arena, void *memory, const size_t size);
+
+void *xcf_arena_alloc(xcf_arena_t *arena, size_t size);
+char *xcf_arena_strdup(xcf_arena_t *arena, const char *s);
+// make all memory available again, but keep the blocks around
+void xcf_arena_reset(xcf_arena_t *arena);
+void xcf_arena_free(xcf_arena_t *arena);
+
+
+// the process wide scheduler, only available when built with XCF_ENABLE_THREADS
+
+#ifdef XCF_ENABLE_THREADS
+// tasks are numbered. the result says if it succeeded
+typedef int (*xcf_task_func_t)(void *user, const uint64_t task);
+typedef struct xcf_task_group_t xcf_task_group_t;
+
+// a group of tasks belonging to one handle. the state of the last ring_size tasks is tracked, so there must never
+// be more tasks than that submitted that haven't been waited for
+xcf_task_group_t *xcf_task_group_new(xcf_task_func_t run, void *user, const uint32_t ring_size);
+// all tasks have to be waited for before this
+void xcf_task_group_free(xcf_task_group_t *group);
+// tasks have to be submitted in order, starting at any number once all earlier ones were waited for
+void xcf_task_submit(xcf_task_group_t *group, const uint64_t task);
+// wait until the task is finished, running tasks of the group in the calling thread meanwhile.
+// returns the result of the task
+int xcf_task_wait(xcf_task_group_t *group, const uint64_t task);
+#endif
+
+
+// tracing of the stages of writing a file. without XCF_ENABLE_TRACING the events aren't even compiled in
+
+typedef struct xcf_trace_t
+{
+  xcf_trace_func_t func;
+  void *user;
+} xcf_trace_t;
+
+void xcf_trace_emit(const xcf_trace_t *trace, const xcf_trace_kind_t kind, const int begin, const uint32_t index);
+
+#ifdef XCF_ENABLE_TRACING
+#define XCF_TRACE(_trace, _kind, _begin, _index)                                  \
+  do                                                                              \
+  {                                                                               \
+    if((_trace) && (_trace)->func) xcf_trace_emit(_trace, _kind, _begin, _index); \
+  } while(0)
+#else
+#define XCF_TRACE(_trace, _kind, _begin, _index) do {} while(0)
+#endif
+
+
+// conversion of pixel data
+
+// number of bytes per channel per pixel
+int xcf_precision_size(const xcf_precision_t precision);
+int xcf_precision_is_gamma(const xcf_precision_t precision);
+
+// the sRGB transfer functions
+float xcf_linear_to_gamma(const float value);
+float xcf_gamma_to_linear(const float value);
+
+// copy n_values values of channel_size bytes each, converting them to big endian. dest and src may be the same
+void xcf_copy_values_be(uint8_t *dest, const uint8_t *src, const size_t n_values, const int channel_size);
+// copy one channel of n pixels, converting it to big endian. the strides are the bytes from one pixel to the next
+void xcf_copy_channel_be(uint8_t *dest, const size_t dest_stride, const uint8_t *src, const size_t src_stride,
+                         const size_t n, const int channel_size);
+// undo premultiplied alpha of n pixels in host byte order with n_channels each, alpha is the index of the alpha
+// channel. 8, 16 and 32 bit integers and doubles are supported, 0 is returned for half and single floats, they lose
+// nothing with xcf_unpremultiply_float()
+int xcf_unpremultiply(const uint8_t *src, uint8_t *dest, const size_t n, const int n_channels, const int alpha,
+                      const xcf_precision_t precision);
+void xcf_unpremultiply_float(float *data, const size_t n, const int n_channels, const int alpha);
+// convert n values stored in host byte order in the given precision to float, without changing the encoding
+void xcf_convert_to_float(const uint8_t *src, float *dest, const size_t n, const xcf_precision_t precision);
+// convert n floats to big endian values in the given precision. integers are clamped and rounded to nearest
+void xcf_convert_from_float_be(const float *src, uint8_t *dest, const size_t n, const xcf_precision_t precision);
+
+
+// palettes of indexed images
+
+#define XCF_PALETTE_HASH_SIZE 512
+
+typedef struct xcf_palette_t
+{
+  uint32_t n_colors;
+  uint8_t colors[256 * 3];
+  int fixed; // set by the user, no colors get added
+
+  // the colors of the palette for exact lookups. keys are 0xRRGGBB with bit 24 set, 0 is an empty slot
+  uint32_t keys[XCF_PALETTE_HASH_SIZE];
+  uint8_t values[XCF_PALETTE_HASH_SIZE];
+
+  // the closest entry for colors that are not in the palette, with 5 bits per channel. only used when approximate
+  // is set, which is the case after xcf_palette_approximate()
+  uint8_t *nearest;
+  int approximate;
+} xcf_palette_t;
+
+typedef struct xcf_histogram_t xcf_histogram_t;
+
+// empty the palette. the buffer of nearest colors is kept
+void xcf_palette_init(xcf_palette_t *palette);
+void xcf_palette_free(xcf_palette_t *palette);
+// the bytes allocated by the palette
+size_t xcf_palette_memory(const xcf_palette_t *palette);
+// use the given colors, RGB with 8 bit each, and don't add any
+int xcf_palette_set(xcf_palette_t *palette, const uint8_t *colors, const uint32_t n_colors);
+// make sure the palette starts with the given colors, for indices that were made for them. a palette that isn't
+// fixed gets the ones it doesn't have yet appended. returns 0 when the colors differ or don't fit
+int xcf_palette_merge(xcf_palette_t *palette, const uint8_t *colors, const uint32_t n_colors);
+// add the colors of n 8 bit RGB or RGBA pixels. returns 0 when some of them don't fit, they have to be approximated
+// then. colors of fully transparent pixels are ignored
+int xcf_palette_add(xcf_palette_t *palette, const uint8_t *pixels, const int channels, const size_t n);
+xcf_histogram_t *xcf_histogram_new(void);
+// the bytes allocated for approximating colors: a histogram and the nearest colors of the palette
+size_t xcf_histogram_memory(void);
+void xcf_histogram_free(xcf_histogram_t *histogram);
+void xcf_histogram_add(xcf_histogram_t *histogram, const uint8_t *pixels, const int channels, const size_t n);
+// add the best approximation of the colors in the histogram to the free entries of the palette and find the
+// closest entry for all of them
+int xcf_palette_approximate(xcf_palette_t *palette, const xcf_histogram_t *histogram);
+// map n 8 bit RGB or RGBA pixels to the palette. dest gets the index and, with 2 channels, the alpha of every pixel
+void xcf_palette_map(const xcf_palette_t *palette, const uint8_t *pixels, const int channels, uint8_t *dest,
+                     const int n_dest_channels, const size_t n);
+
+
+// encoding of tiles, split into stages: gathering the pixels of a tile from the source, which adapts the channels
+// and precision and converts them to big endian, compressing the tile and encoding the pointers to the tiles.
+// none of them does any file io
+
+// the pixel data passed in by the user
+typedef struct xcf_source_t
+{
+  const uint8_t *data;
+  const uint8_t *planes[4];  // for planar data, one pointer per channel. data is NULL then
+  size_t stride;             // bytes from one row to the next, for planar data in every plane
+  int channels;              // channels per pixel
+  xcf_precision_t precision; // this can differ from the image, the data gets converted while writing
+  int order[4];              // for every channel in R, G, B, A (or Y, A) order its index in the source pixel
+  int alpha;                 // the index of premultiplied alpha in the source pixel, -1 when it's straight or missing
+
+  // when set, the data of every tile is asked for right before encoding it instead of reading it from memory
+  xcf_tile_provider_t provider;
+  void *user;
+
+  // when set, the source has colors that get mapped to this palette to get the indices of an indexed layer
+  const xcf_palette_t *palette;
+} xcf_source_t;
+
+// copies a row of pixels that don't need any conversion apart from the channels and byte order, see
+// xcf_gather_select()
+typedef void (*xcf_gather_kernel_t)(uint8_t *dest, const uint8_t * const channels[4], const uint8_t *fill,
+                                    const uint32_t n_pixels);
+
+// the state for encoding tiles. the buffers only grow, so keeping one around avoids allocations per layer
+typedef struct xcf_tile_encoder_t
+{
+  xcf_source_t source;
+  uint32_t width, height;
+  int n_channels;
+  int channel_size; // the number of bytes per channel per pixel. for a float rgb image it is 4
+  xcf_precision_t precision;
+  uint8_t compression;
+  int level; // of zlib, or XCF_ZLIB_LEVEL_ADAPTIVE
+  xcf_gather_kernel_t kernel; // for the source, selected once per layer
+
+  // scratch buffers
+  uint8_t *input; // the pixels of a tile from the provider of the source
+  uint8_t *tile;
+  uint8_t *tile_compressed;
+  uint8_t *scratch;
+  size_t input_allocated, tile_allocated, tile_compressed_allocated, scratch_allocated;
+  int fixed; // the buffers were given to xcf_tile_encoder_init_static(), they never grow
+
+  // reset for every tile instead of setting up a new one
+  z_stream stream;
+  int stream_ready;
+  int stream_level, stream_strategy; // what the stream is set up for right now
+  xcf_zlib_memory_t stream_memory;   // passed to zlib as opaque
+
+  // time spent in xcf_encode_tile(), for the statistics of the handle
+  uint64_t gather_ns, compress_ns;
+
+  // the tracing of the handle the encoder belongs to. may be NULL
+  const xcf_trace_t *trace;
+} xcf_tile_encoder_t;
+
+void xcf_source_init(xcf_source_t *source, const void *data, const uint32_t width, const int channels,
+                     const xcf_precision_t precision);
+// use separate planes instead of interleaved data and/or rows that are further apart than the width of the layer.
+// a stride of 0 means that the rows are tightly packed
+int xcf_source_set_memory(xcf_source_t *source, const void * const planes[4], const size_t stride,
+                          const uint32_t width);
+int xcf_source_set_layout(xcf_source_t *source, const xcf_channel_order_t order, const int premultiplied);
+
+// the number of bytes needed as scratch space by xcf_gather_row() for a row of n_pixels
+size_t xcf_gather_scratch_size(const xcf_source_t *source, const int n_channels, const uint32_t n_pixels);
+// the kernel specialized for gathering rows of the source with n_channels in precision. NULL when the source needs
+// more than copying, i.e. it is premultiplied, in another precision or has more than 4 channels
+xcf_gather_kernel_t xcf_gather_select(const xcf_source_t *source, const int n_channels,
+                                      const xcf_precision_t precision);
+// copy n_pixels pixels starting at x, y from the source to dest in the format used in the file: big endian,
+// n_channels per pixel in R, G, B, A order, straight alpha, in the given precision. kernel is what
+// xcf_gather_select() returned for the same arguments, it can be NULL to always take the generic path
+void xcf_gather_row(const xcf_source_t *source, const uint32_t x, const uint32_t y, const uint32_t n_pixels,
+                    uint8_t *dest, const int n_channels, const xcf_precision_t precision,
+                    const xcf_gather_kernel_t kernel, uint8_t *scratch);
+// like xcf_gather_row(), but colors of sources with a palette are mapped to indices first. the kernel has to be
+// selected for the 8 bit colors then
+void xcf_gather_indexed_row(const xcf_source_t *source, const uint32_t x, const uint32_t y,
+                            const uint32_t n_pixels, uint8_t *dest, const int n_channels,
+                            const xcf_precision_t precision, const xcf_gather_kernel_t kernel, uint8_t *scratch);
+
+// set up the encoder for a new layer. the encoder has to be zeroed before it is used for the first time.
+// level is the level of zlib or one of xcf_zlib_level_t
+int xcf_tile_encoder_init(xcf_tile_encoder_t *encoder, const xcf_source_t *source, const uint32_t width,
+                          const uint32_t height, const int n_channels, const xcf_precision_t precision,
+                          const uint8_t compression, const int level);
+// the memory a static encoder for tiles in precision needs, including the state of zlib. that is measured by setting
+// up a stream, which allocates. 0 when that failed
+size_t xcf_tile_encoder_static_size(const xcf_precision_t precision);
+// set up a zeroed encoder with all its memory in size bytes of memory, aligned to 16 bytes. the buffers are big enough
+// for any source with tiles in precision, layers in another precision fail. zlib gets the rest, its stream is set
+// up right away. returns 0 when size isn't enough
+int xcf_tile_encoder_init_static(xcf_tile_encoder_t *encoder, void *memory, const size_t size,
+                                 const xcf_precision_t precision);
+void xcf_tile_encoder_cleanup(xcf_tile_encoder_t *encoder);
+// the bytes allocated by the encoder right now, including the state of zlib
+size_t xcf_tile_encoder_memory(const xcf_tile_encoder_t *encoder);
+// the bytes the encoder will have allocated after xcf_tile_encoder_init() with these arguments. buffers that are
+// bigger already stay that size
+size_t xcf_tile_encoder_need(const xcf_tile_encoder_t *encoder, const xcf_source_t *source, const int n_channels,
+                             const xcf_precision_t precision, const uint8_t compression);
+// gather the tile at x, y into encoder->tile. returns its size in bytes or 0 on error
+size_t xcf_tile_gather(xcf_tile_encoder_t *encoder, const uint32_t x, const uint32_t y);
+// compress the first length bytes of encoder->tile. the result is valid until the next call
+int xcf_tile_compress(xcf_tile_encoder_t *encoder, const size_t length, const uint8_t **result,
+                      size_t *result_length);
+// both of the above, adding the time they take to the counters of the encoder
+int xcf_encode_tile(xcf_tile_encoder_t *encoder, const uint32_t x, const uint32_t y,
+                    const uint8_t **result, size_t *length);
+
+// write n big endian pointers of pointer_size bytes, base + offsets[i], to dest
+void xcf_encode_pointers(uint8_t *dest, const int pointer_size, const uint64_t base, const uint64_t *offsets,
+                         const size_t n);
+
+
+// reading of existing files. only used for the small parts we need to look at, like headers and pointer lists.
+// all reads are positioned and go through a small block cache, so walking the headers of a file usually
+// needs only a handful of read calls and never touches the tile data.
+
+#define XCF_READER_BLOCK_SIZE (16 * 1024)
+
+typedef struct xcf_reader_t
+{
+  FILE *fd;
+  int version;
+  int pointer_size;
+  uint64_t file_size;
+
+  // where the colors of the colormap of the image are, found by xcf_read_image_header(). 0 when it has none
+  uint64_t colormap;
+  uint32_t n_colors;
+
+  // the cached block
+  uint64_t block_offset;
+  size_t block_length;
+  uint8_t block[XCF_READER_BLOCK_SIZE];
+} xcf_reader_t;
+
+// opens the file and parses the magic at the start. on success the version and pointer size are known
+int xcf_reader_open(xcf_reader_t *reader, const char *filename, const char *mode);
+void xcf_reader_close(xcf_reader_t *reader);
+
+// all of these read at *offset and advance it by the number of bytes consumed. they return 0 on error
+int xcf_reader_read(xcf_reader_t *reader, uint64_t *offset, void *data, size_t length);
+int xcf_reader_uint32(xcf_reader_t *reader, uint64_t *offset, uint32_t *value);
+int xcf_reader_float(xcf_reader_t *reader, uint64_t *offset, float *value);
+int xcf_reader_pointer(xcf_reader_t *reader, uint64_t *offset, uint64_t *value);
+// the returned string has to be freed by the caller. empty strings in the file are returned as NULL
+int xcf_reader_string(xcf_reader_t *reader, uint64_t *offset, char **value);
+
+// overwrite existing data in the file. the reader has to be opened with mode "r+b" for that
+int xcf_reader_write(xcf_reader_t *reader, uint64_t offset, const void *data, size_t length);
+// append length bytes starting at offset to the end of dst, without going through user space where possible
+int xcf_reader_copy(xcf_reader_t *reader, uint64_t offset, uint64_t length, FILE *dst);
+// the number of bytes used by the zlib stream starting at offset. the stream gets decompressed to find its end
+int xcf_reader_zlib_length(xcf_reader_t *reader, uint64_t offset, uint64_t *length);
+
+// map the precision stored in the file to the current enum, taking old file versions into account
+int xcf_reader_precision(const int version, const uint32_t stored, xcf_precision_t *precision);
+
+// parse the image header and its properties. on success *layer_list is the file offset of the layer pointer list.
+// flags are the same as for xcf_scan()
+int xcf_read_image_header(xcf_reader_t *reader, xcf_info_t *info, const int flags, uint64_t *layer_list);
+// parse a layer header starting at offset. on success *hierarchy is the file offset of the layer's hierarchy
+int xcf_read_layer_header(xcf_reader_t *reader, uint64_t offset, xcf_info_layer_t *layer, const int flags,
+                          uint64_t *hierarchy);
+// free everything inside the structs, but not the structs themselves
+void xcf_info_clear(xcf_info_t *info);
+void xcf_info_layer_clear(xcf_info_layer_t *layer);
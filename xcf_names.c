@@ -201,6 +201,8 @@ const char *xcf_get_field_name(xcf_field_t field)
     case XCF_N_CHANNELS:      return STR(XCF_N_CHANNELS);
     // case XCF_TYPE:         return STR(XCF_TYPE);
     case XCF_OMIT_BASE_ALPHA: return STR(XCF_OMIT_BASE_ALPHA);
+    case XCF_ZLIB_LEVEL:      return STR(XCF_ZLIB_LEVEL);
+    case XCF_MEMORY_LIMIT:    return STR(XCF_MEMORY_LIMIT);
   }
 
   return NULL;
@@ -0,0 +1,356 @@
+#include "xcf.h"
+#include "xcf_internal.h"
+
+#include <string.h>
+
+// palettes of indexed images. colors are looked up in a small hash table first. when a layer has more colors than
+// fit into the palette, the missing ones are approximated with median cut on a histogram with 5 bits per channel
+// and every color of that histogram gets mapped to the closest entry of the palette.
+
+#define XCF_PALETTE_USED 0x1000000
+#define XCF_HISTOGRAM_SIZE (32 * 32 * 32)
+
+static inline uint32_t xcf_palette_hash(const uint32_t color)
+{
+  return (color * 2654435761u) >> (32 - 9);
+}
+
+static inline uint32_t xcf_rgb(const uint8_t *pixel)
+{
+  return ((uint32_t)pixel[0] << 16) | ((uint32_t)pixel[1] << 8) | pixel[2];
+}
+
+static inline uint32_t xcf_rgb555(const uint8_t *pixel)
+{
+  return ((uint32_t)(pixel[0] >> 3) << 10) | ((uint32_t)(pixel[1] >> 3) << 5) | (pixel[2] >> 3);
+}
+
+void xcf_palette_init(xcf_palette_t *palette)
+{
+  uint8_t *nearest = palette->nearest;
+  memset(palette, 0, sizeof(*palette));
+  palette->nearest = nearest;
+}
+
+void xcf_palette_free(xcf_palette_t *palette)
+{
+  xcf_free(palette->nearest);
+  palette->nearest = NULL;
+}
+
+size_t xcf_palette_memory(const xcf_palette_t *palette)
+{
+  return palette->nearest ? XCF_HISTOGRAM_SIZE : 0;
+}
+
+// the index of the color or -1 when it's not in the palette
+static inline int xcf_palette_find(const xcf_palette_t *palette, const uint32_t color)
+{
+  for(uint32_t i = xcf_palette_hash(color);; i = (i + 1) % XCF_PALETTE_HASH_SIZE)
+  {
+    if(palette->keys[i] == (color | XCF_PALETTE_USED)) return palette->values[i];
+    if(palette->keys[i] == 0) return -1;
+  }
+}
+
+// add a color that isn't in the palette yet. returns 0 when the palette is full
+static int xcf_palette_append(xcf_palette_t *palette, const uint32_t color)
+{
+  if(palette->n_colors >= 256) return 0;
+
+  const uint32_t index = palette->n_colors++;
+  palette->colors[index * 3 + 0] = color >> 16;
+  palette->colors[index * 3 + 1] = color >> 8;
+  palette->colors[index * 3 + 2] = color;
+
+  // the table is only half full at most, so there is always a free slot
+  uint32_t i = xcf_palette_hash(color);
+  while(palette->keys[i]) i = (i + 1) % XCF_PALETTE_HASH_SIZE;
+  palette->keys[i] = color | XCF_PALETTE_USED;
+  palette->values[i] = index;
+  return 1;
+}
+
+// append colors in the given order, so they keep their indices
+static int xcf_palette_extend(xcf_palette_t *palette, const uint8_t *colors, const uint32_t n_colors)
+{
+  if(palette->n_colors + n_colors > 256) return 0;
+  for(uint32_t i = 0; i < n_colors; i++)
+  {
+    const uint32_t color = xcf_rgb(colors + i * 3);
+    // the first of duplicate entries wins when looking colors up
+    if(xcf_palette_find(palette, color) < 0)
+      xcf_palette_append(palette, color);
+    else
+    {
+      memcpy(palette->colors + palette->n_colors * 3, colors + i * 3, 3);
+      palette->n_colors++;
+    }
+  }
+  return 1;
+}
+
+int xcf_palette_set(xcf_palette_t *palette, const uint8_t *colors, const uint32_t n_colors)
+{
+  if(n_colors > 256) return 0;
+  xcf_palette_init(palette);
+  xcf_palette_extend(palette, colors, n_colors);
+  palette->fixed = 1;
+  return 1;
+}
+
+int xcf_palette_merge(xcf_palette_t *palette, const uint8_t *colors, const uint32_t n_colors)
+{
+  const uint32_t n_common = MIN(palette->n_colors, n_colors);
+  if(memcmp(palette->colors, colors, 3 * n_common) != 0) return 0;
+  if(n_colors <= palette->n_colors) return 1;
+  if(palette->fixed) return 0;
+  return xcf_palette_extend(palette, colors + 3 * palette->n_colors, n_colors - palette->n_colors);
+}
+
+int xcf_palette_add(xcf_palette_t *palette, const uint8_t *pixels, const int channels, const size_t n)
+{
+  const int has_alpha = (channels == 4);
+  uint32_t last = XCF_PALETTE_USED; // never a color
+  for(size_t i = 0; i < n; i++)
+  {
+    const uint8_t *pixel = pixels + i * channels;
+    // fully transparent pixels don't need their color to be exact
+    if(has_alpha && pixel[3] == 0) continue;
+    const uint32_t color = xcf_rgb(pixel);
+    if(color == last) continue;
+    last = color;
+    if(xcf_palette_find(palette, color) >= 0) continue;
+    if(palette->fixed || !xcf_palette_append(palette, color)) return 0;
+  }
+  return 1;
+}
+
+
+// the approximation for colors that don't fit into the palette
+
+struct xcf_histogram_t
+{
+  uint32_t count[XCF_HISTOGRAM_SIZE];
+  uint64_t sum[XCF_HISTOGRAM_SIZE][3]; // to get the exact mean color of a box instead of the center of its bins
+};
+
+xcf_histogram_t *xcf_histogram_new(void)
+{
+  return (xcf_histogram_t *)xcf_calloc(1, sizeof(xcf_histogram_t));
+}
+
+size_t xcf_histogram_memory(void)
+{
+  return sizeof(xcf_histogram_t) + XCF_HISTOGRAM_SIZE;
+}
+
+void xcf_histogram_free(xcf_histogram_t *histogram)
+{
+  xcf_free(histogram);
+}
+
+void xcf_histogram_add(xcf_histogram_t *histogram, const uint8_t *pixels, const int channels, const size_t n)
+{
+  const int has_alpha = (channels == 4);
+  for(size_t i = 0; i < n; i++)
+  {
+    const uint8_t *pixel = pixels + i * channels;
+    if(has_alpha && pixel[3] == 0) continue;
+    const uint32_t bin = xcf_rgb555(pixel);
+    histogram->count[bin]++;
+    histogram->sum[bin][0] += pixel[0];
+    histogram->sum[bin][1] += pixel[1];
+    histogram->sum[bin][2] += pixel[2];
+  }
+}
+
+typedef struct xcf_box_t
+{
+  uint8_t min[3], max[3]; // inclusive, in histogram coordinates
+  uint64_t count;
+} xcf_box_t;
+
+static inline uint32_t xcf_bin(const int r, const int g, const int b)
+{
+  return ((uint32_t)r << 10) | ((uint32_t)g << 5) | (uint32_t)b;
+}
+
+// shrink the box to the bins that are used and count its pixels
+static void xcf_box_fit(const xcf_histogram_t *histogram, xcf_box_t *box)
+{
+  uint8_t min[3] = { 31, 31, 31 }, max[3] = { 0, 0, 0 };
+  box->count = 0;
+  for(int r = box->min[0]; r <= box->max[0]; r++)
+    for(int g = box->min[1]; g <= box->max[1]; g++)
+      for(int b = box->min[2]; b <= box->max[2]; b++)
+      {
+        const uint32_t count = histogram->count[xcf_bin(r, g, b)];
+        if(count == 0) continue;
+        box->count += count;
+        const int v[3] = { r, g, b };
+        for(int c = 0; c < 3; c++)
+        {
+          min[c] = MIN(min[c], v[c]);
+          max[c] = MAX(max[c], v[c]);
+        }
+      }
+  if(box->count == 0) return;
+  memcpy(box->min, min, 3);
+  memcpy(box->max, max, 3);
+}
+
+// split the box along its longest side at the median. returns 0 when it's just a single bin
+static int xcf_box_split(const xcf_histogram_t *histogram, xcf_box_t *box, xcf_box_t *other)
+{
+  int axis = 0;
+  for(int c = 1; c < 3; c++)
+    if(box->max[c] - box->min[c] > box->max[axis] - box->min[axis]) axis = c;
+  if(box->max[axis] == box->min[axis]) return 0;
+
+  // the number of pixels in every slice along the axis
+  uint64_t slices[32] = { 0 };
+  for(int r = box->min[0]; r <= box->max[0]; r++)
+    for(int g = box->min[1]; g <= box->max[1]; g++)
+      for(int b = box->min[2]; b <= box->max[2]; b++)
+      {
+        const int v[3] = { r, g, b };
+        slices[v[axis]] += histogram->count[xcf_bin(r, g, b)];
+      }
+
+  // the first slice where at least half of the pixels are covered stays in this box
+  uint64_t covered = 0;
+  int split = box->min[axis];
+  for(; split < box->max[axis] - 1; split++)
+  {
+    covered += slices[split];
+    if(covered * 2 >= box->count) break;
+  }
+
+  *other = *box;
+  box->max[axis] = split;
+  other->min[axis] = split + 1;
+  xcf_box_fit(histogram, box);
+  xcf_box_fit(histogram, other);
+  return 1;
+}
+
+static void xcf_box_mean(const xcf_histogram_t *histogram, const xcf_box_t *box, uint8_t *color)
+{
+  uint64_t sum[3] = { 0, 0, 0 };
+  for(int r = box->min[0]; r <= box->max[0]; r++)
+    for(int g = box->min[1]; g <= box->max[1]; g++)
+      for(int b = box->min[2]; b <= box->max[2]; b++)
+      {
+        const uint32_t bin = xcf_bin(r, g, b);
+        for(int c = 0; c < 3; c++)
+          sum[c] += histogram->sum[bin][c];
+      }
+  for(int c = 0; c < 3; c++)
+    color[c] = (sum[c] + box->count / 2) / box->count;
+}
+
+int xcf_palette_approximate(xcf_palette_t *palette, const xcf_histogram_t *histogram)
+{
+  if(!palette->nearest)
+  {
+    palette->nearest = (uint8_t *)xcf_malloc(XCF_HISTOGRAM_SIZE);
+    if(!palette->nearest) return 0;
+  }
+
+  // fill the free entries with median cut. the colors already in the palette stay where they are, earlier layers
+  // might use them
+  const int n_free = palette->fixed ? 0 : 256 - palette->n_colors;
+  if(n_free > 0)
+  {
+    xcf_box_t boxes[256];
+    int n_boxes = 1;
+    memset(&boxes[0], 0, sizeof(boxes[0]));
+    memset(boxes[0].max, 31, 3);
+    xcf_box_fit(histogram, &boxes[0]);
+    if(boxes[0].count == 0) n_boxes = 0;
+
+    while(n_boxes > 0 && n_boxes < n_free)
+    {
+      // split the box with the most pixels that can still be split
+      int best = -1;
+      for(int i = 0; i < n_boxes; i++)
+      {
+        const xcf_box_t *box = &boxes[i];
+        if(memcmp(box->min, box->max, 3) == 0) continue;
+        if(best < 0 || box->count > boxes[best].count) best = i;
+      }
+      if(best < 0 || !xcf_box_split(histogram, &boxes[best], &boxes[n_boxes])) break;
+      n_boxes++;
+    }
+
+    for(int i = 0; i < n_boxes; i++)
+    {
+      uint8_t color[3];
+      xcf_box_mean(histogram, &boxes[i], color);
+      if(xcf_palette_find(palette, xcf_rgb(color)) < 0)
+        xcf_palette_append(palette, xcf_rgb(color));
+    }
+  }
+
+  if(palette->n_colors == 0)
+  {
+    PRINT_ERROR("error: the palette is empty");
+    return 0;
+  }
+
+  // the closest entry for every bin that is used, measured from the center of the bin. the others can only be hit
+  // by transparent pixels
+  memset(palette->nearest, 0, XCF_HISTOGRAM_SIZE);
+  int16_t colors[3][256];
+  for(uint32_t i = 0; i < palette->n_colors; i++)
+    for(int c = 0; c < 3; c++)
+      colors[c][i] = palette->colors[i * 3 + c];
+  for(uint32_t bin = 0; bin < XCF_HISTOGRAM_SIZE; bin++)
+  {
+    if(histogram->count[bin] == 0) continue;
+    const int r = ((bin >> 10) << 3) | 4, g = (((bin >> 5) & 31) << 3) | 4, b = ((bin & 31) << 3) | 4;
+    int32_t best_distance = INT32_MAX;
+    uint8_t best = 0;
+    for(uint32_t i = 0; i < palette->n_colors; i++)
+    {
+      const int32_t dr = colors[0][i] - r, dg = colors[1][i] - g, db = colors[2][i] - b;
+      const int32_t distance = dr * dr + dg * dg + db * db;
+      if(distance < best_distance)
+      {
+        best_distance = distance;
+        best = i;
+      }
+    }
+    palette->nearest[bin] = best;
+  }
+
+  palette->approximate = 1;
+  return 1;
+}
+
+void xcf_palette_map(const xcf_palette_t *palette, const uint8_t *pixels, const int channels, uint8_t *dest,
+                     const int n_dest_channels, const size_t n)
+{
+  // neighbouring pixels often have the same color
+  uint32_t last = XCF_PALETTE_USED;
+  uint8_t last_index = 0;
+  for(size_t i = 0; i < n; i++)
+  {
+    const uint8_t *pixel = pixels + i * channels;
+    const uint32_t color = xcf_rgb(pixel);
+    if(color != last)
+    {
+      const int index = xcf_palette_find(palette, color);
+      if(index >= 0)
+        last_index = index;
+      else if(palette->approximate)
+        last_index = palette->nearest[xcf_rgb555(pixel)];
+      else
+        last_index = 0; // transparent pixels that were skipped when collecting the colors
+      last = color;
+    }
+    dest[i * n_dest_channels] = last_index;
+    if(n_dest_channels == 2) dest[i * 2 + 1] = channels == 4 ? pixel[3] : 255;
+  }
+}
@@ -0,0 +1,569 @@
+#define _GNU_SOURCE // for copy_file_range()
+
+#include "xcf.h"
+#include "xcf_internal.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#if !defined(_WIN32)
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  #define HAVE_COPY_FILE_RANGE
+#endif
+
+// a positioned read that doesn't depend on (or change) the position of the FILE.
+// returns the number of bytes read, which can be less than length at the end of the file
+static size_t xcf_pread(FILE *fd, void *data, size_t length, uint64_t offset)
+{
+#if !defined(_WIN32)
+  size_t total = 0;
+  while(total < length)
+  {
+    const ssize_t n = pread(fileno(fd), (uint8_t *)data + total, length - total, offset + total);
+    if(n <= 0) break;
+    total += n;
+  }
+  return total;
+#else
+  if(_fseeki64(fd, offset, SEEK_SET) != 0) return 0;
+  return fread(data, 1, length, fd);
+#endif
+}
+
+static int xcf_pwrite(FILE *fd, const void *data, size_t length, uint64_t offset)
+{
+#if !defined(_WIN32)
+  size_t total = 0;
+  while(total < length)
+  {
+    const ssize_t n = pwrite(fileno(fd), (const uint8_t *)data + total, length - total, offset + total);
+    if(n <= 0) return 0;
+    total += n;
+  }
+  return 1;
+#else
+  if(_fseeki64(fd, offset, SEEK_SET) != 0) return 0;
+  return fwrite(data, 1, length, fd) == length && fflush(fd) == 0;
+#endif
+}
+
+static uint64_t xcf_file_size(FILE *fd)
+{
+#if !defined(_WIN32)
+  struct stat st;
+  if(fstat(fileno(fd), &st) != 0) return 0;
+  return st.st_size;
+#else
+  if(_fseeki64(fd, 0, SEEK_END) != 0) return 0;
+  return _ftelli64(fd);
+#endif
+}
+
+
+// the low level reader
+
+int xcf_reader_open(xcf_reader_t *reader, const char *filename, const char *mode)
+{
+  memset(reader, 0, sizeof(*reader) - sizeof(reader->block));
+
+  if(!(reader->fd = fopen(filename, mode)))
+    return 0;
+
+  reader->file_size = xcf_file_size(reader->fd);
+
+  // the magic is "gimp xcf file" for version 0 and "gimp xcf vXXX" for everything else, followed by a '\0'
+  char magic[9 + 4 + 1];
+  uint64_t offset = 0;
+  if(!xcf_reader_read(reader, &offset, magic, sizeof(magic))
+     || memcmp(magic, "gimp xcf ", 9) != 0
+     || magic[13] != '\0')
+    goto error;
+
+  if(!memcmp(magic + 9, "file", 4))
+    reader->version = 0;
+  else if(magic[9] == 'v'
+          && magic[10] >= '0' && magic[10] <= '9'
+          && magic[11] >= '0' && magic[11] <= '9'
+          && magic[12] >= '0' && magic[12] <= '9')
+    reader->version = (magic[10] - '0') * 100 + (magic[11] - '0') * 10 + (magic[12] - '0');
+  else
+    goto error;
+
+  reader->pointer_size = reader->version <= 10 ? 4 : 8;
+
+  return 1;
+
+error:
+  xcf_reader_close(reader);
+  return 0;
+}
+
+void xcf_reader_close(xcf_reader_t *reader)
+{
+  if(reader->fd) fclose(reader->fd);
+  reader->fd = NULL;
+  reader->block_length = 0;
+}
+
+int xcf_reader_read(xcf_reader_t *reader, uint64_t *offset, void *data, size_t length)
+{
+  if(*offset + length > reader->file_size)
+    return 0;
+
+  if(length > XCF_READER_BLOCK_SIZE)
+  {
+    // too big for the cache, read it directly
+    if(xcf_pread(reader->fd, data, length, *offset) != length)
+      return 0;
+  }
+  else
+  {
+    if(*offset < reader->block_offset || *offset + length > reader->block_offset + reader->block_length)
+    {
+      reader->block_offset = *offset;
+      reader->block_length = xcf_pread(reader->fd, reader->block, XCF_READER_BLOCK_SIZE, *offset);
+      if(reader->block_length < length)
+      {
+        reader->block_length = 0;
+        return 0;
+      }
+    }
+    memcpy(data, reader->block + (*offset - reader->block_offset), length);
+  }
+
+  *offset += length;
+  return 1;
+}
+
+int xcf_reader_write(xcf_reader_t *reader, uint64_t offset, const void *data, size_t length)
+{
+  if(offset + length > reader->file_size) return 0;
+  // don't bother updating the cache, just drop it when it's affected
+  if(offset < reader->block_offset + reader->block_length && offset + length > reader->block_offset)
+    reader->block_length = 0;
+  return xcf_pwrite(reader->fd, data, length, offset);
+}
+
+int xcf_reader_copy(xcf_reader_t *reader, uint64_t offset, uint64_t length, FILE *dst)
+{
+  if(offset + length > reader->file_size) return 0;
+  if(fflush(dst) != 0) return 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  // let the kernel move the data. this can fail for all kinds of reasons, like the files being on different
+  // file systems with older kernels. in that case we just continue below with whatever is left
+  loff_t in_offset = offset;
+  while(length > 0)
+  {
+    const ssize_t n = copy_file_range(fileno(reader->fd), &in_offset, fileno(dst), NULL, length, 0);
+    if(n <= 0) break;
+    length -= n;
+  }
+  offset = in_offset;
+  // copy_file_range() moved the file offset behind the back of the FILE, sync it again
+  if(fseek(dst, 0, SEEK_END) != 0) return 0;
+#endif
+
+  // the fallback goes through the block cache
+  reader->block_length = 0;
+  while(length > 0)
+  {
+    const size_t chunk = MIN(length, XCF_READER_BLOCK_SIZE);
+    if(xcf_pread(reader->fd, reader->block, chunk, offset) != chunk) return 0;
+    if(fwrite(reader->block, 1, chunk, dst) != chunk) return 0;
+    offset += chunk;
+    length -= chunk;
+  }
+
+  return 1;
+}
+
+int xcf_reader_zlib_length(xcf_reader_t *reader, uint64_t offset, uint64_t *length)
+{
+  uint8_t in[4096], out[4096];
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if(inflateInit(&stream) != Z_OK) return 0;
+
+  int res = Z_OK;
+  while(res == Z_OK)
+  {
+    if(stream.avail_in == 0)
+    {
+      const size_t chunk = MIN(sizeof(in), reader->file_size - offset);
+      if(chunk == 0 || !xcf_reader_read(reader, &offset, in, chunk)) break;
+      stream.next_in = in;
+      stream.avail_in = chunk;
+    }
+    stream.next_out = out;
+    stream.avail_out = sizeof(out);
+    res = inflate(&stream, Z_NO_FLUSH);
+  }
+
+  *length = stream.total_in;
+  inflateEnd(&stream);
+  return res == Z_STREAM_END;
+}
+
+int xcf_reader_uint32(xcf_reader_t *reader, uint64_t *offset, uint32_t *value)
+{
+  uint32_t value_be;
+  if(!xcf_reader_read(reader, offset, &value_be, sizeof(value_be))) return 0;
+  *value = be32toh(value_be);
+  return 1;
+}
+
+int xcf_reader_float(xcf_reader_t *reader, uint64_t *offset, float *value)
+{
+  union {float f; uint32_t i;} v;
+  if(!xcf_reader_uint32(reader, offset, &v.i)) return 0;
+  *value = v.f;
+  return 1;
+}
+
+int xcf_reader_pointer(xcf_reader_t *reader, uint64_t *offset, uint64_t *value)
+{
+  if(reader->pointer_size == 4)
+  {
+    uint32_t value32;
+    if(!xcf_reader_uint32(reader, offset, &value32)) return 0;
+    *value = value32;
+  }
+  else
+  {
+    uint64_t value_be;
+    if(!xcf_reader_read(reader, offset, &value_be, sizeof(value_be))) return 0;
+    *value = be64toh(value_be);
+  }
+  return 1;
+}
+
+int xcf_reader_string(xcf_reader_t *reader, uint64_t *offset, char **value)
+{
+  uint32_t length;
+  *value = NULL;
+  if(!xcf_reader_uint32(reader, offset, &length)) return 0;
+  if(length == 0) return 1;
+  if(*offset + length > reader->file_size) return 0;
+
+  char *s = (char *)xcf_malloc(length);
+  if(!s) return 0;
+  if(!xcf_reader_read(reader, offset, s, length))
+  {
+    xcf_free(s);
+    return 0;
+  }
+  s[length - 1] = '\0';
+  *value = s;
+  return 1;
+}
+
+int xcf_reader_precision(const int version, const uint32_t stored, xcf_precision_t *precision)
+{
+  // before version 4 there was only 8 bit gamma, and versions 4 to 6 used different values
+  if(version < 4)
+  {
+    *precision = XCF_PRECISION_I_8_G;
+    return 1;
+  }
+  if(version == 4)
+  {
+    switch(stored)
+    {
+      case 0: *precision = XCF_PRECISION_I_8_G;  return 1;
+      case 1: *precision = XCF_PRECISION_I_16_G; return 1;
+      case 2: *precision = XCF_PRECISION_I_32_L; return 1;
+      case 3: *precision = XCF_PRECISION_F_16_L; return 1;
+      case 4: *precision = XCF_PRECISION_F_32_L; return 1;
+      default: return 0;
+    }
+  }
+  if(version < 7)
+  {
+    switch(stored)
+    {
+      case 100: *precision = XCF_PRECISION_I_8_L;  return 1;
+      case 150: *precision = XCF_PRECISION_I_8_G;  return 1;
+      case 200: *precision = XCF_PRECISION_I_16_L; return 1;
+      case 250: *precision = XCF_PRECISION_I_16_G; return 1;
+      case 300: *precision = XCF_PRECISION_I_32_L; return 1;
+      case 350: *precision = XCF_PRECISION_I_32_G; return 1;
+      case 400: *precision = XCF_PRECISION_F_16_L; return 1;
+      case 450: *precision = XCF_PRECISION_F_16_G; return 1;
+      case 500: *precision = XCF_PRECISION_F_32_L; return 1;
+      case 550: *precision = XCF_PRECISION_F_32_G; return 1;
+      default: return 0;
+    }
+  }
+
+  // we rely on xcf_get_precision_name() to know all valid values
+  if(!xcf_get_precision_name((xcf_precision_t)stored))
+    return 0;
+  *precision = (xcf_precision_t)stored;
+  return 1;
+}
+
+
+// parsing of headers and property lists
+
+// parse the payload of a XCF_PROP_PARASITES, which can hold any number of parasites
+static int xcf_read_parasites(xcf_reader_t *reader, uint64_t offset, const uint32_t size, const int flags,
+                              uint32_t *n_parasites, xcf_info_parasite_t **parasites)
+{
+  const uint64_t end = offset + size;
+  while(offset < end)
+  {
+    xcf_info_parasite_t parasite = { 0 };
+    if(!xcf_reader_string(reader, &offset, &parasite.name)) return 0;
+    if(!xcf_reader_uint32(reader, &offset, &parasite.flags)
+       || !xcf_reader_uint32(reader, &offset, &parasite.length)
+       || offset + parasite.length > end)
+    {
+      xcf_free(parasite.name);
+      return 0;
+    }
+    if(flags & XCF_SCAN_PARASITE_DATA)
+    {
+      parasite.data = (uint8_t *)xcf_malloc(parasite.length ? parasite.length : 1);
+      if(!parasite.data || !xcf_reader_read(reader, &offset, parasite.data, parasite.length))
+      {
+        xcf_free(parasite.name);
+        xcf_free(parasite.data);
+        return 0;
+      }
+    }
+    else
+      offset += parasite.length;
+
+    xcf_info_parasite_t *new_parasites = (xcf_info_parasite_t *)xcf_realloc(*parasites,
+                                                                        (*n_parasites + 1) * sizeof(xcf_info_parasite_t));
+    if(!new_parasites)
+    {
+      xcf_free(parasite.name);
+      xcf_free(parasite.data);
+      return 0;
+    }
+    *parasites = new_parasites;
+    (*parasites)[(*n_parasites)++] = parasite;
+  }
+  return 1;
+}
+
+static void xcf_info_parasites_free(const uint32_t n_parasites, xcf_info_parasite_t *parasites)
+{
+  for(uint32_t i = 0; i < n_parasites; i++)
+  {
+    xcf_free(parasites[i].name);
+    xcf_free(parasites[i].data);
+  }
+  xcf_free(parasites);
+}
+
+int xcf_read_image_header(xcf_reader_t *reader, xcf_info_t *info, const int flags, uint64_t *layer_list)
+{
+  uint64_t offset = 9 + 4 + 1;
+  uint32_t base_type, precision = 0;
+
+  info->version = reader->version;
+  info->compression = XCF_PROP_COMPRESSION_RLE; // that's what GIMP assumes when the property is missing
+  reader->colormap = 0;
+  reader->n_colors = 0;
+
+  if(!xcf_reader_uint32(reader, &offset, &info->width)) return 0;
+  if(!xcf_reader_uint32(reader, &offset, &info->height)) return 0;
+  if(!xcf_reader_uint32(reader, &offset, &base_type)) return 0;
+  if(reader->version >= 4 && !xcf_reader_uint32(reader, &offset, &precision)) return 0;
+  if(!xcf_get_base_type_name((xcf_base_type_t)base_type)) return 0;
+  info->base_type = (xcf_base_type_t)base_type;
+  if(!xcf_reader_precision(reader->version, precision, &info->precision)) return 0;
+
+  while(1)
+  {
+    uint32_t type, size;
+    if(!xcf_reader_uint32(reader, &offset, &type)) return 0;
+    if(!xcf_reader_uint32(reader, &offset, &size)) return 0;
+    if(type == XCF_PROP_END) break;
+    if(offset + size > reader->file_size) return 0;
+
+    if(type == XCF_PROP_COMPRESSION && size >= 1)
+    {
+      uint8_t compression;
+      uint64_t o = offset;
+      if(!xcf_reader_read(reader, &o, &compression, 1)) return 0;
+      info->compression = (xcf_prop_compression_t)compression;
+    }
+    else if(type == XCF_PROP_COLORMAP && size >= 4)
+    {
+      uint32_t n_colors;
+      uint64_t o = offset;
+      if(!xcf_reader_uint32(reader, &o, &n_colors)) return 0;
+      // broken colormaps are skipped, only copying indexed layers needs it
+      if(n_colors <= 256 && 4 + 3 * n_colors <= size)
+      {
+        reader->colormap = o;
+        reader->n_colors = n_colors;
+      }
+    }
+    else if(type == XCF_PROP_PARASITES)
+    {
+      if(!xcf_read_parasites(reader, offset, size, flags, &info->n_parasites, &info->parasites)) return 0;
+    }
+    offset += size;
+  }
+
+  *layer_list = offset;
+  return 1;
+}
+
+int xcf_read_layer_header(xcf_reader_t *reader, uint64_t offset, xcf_info_layer_t *layer, const int flags,
+                          uint64_t *hierarchy)
+{
+  uint32_t type;
+
+  // these are the defaults GIMP uses when the properties are missing
+  layer->opacity = 1.0;
+  layer->visible = 0;
+  layer->mode = XCF_PROP_MODE_LEGACY_NORMAL;
+
+  if(!xcf_reader_uint32(reader, &offset, &layer->width)) return 0;
+  if(!xcf_reader_uint32(reader, &offset, &layer->height)) return 0;
+  if(!xcf_reader_uint32(reader, &offset, &type)) return 0;
+  layer->type = (xcf_type_t)type;
+  if(!xcf_reader_string(reader, &offset, &layer->name)) return 0;
+
+  while(1)
+  {
+    uint32_t prop, size;
+    if(!xcf_reader_uint32(reader, &offset, &prop)) return 0;
+    if(!xcf_reader_uint32(reader, &offset, &size)) return 0;
+    if(prop == XCF_PROP_END) break;
+    if(offset + size > reader->file_size) return 0;
+
+    uint64_t o = offset;
+    uint32_t value;
+    switch(prop)
+    {
+      case XCF_PROP_OPACITY:
+        if(!xcf_reader_uint32(reader, &o, &value)) return 0;
+        layer->opacity = CLAMP(value / 255.0, 0.0, 1.0);
+        break;
+      case XCF_PROP_FLOAT_OPACITY:
+        if(!xcf_reader_float(reader, &o, &layer->opacity)) return 0;
+        break;
+      case XCF_PROP_VISIBLE:
+        if(!xcf_reader_uint32(reader, &o, &value)) return 0;
+        layer->visible = value ? 1 : 0;
+        break;
+      case XCF_PROP_MODE:
+        if(!xcf_reader_uint32(reader, &o, &value)) return 0;
+        layer->mode = (int32_t)value;
+        break;
+      case XCF_PROP_OFFSETS:
+        if(!xcf_reader_uint32(reader, &o, &value)) return 0;
+        layer->offset_x = (int32_t)value;
+        if(!xcf_reader_uint32(reader, &o, &value)) return 0;
+        layer->offset_y = (int32_t)value;
+        break;
+      case XCF_PROP_PARASITES:
+        if(!xcf_read_parasites(reader, offset, size, flags, &layer->n_parasites, &layer->parasites)) return 0;
+        break;
+    }
+    offset += size;
+  }
+
+  return xcf_reader_pointer(reader, &offset, hierarchy);
+}
+
+void xcf_info_layer_clear(xcf_info_layer_t *layer)
+{
+  xcf_free(layer->name);
+  xcf_info_parasites_free(layer->n_parasites, layer->parasites);
+  memset(layer, 0, sizeof(*layer));
+}
+
+void xcf_info_clear(xcf_info_t *info)
+{
+  if(info->layers)
+    for(uint32_t i = 0; i < info->n_layers; i++)
+      xcf_info_layer_clear(&info->layers[i]);
+  xcf_free(info->layers);
+  xcf_info_parasites_free(info->n_parasites, info->parasites);
+  memset(info, 0, sizeof(*info));
+}
+
+
+// public api
+
+xcf_info_t *xcf_scan(const char *filename, const int flags)
+{
+  xcf_reader_t *reader = (xcf_reader_t *)xcf_calloc(1, sizeof(xcf_reader_t));
+  xcf_info_t *info = (xcf_info_t *)xcf_calloc(1, sizeof(xcf_info_t));
+  uint64_t *layer_pointers = NULL;
+  if(!reader || !info) goto error;
+
+  if(!xcf_reader_open(reader, filename, "rb")) goto error;
+
+  uint64_t offset;
+  if(!xcf_read_image_header(reader, info, flags, &offset)) goto error;
+
+  // the layer and channel lists are terminated by a 0 pointer
+  uint32_t allocated = 0;
+  while(1)
+  {
+    uint64_t pointer;
+    if(!xcf_reader_pointer(reader, &offset, &pointer)) goto error;
+    if(!pointer) break;
+    if(info->n_layers == allocated)
+    {
+      allocated = allocated ? 2 * allocated : 16;
+      uint64_t *new_pointers = (uint64_t *)xcf_realloc(layer_pointers, allocated * sizeof(uint64_t));
+      if(!new_pointers) goto error;
+      layer_pointers = new_pointers;
+    }
+    layer_pointers[info->n_layers++] = pointer;
+  }
+  while(1)
+  {
+    uint64_t pointer;
+    if(!xcf_reader_pointer(reader, &offset, &pointer)) goto error;
+    if(!pointer) break;
+    info->n_channels++;
+  }
+
+  if((flags & XCF_SCAN_LAYERS) && info->n_layers > 0)
+  {
+    info->layers = (xcf_info_layer_t *)xcf_calloc(info->n_layers, sizeof(xcf_info_layer_t));
+    if(!info->layers) goto error;
+    for(uint32_t i = 0; i < info->n_layers; i++)
+    {
+      uint64_t hierarchy;
+      if(!xcf_read_layer_header(reader, layer_pointers[i], &info->layers[i], flags, &hierarchy)) goto error;
+    }
+  }
+
+  xcf_free(layer_pointers);
+  xcf_reader_close(reader);
+  xcf_free(reader);
+  return info;
+
+error:
+  xcf_free(layer_pointers);
+  if(reader) xcf_reader_close(reader);
+  xcf_free(reader);
+  xcf_info_free(info);
+  return NULL;
+}
+
+void xcf_info_free(xcf_info_t *info)
+{
+  if(!info) return;
+  xcf_info_clear(info);
+  xcf_free(info);
+}
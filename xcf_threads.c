@@ -0,0 +1,288 @@
+#define _GNU_SOURCE // for pthread_setaffinity_np()
+
+#include "xcf.h"
+#include "xcf_internal.h"
+
+#include <string.h>
+
+// the process wide scheduler. every handle has a task group with a queue of tiles to encode. the workers serve
+// the groups round robin, so a handle writing a huge layer can't starve the others. the thread writing a file
+// only waits for its tiles in order and helps encoding them while it waits.
+
+#ifdef XCF_ENABLE_THREADS
+
+#include <pthread.h>
+
+struct xcf_task_group_t
+{
+  xcf_task_func_t run;
+  void *user;
+
+  // tasks [next, end) are waiting to be picked up
+  uint64_t next, end;
+  // the state of the last ring_size tasks: 0 while it's not finished, 1 on success and -1 on failure
+  int8_t *state;
+  uint32_t ring_size;
+
+  // the list of groups with waiting tasks
+  xcf_task_group_t *prev_active, *next_active;
+  int active;
+};
+
+static struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t work;     // there are new tasks
+  pthread_cond_t finished; // a task was finished
+  int running;
+  int n_workers;
+  pthread_t *workers;
+  int *cpus;
+  int n_cpus;
+
+  // circular list of groups with waiting tasks. the workers continue from where the last one took something
+  xcf_task_group_t *active;
+} scheduler = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, NULL, NULL, 0, NULL };
+
+// all of these expect the mutex to be locked
+
+static void xcf_group_activate(xcf_task_group_t *group)
+{
+  if(group->active) return;
+  group->active = 1;
+  if(!scheduler.active)
+  {
+    group->prev_active = group->next_active = group;
+    scheduler.active = group;
+  }
+  else
+  {
+    // insert right before the one that is next in line, so it's served last
+    xcf_task_group_t *next = scheduler.active;
+    group->next_active = next;
+    group->prev_active = next->prev_active;
+    next->prev_active->next_active = group;
+    next->prev_active = group;
+  }
+}
+
+static void xcf_group_deactivate(xcf_task_group_t *group)
+{
+  if(!group->active) return;
+  group->active = 0;
+  if(group->next_active == group)
+    scheduler.active = NULL;
+  else
+  {
+    group->prev_active->next_active = group->next_active;
+    group->next_active->prev_active = group->prev_active;
+    if(scheduler.active == group) scheduler.active = group->next_active;
+  }
+  group->prev_active = group->next_active = NULL;
+}
+
+// take the next task of the group and run it. the mutex is unlocked while the task runs
+static void xcf_group_run_one(xcf_task_group_t *group)
+{
+  const uint64_t task = group->next++;
+  if(group->next == group->end) xcf_group_deactivate(group);
+
+  pthread_mutex_unlock(&scheduler.mutex);
+  const int res = group->run(group->user, task);
+  pthread_mutex_lock(&scheduler.mutex);
+
+  group->state[task % group->ring_size] = res ? 1 : -1;
+  pthread_cond_broadcast(&scheduler.finished);
+}
+
+static void *xcf_worker(void *arg)
+{
+  const int n = (int)(intptr_t)arg;
+
+#ifdef __linux__
+  if(scheduler.n_cpus > 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(scheduler.cpus[n % scheduler.n_cpus], &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      PRINT_ERROR("warning: can't pin worker %d to cpu %d", n, scheduler.cpus[n % scheduler.n_cpus]);
+  }
+#else
+  (void)n;
+#endif
+
+  pthread_mutex_lock(&scheduler.mutex);
+  while(scheduler.running)
+  {
+    if(!scheduler.active)
+    {
+      pthread_cond_wait(&scheduler.work, &scheduler.mutex);
+      continue;
+    }
+
+    // round robin over the handles
+    xcf_task_group_t *group = scheduler.active;
+    scheduler.active = group->next_active;
+    xcf_group_run_one(group);
+  }
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  return NULL;
+}
+
+int xcf_scheduler_start(const int n_threads, const int *cpus, const int n_cpus)
+{
+  if(n_threads < 1)
+  {
+    PRINT_ERROR("error: the scheduler needs at least one thread");
+    return 0;
+  }
+
+  pthread_mutex_lock(&scheduler.mutex);
+  if(scheduler.running)
+  {
+    pthread_mutex_unlock(&scheduler.mutex);
+    PRINT_ERROR("error: the scheduler is already running");
+    return 0;
+  }
+
+  scheduler.workers = (pthread_t *)xcf_malloc(n_threads * sizeof(pthread_t));
+  scheduler.cpus = n_cpus > 0 ? (int *)xcf_malloc(n_cpus * sizeof(int)) : NULL;
+  if(!scheduler.workers || (n_cpus > 0 && !scheduler.cpus))
+  {
+    xcf_free(scheduler.workers);
+    xcf_free(scheduler.cpus);
+    scheduler.workers = NULL;
+    scheduler.cpus = NULL;
+    pthread_mutex_unlock(&scheduler.mutex);
+    PRINT_ERROR("error: out of memory");
+    return 0;
+  }
+  if(n_cpus > 0) memcpy(scheduler.cpus, cpus, n_cpus * sizeof(int));
+  scheduler.n_cpus = MAX(n_cpus, 0);
+  scheduler.running = 1;
+  scheduler.n_workers = 0;
+  for(int i = 0; i < n_threads; i++)
+  {
+    if(pthread_create(&scheduler.workers[i], NULL, xcf_worker, (void *)(intptr_t)i) != 0)
+    {
+      PRINT_ERROR("warning: could only start %d of %d threads", i, n_threads);
+      break;
+    }
+    scheduler.n_workers++;
+  }
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  if(scheduler.n_workers == 0)
+  {
+    xcf_scheduler_stop();
+    return 0;
+  }
+
+  return 1;
+}
+
+void xcf_scheduler_stop(void)
+{
+  pthread_mutex_lock(&scheduler.mutex);
+  scheduler.running = 0;
+  pthread_cond_broadcast(&scheduler.work);
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  // the workers finish the task they are running. whatever is still queued is done by the waiting writers
+  for(int i = 0; i < scheduler.n_workers; i++)
+    pthread_join(scheduler.workers[i], NULL);
+
+  pthread_mutex_lock(&scheduler.mutex);
+  xcf_free(scheduler.workers);
+  xcf_free(scheduler.cpus);
+  scheduler.workers = NULL;
+  scheduler.cpus = NULL;
+  scheduler.n_workers = 0;
+  scheduler.n_cpus = 0;
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+int xcf_scheduler_threads(void)
+{
+  pthread_mutex_lock(&scheduler.mutex);
+  const int n = scheduler.running ? scheduler.n_workers : 0;
+  pthread_mutex_unlock(&scheduler.mutex);
+  return n;
+}
+
+xcf_task_group_t *xcf_task_group_new(xcf_task_func_t run, void *user, const uint32_t ring_size)
+{
+  xcf_task_group_t *group = (xcf_task_group_t *)xcf_calloc(1, sizeof(xcf_task_group_t));
+  if(!group) return NULL;
+  group->state = (int8_t *)xcf_calloc(ring_size, sizeof(int8_t));
+  if(!group->state)
+  {
+    xcf_free(group);
+    return NULL;
+  }
+  group->run = run;
+  group->user = user;
+  group->ring_size = ring_size;
+  return group;
+}
+
+void xcf_task_group_free(xcf_task_group_t *group)
+{
+  if(!group) return;
+  pthread_mutex_lock(&scheduler.mutex);
+  xcf_group_deactivate(group);
+  pthread_mutex_unlock(&scheduler.mutex);
+  xcf_free(group->state);
+  xcf_free(group);
+}
+
+void xcf_task_submit(xcf_task_group_t *group, const uint64_t task)
+{
+  pthread_mutex_lock(&scheduler.mutex);
+  if(group->next == group->end) group->next = group->end = task;
+  group->state[task % group->ring_size] = 0;
+  group->end = task + 1;
+  xcf_group_activate(group);
+  pthread_cond_signal(&scheduler.work);
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+int xcf_task_wait(xcf_task_group_t *group, const uint64_t task)
+{
+  pthread_mutex_lock(&scheduler.mutex);
+  int8_t state;
+  while((state = group->state[task % group->ring_size]) == 0)
+  {
+    // help with our own tasks instead of idling. without workers this runs everything
+    if(group->next < group->end)
+      xcf_group_run_one(group);
+    else
+      pthread_cond_wait(&scheduler.finished, &scheduler.mutex);
+  }
+  pthread_mutex_unlock(&scheduler.mutex);
+  return state > 0;
+}
+
+#else // XCF_ENABLE_THREADS
+
+int xcf_scheduler_start(const int n_threads, const int *cpus, const int n_cpus)
+{
+  (void)n_threads;
+  (void)cpus;
+  (void)n_cpus;
+  PRINT_ERROR("error: libxcf was built without thread support");
+  return 0;
+}
+
+void xcf_scheduler_stop(void)
+{
+}
+
+int xcf_scheduler_threads(void)
+{
+  return 0;
+}
+
+#endif // XCF_ENABLE_THREADS
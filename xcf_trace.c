@@ -0,0 +1,111 @@
+#include "xcf.h"
+#include "xcf_internal.h"
+
+#include <stdio.h>
+
+#ifdef XCF_ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+// tracing of the stages of writing a file and a sink writing them in the Chrome trace event format, see
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+
+void xcf_trace_emit(const xcf_trace_t *trace, const xcf_trace_kind_t kind, const int begin, const uint32_t index)
+{
+  xcf_trace_event_t event;
+  event.kind = kind;
+  event.begin = begin;
+  event.time_ns = xcf_now_ns();
+  event.index = index;
+  trace->func(trace->user, &event);
+}
+
+
+// the chrome trace sink
+
+#define XCF_TRACE_MAX_THREADS 64
+
+struct xcf_chrome_trace_t
+{
+  FILE *fd;
+  uint64_t start_ns; // timestamps are relative to this, Perfetto shows them from 0 then
+  int first;
+  int failed;
+
+#ifdef XCF_ENABLE_THREADS
+  // events of workers of the scheduler arrive concurrently. every thread gets a small number as its id
+  pthread_mutex_t mutex;
+  pthread_t threads[XCF_TRACE_MAX_THREADS];
+  int n_threads;
+#endif
+};
+
+static const char *xcf_trace_names[] = { "header", "layer", "channel", "gather", "compress", "write", "close" };
+
+xcf_chrome_trace_t *xcf_chrome_trace_open(const char *filename)
+{
+  xcf_chrome_trace_t *trace = (xcf_chrome_trace_t *)xcf_calloc(1, sizeof(xcf_chrome_trace_t));
+  if(!trace)
+  {
+    PRINT_ERROR("error: out of memory");
+    return NULL;
+  }
+
+  if(!(trace->fd = fopen(filename, "wb")))
+  {
+    PRINT_ERROR("error: can't open '%s'", filename);
+    xcf_free(trace);
+    return NULL;
+  }
+
+#ifdef XCF_ENABLE_THREADS
+  pthread_mutex_init(&trace->mutex, NULL);
+#endif
+  trace->start_ns = xcf_now_ns();
+  trace->first = 1;
+  if(fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", trace->fd) == EOF) trace->failed = 1;
+  return trace;
+}
+
+void xcf_chrome_trace_event(void *user, const xcf_trace_event_t *event)
+{
+  xcf_chrome_trace_t *trace = (xcf_chrome_trace_t *)user;
+  if(event->kind < XCF_TRACE_HEADER || event->kind > XCF_TRACE_CLOSE) return;
+
+  int tid = 0;
+#ifdef XCF_ENABLE_THREADS
+  pthread_mutex_lock(&trace->mutex);
+  const pthread_t self = pthread_self();
+  while(tid < trace->n_threads && !pthread_equal(trace->threads[tid], self)) tid++;
+  if(tid == trace->n_threads && tid < XCF_TRACE_MAX_THREADS)
+    trace->threads[trace->n_threads++] = self;
+#endif
+
+  // timestamps are in microseconds
+  const uint64_t ns = event->time_ns >= trace->start_ns ? event->time_ns - trace->start_ns : 0;
+  if(fprintf(trace->fd, "%s\n{\"name\":\"%s\",\"cat\":\"xcf\",\"ph\":\"%s\",\"ts\":%" PRIu64 ".%03u,\"pid\":1,"
+             "\"tid\":%d,\"args\":{\"index\":%" PRIu32 "}}",
+             trace->first ? "" : ",", xcf_trace_names[event->kind], event->begin ? "B" : "E", ns / 1000,
+             (unsigned int)(ns % 1000), tid, event->index) < 0)
+    trace->failed = 1;
+  trace->first = 0;
+
+#ifdef XCF_ENABLE_THREADS
+  pthread_mutex_unlock(&trace->mutex);
+#endif
+}
+
+int xcf_chrome_trace_close(xcf_chrome_trace_t *trace)
+{
+  if(!trace) return 1;
+
+  int res = !trace->failed;
+  if(fputs("\n]}\n", trace->fd) == EOF) res = 0;
+  if(fclose(trace->fd) != 0) res = 0;
+  if(!res) PRINT_ERROR("error: can't write the trace");
+#ifdef XCF_ENABLE_THREADS
+  pthread_mutex_destroy(&trace->mutex);
+#endif
+  xcf_free(trace);
+  return res;
+}